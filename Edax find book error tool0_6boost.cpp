@@ -1,1252 +1,7270 @@
-﻿#include <iostream>
-#include <fstream>
-#include <string>
-#include <tuple>
-#include <set>
-#include <stack>
-#include <chrono>
-#include <functional>
-#include <sstream>
-#include <iomanip>
-#include <algorithm>
-#include <cstdint>
-#include <unordered_map>
-#include <filesystem>
-#include <boost/interprocess/file_mapping.hpp>
-#include <boost/interprocess/mapped_region.hpp>
-#include <boost/unordered_map.hpp>
-#include <boost/container/vector.hpp>
-#include <boost/container/small_vector.hpp>
-
-
-// 各種構造体
-struct Link {
-    uint8_t move;
-    int8_t eval_link;
-    bool visited;
-};
-
-struct Leaf {
-    uint8_t move;
-    int8_t eval;
-    bool visited;
-};
-
-// ハッシュ関数 シンプルいずベスト
-struct PairHash {
-    std::size_t operator()(const std::pair<uint64_t, uint64_t>& p) const {
-        uint64_t combined = p.first + 0x9e3779b97f4a7c15ULL + (p.second << 12) + (p.second >> 4);
-        return std::hash<uint64_t>{}(combined);
-    }
-};
-
-// 等価比較演算子の定義
-struct PairEqual {
-    template <class T1, class T2>
-    bool operator()(const std::pair<T1, T2>& lhs, const std::pair<T1, T2>& rhs) const {
-        return lhs.first == rhs.first && lhs.second == rhs.second;
-    }
-};
-
-struct Position {
-    uint64_t my_stones = 0;
-    uint64_t opponent_stones = 0;
-    boost::container::small_vector<Link, 1> links;
-    Leaf leaf = { 0, 0, false };
-    int8_t eval_value = 0;
-};
-
-// unorderd map 本体
-using PositionMap = boost::unordered_map<std::pair<uint64_t, uint64_t>, Position, PairHash, PairEqual>;
-
-// グローバル変数の宣言と定義
-extern PositionMap book_positions;
-PositionMap book_positions;
-
-class PositionManager {
-public:
-    // ログレベル一覧
-    enum class LogLevel {
-        DEBUG,
-        INFO,
-        WARNING,
-        ERROR,
-        NONE
-    };
-
-    // 時間カウントとループ回数測定
-    std::chrono::steady_clock::time_point program_start_time;
-    size_t loop_count = 0;
-
-    // ポジションマネージャーの変数宣言部分
-    std::string book_path;
-    std::string debug_log_path;
-    Position current_position;
-    std::string current_kifu;
-    mutable LogLevel log_level;
-    bool auto_adjust_log_level;
-    LogLevel adjusted_log_level;
-
-    // 初期設定等
-    PositionManager(const std::string& book_path, const std::string& debug_log_path,
-        LogLevel level = LogLevel::ERROR,
-        bool auto_adjust = false,
-        LogLevel adjusted_level = LogLevel::INFO)
-        : book_path(book_path),
-        debug_log_path(debug_log_path),
-        current_position(),  // デフォルト初期化
-        current_kifu(""),
-        log_level(level),
-        auto_adjust_log_level(auto_adjust),
-        adjusted_log_level(adjusted_level) {
-        init_debug_log();
-    }
-
-    // デバッグログ出力関数本体
-    void debug_log(const std::string& message, LogLevel level, bool is_adjustment_message = false) {
-        if (level >= log_level) {
-            std::ofstream log_file(debug_log_path, std::ios_base::app | std::ios_base::binary);
-            if (log_file.is_open()) {
-                log_file << message << std::endl;
-
-                // WARNING 以上のレベルでログ出力された場合、ログレベルを自動調整
-                if (!is_adjustment_message && auto_adjust_log_level && level >= LogLevel::WARNING && log_level > adjusted_log_level) {
-                    LogLevel previous_level = log_level;
-                    log_level = adjusted_log_level;
-
-                    std::string warning_message = "Log level automatically adjusted from "
-                        + log_level_to_string(previous_level) + " to "
-                        + log_level_to_string(log_level);
-
-                    // 調整メッセージを直接書き込み、再帰呼び出しを避ける
-                    log_file << warning_message << std::endl;
-                }
-            }
-        }
-    }
-
-    // デバッグログ出力用
-private:
-    void init_debug_log() {
-        std::ofstream log_file(debug_log_path, std::ios_base::trunc | std::ios_base::binary);
-        if (log_file.is_open()) {
-            // UTF-8 BOMを書き込む
-            log_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
-            //時刻を記録
-            auto now = std::chrono::system_clock::now();
-            auto now_c = std::chrono::system_clock::to_time_t(now);
-            std::tm local_tm;
-            localtime_s(&local_tm, &now_c);
-
-            log_file << "[" << std::put_time(&local_tm, "%Y-%m-%d %H:%M:%S") << "] "
-                << "[" << log_level_to_string(log_level) << "]" << std::endl;
-        }
-    }
-
-private:
-    // const 修飾子を追加　デバッグ出力用
-    std::string log_level_to_string(LogLevel level) const {
-        switch (level) {
-        case LogLevel::ERROR: return "ERROR";
-        case LogLevel::WARNING: return "WARNING";
-        case LogLevel::INFO: return "INFO";
-        case LogLevel::DEBUG: return "DEBUG";
-        default: return "UNKNOWN";
-        }
-    }
-};
-
-// config.ini 読み込み関数を修正
-std::tuple<PositionManager::LogLevel, bool, PositionManager::LogLevel, int> read_config(const std::string& config_path) {
-    // 設定ファイルを開く
-    std::ifstream config_file(config_path);
-    std::string line;
-
-    // デフォルト値の設定
-    PositionManager::LogLevel log_level = PositionManager::LogLevel::ERROR;
-    bool auto_adjust = false;
-    PositionManager::LogLevel adjusted_level = PositionManager::LogLevel::INFO;
-    int mode = 4;  // デフォルトモードを4に設定
-
-    // ログレベルの文字列と列挙型のマッピング
-    std::unordered_map<std::string, PositionManager::LogLevel> log_level_map = {
-        {"DEBUG", PositionManager::LogLevel::DEBUG},
-        {"INFO", PositionManager::LogLevel::INFO},
-        {"WARNING", PositionManager::LogLevel::WARNING},
-        {"ERROR", PositionManager::LogLevel::ERROR},
-        {"NONE", PositionManager::LogLevel::NONE}
-    };
-
-    // 設定ファイルを1行ずつ読み込む
-    while (std::getline(config_file, line)) {
-        // ログレベルの設定を読み込む
-        if (line.substr(0, 9) == "log_level") {
-            size_t pos = line.find('=');
-            if (pos != std::string::npos) {
-                std::string level = line.substr(pos + 1);
-                level.erase(0, level.find_first_not_of(" \t"));
-                level.erase(level.find_last_not_of(" \t") + 1);
-                auto it = log_level_map.find(level);
-                if (it != log_level_map.end()) {
-                    log_level = it->second;
-                }
-            }
-        }
-        // 自動調整レベルの設定を読み込む
-        else if (line.substr(0, 18) == "auto_adjust_level=") {
-            std::string value = line.substr(18);
-            value.erase(0, value.find_first_not_of(" \t"));
-            value.erase(value.find_last_not_of(" \t") + 1);
-            std::transform(value.begin(), value.end(), value.begin(),
-                [](unsigned char c) { return std::tolower(c); });
-            auto_adjust = (value == "true");
-        }
-        // 調整後のログレベルの設定を読み込む
-        else if (line.substr(0, 15) == "adjusted_level=") {
-            std::string level = line.substr(15);
-            level.erase(0, level.find_first_not_of(" \t"));
-            level.erase(level.find_last_not_of(" \t") + 1);
-            auto it = log_level_map.find(level);
-            if (it != log_level_map.end()) {
-                adjusted_level = it->second;
-            }
-        }
-        // モードの設定を読み込む
-        else if (line.substr(0, 5) == "mode=") {
-            mode = std::stoi(line.substr(5));
-        }
-    }
-
-    // 返値: ログレベル、自動調整フラグ、調整後のログレベル、モードのタプル
-    return std::make_tuple(log_level, auto_adjust, adjusted_level, mode);
-}
-
-// move値の実際の実装が説明と異なる部分があるための修正用
-inline uint8_t rotate_move_180(uint8_t move) {
-    if (move >= 64) {
-        return move;
-    }
-    return 63 - move;
-}
-
-// unorderd_map用のハッシュ関数の衝突回数を調べる　ハッシュ領域が足りてないのでどんなハッシュ関数を用意しても衝突率33％はある
-size_t count_collisions(const PositionMap& map) {
-    boost::container::vector<size_t> bucket_sizes(map.bucket_count());
-    for (size_t i = 0; i < map.bucket_count(); ++i) {
-        bucket_sizes[i] = map.bucket_size(i);
-    }
-
-    size_t collisions = 0;
-    for (size_t size : bucket_sizes) {
-        if (size > 1) {
-            collisions += size - 1;
-        }
-    }
-    // 返値 衝突回数
-    return collisions;
-}
-
-// bookデータをbook posiitons unorderd mapへ全てぶち込む　いらないデータは捨てる
-void load_all_positions(const std::string& book_path, PositionManager& manager) {
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    // ファイルマッピングを作成
-    boost::interprocess::file_mapping file(book_path.c_str(), boost::interprocess::read_only);
-    boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
-
-    // マップされたリージョンの先頭ポインタを取得
-    const char* data = static_cast<const char*>(region.get_address());
-    std::size_t filesize = region.get_size();
-    manager.debug_log("File size: " + std::to_string(filesize) + " bytes", PositionManager::LogLevel::INFO);
-
-    // ポジション数を推定
-    constexpr double avg_position_size = 44.0720;
-    double estimated_positions_double = static_cast<double>(filesize) / avg_position_size;
-    size_t estimated_positions = static_cast<size_t>(estimated_positions_double);
-
-    // 負荷係数を考慮してバケット数を計算
-    size_t estimated_buckets = static_cast<size_t>(estimated_positions * 1.10);
-
-    // reserveの前にバケット数を出力　そしてreserve
-    manager.debug_log("Estimated number of buckets: " + std::to_string(estimated_buckets), PositionManager::LogLevel::DEBUG);
-    book_positions.reserve(estimated_buckets);
-
-    if (manager.log_level == PositionManager::LogLevel::DEBUG) {
-        manager.debug_log("Actual bucket count after reserve: " + std::to_string(book_positions.bucket_count()), PositionManager::LogLevel::DEBUG);
-        manager.debug_log("Estimated number of positions: " + std::to_string(estimated_positions), PositionManager::LogLevel::DEBUG);
-
-        // バケットのメモリ使用量（ポインタサイズ）
-        size_t bucket_memory = book_positions.bucket_count() * sizeof(void*);
-
-        // 要素のメモリ使用量
-        constexpr double bytes_per_position = 47.0;  // Position構造体の平均サイズ
-        double element_memory = estimated_positions * bytes_per_position;
-
-        // 合計推定メモリ使用量
-        double total_estimated_memory_mb = (bucket_memory + element_memory) / (1048576);
-        manager.debug_log("Estimated total memory usage: " + std::to_string(total_estimated_memory_mb) + " MB", PositionManager::LogLevel::DEBUG);
-    }
-
-    // ヘッダーをスキップ
-    const char* current = data + 42;
-
-    // 読み込み時間の測定
-    auto read_start_time = std::chrono::high_resolution_clock::now();
-
-    // 変数の初期化
-    size_t positions_loaded = 0;
-
-    while (current < data + filesize) {
-        uint64_t my_stones = *reinterpret_cast<const uint64_t*>(current);
-        current += sizeof(uint64_t);
-        uint64_t opponent_stones = *reinterpret_cast<const uint64_t*>(current);
-        current += sizeof(uint64_t);
-
-        current += 16;  // win, draw, lose, lineをスキップ
-
-        int16_t raw_value = *reinterpret_cast<const int16_t*>(current);
-        current += sizeof(int16_t);
-
-        current += 4;  // minvalue, maxvalueをスキップ
-
-        uint8_t numberline = *reinterpret_cast<const uint8_t*>(current);
-        current += sizeof(uint8_t);
-
-        current += 1;  // levelをスキップ
-
-        // 評価値が範囲外だった場合
-        if (raw_value < -127 || raw_value > 127) {
-            manager.debug_log("Error: Value out of int8_t range: " + std::to_string(raw_value), PositionManager::LogLevel::ERROR);
-            std::exit(1);
-        }
-        int8_t value = static_cast<int8_t>(raw_value);
-
-        // リンクとリーフの処理
-        boost::container::small_vector<Link, 1> links;
-        for (int i = 0; i < numberline; ++i) {
-            int8_t link_value = *reinterpret_cast<const int8_t*>(current);
-            current += sizeof(int8_t);
-            uint8_t link_move = *reinterpret_cast<const uint8_t*>(current);
-            current += sizeof(uint8_t);
-            links.emplace_back(rotate_move_180(link_move), link_value, false);
-        }
-
-        int8_t leaf_eval = *reinterpret_cast<const int8_t*>(current);
-        current += sizeof(int8_t);
-        uint8_t leaf_move = *reinterpret_cast<const uint8_t*>(current);
-        current += sizeof(uint8_t);
-
-        // ポジション構造体の作成
-        Position position = {
-            my_stones,
-            opponent_stones,
-            std::move(links),
-            {rotate_move_180(leaf_move), leaf_eval, false},
-            value
-        };
-
-        book_positions.emplace(std::make_pair(my_stones, opponent_stones), std::move(position));
-        positions_loaded++;
-
-        // 10万ポジションごとに進捗を表示
-        if (positions_loaded % 100000 == 0) {
-            std::cout << "\r" << positions_loaded << " Loading Completed" << std::flush;
-        }
-    }
-
-    // 最終的な読み込み数を表示
-    std::cout << "\r" << positions_loaded << " Loading Completed" << std::endl;
-
-    // 読み込み時間測定終了
-    auto read_end_time = std::chrono::high_resolution_clock::now();
-    auto read_duration = std::chrono::duration_cast<std::chrono::milliseconds>(read_end_time - read_start_time);
-
-    manager.debug_log("Actual number of positions loaded: " + std::to_string(positions_loaded), PositionManager::LogLevel::INFO);
-
-    if (manager.log_level == PositionManager::LogLevel::DEBUG) {
-        // unordered_mapのメモリ使用量を推定
-        size_t bucket_memory_actual = book_positions.bucket_count() * sizeof(void*);
-
-        // ノードサイズの計算（small_vectorのサイズを除外）
-        size_t node_size = sizeof(std::pair<const std::pair<uint64_t, uint64_t>, Position>) - sizeof(boost::container::small_vector<Link, 1>);
-        size_t aligned_node_size = (node_size + 15) & ~15;  // 16バイトアラインメント
-
-        // ノードのメモリ（small_vectorを除く）
-        size_t nodes_memory = aligned_node_size * book_positions.size();
-
-        // linksのメモリ使用量を推定（small_vectorオブジェクト自体のサイズを含む）
-        size_t total_links_memory = 0;
-        size_t small_vector_size = sizeof(boost::container::small_vector<Link, 1>);
-        for (const auto& pair : book_positions) {
-            const Position& pos = pair.second;
-            size_t links_memory = small_vector_size + (pos.links.capacity() * sizeof(Link));
-            total_links_memory += links_memory;
-        }
-
-        // 総メモリ使用量
-        size_t total_memory = bucket_memory_actual + nodes_memory + total_links_memory;
-
-        // メモリ使用量をデバッグログに出力
-        std::stringstream ss;
-        ss << "Estimated memory usage of book_positions:"
-            << "\n  Bucket memory: " << bucket_memory_actual << " bytes"
-            << "\n  Node size (excluding small_vector): " << node_size << " bytes (aligned to " << aligned_node_size << " bytes)"
-            << "\n  Nodes memory: " << nodes_memory << " bytes"
-            << "\n  Links memory (including small_vector objects): " << total_links_memory << " bytes"
-            << "\n  Total memory: " << total_memory << " bytes"
-            << "\n  Total memory (MB): " << (total_memory / (1024.0 * 1024.0)) << " MB";
-        manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
-
-        // Position構造体のサイズを出力
-        ss.str("");
-        ss << "Size of structures:"
-            << "\n  Position: " << sizeof(Position) << " bytes"
-            << "\n  Link: " << sizeof(Link) << " bytes"
-            << "\n  Leaf: " << sizeof(Leaf) << " bytes"
-            << "\n  boost::container::small_vector<Link, 1>: " << sizeof(boost::container::small_vector<Link, 1>) << " bytes";
-        manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
-
-        // ハッシュ関数の衝突回数の測定
-        size_t collisions = count_collisions(book_positions);
-        manager.debug_log("Number of hash collisions: " + std::to_string(collisions), PositionManager::LogLevel::DEBUG);
-        manager.debug_log("Collision rate: " + std::to_string(static_cast<double>(collisions) / positions_loaded), PositionManager::LogLevel::DEBUG);
-    }
-
-    // ファイル読み込み時間の測定
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto total_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-
-    manager.debug_log("File I/O time: " + std::to_string(read_duration.count()) + " ms", PositionManager::LogLevel::INFO);
-    manager.debug_log("Total load time: " + std::to_string(total_duration.count()) + " ms", PositionManager::LogLevel::INFO);
-}
-
-// デバッグログの整地
-std::string format_position(const Position& position) {
-    std::stringstream ss;
-    ss << "my_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << position.my_stones
-        << ", opponent_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << position.opponent_stones
-        << ", eval_value: " << std::dec << static_cast<int>(position.eval_value)
-        << "\nLinks: ";
-    for (const auto& link : position.links) {
-        ss << "{move: " << static_cast<int>(link.move)
-            << ", eval_link: " << static_cast<int>(link.eval_link)
-            << ", visited: " << (link.visited ? "True" : "False") << "} ";
-    }
-    ss << "\nLeaf: {move: " << static_cast<int>(position.leaf.move)
-        << ", eval: " << static_cast<int>(position.leaf.eval)
-        << ", visited: " << (position.leaf.visited ? "True" : "False") << "}";
-
-    // 返値: 盤面の状態を表す文字列
-    return ss.str();
-}
-
-// 各関数の宣言
-std::tuple<Position, std::string, std::string, uint8_t> get_children(PositionManager& manager, Position& position);
-std::tuple<Position, std::string, std::string> process_position(Position& position, const std::string& kifu, uint8_t move, PositionManager& manager);
-std::tuple<Position, std::string> create_position_data(PositionManager& manager, int move = -1);
-std::tuple<std::string, std::string> convert_move_to_str(int move, const std::string& kifu, PositionManager& manager);
-Position flip_stones(const Position& position, const std::string& move_str);
-uint64_t shift(uint64_t b, int dir);
-std::tuple<std::tuple<uint64_t, uint64_t>, std::string> normalize_position(uint64_t my_stones, uint64_t opponent_stones, PositionManager& manager);
-int denormalize_move(int move, const std::string& transformation_name, PositionManager& manager);
-int rotate_move_90(int move);
-int rotate_move_270(int move);
-int flip_move_vertical(int move);
-int flip_move_horizontal(int move);
-int flip_move_diag_a1h8(int move);
-int flip_move_diag_a8h1(int move);
-int normalize_move(int move, const std::string& transformation_name, PositionManager& manager);
-const Position* read_position(uint64_t my_stones, uint64_t opponent_stones);
-void mismatch_process(const Position& child_position, const std::string& kifu, const std::string& transformation_name, const std::string& output_path, PositionManager& manager, int8_t child_eval, int8_t parent_eval, int mode);
-int8_t calculate_parent_eval(const Position& parent_position, uint8_t move, PositionManager& manager);
-void main_process_recursive(Position& current_position, std::string current_kifu, const std::string& output_path, PositionManager& manager, int mode);
-
-// 親ポジションのリンクやリーフのうち最良のものの評価値を取得する関数
-inline int8_t calculate_parent_eval(const Position& parent_position, uint8_t move, PositionManager& manager) {
-    int8_t parent_eval = -64;// -64で初期化
-
-    // 親ポジションの該当するリンクの評価値を検索
-    for (const auto& link : parent_position.links) {
-        if (link.move == move) {
-            parent_eval = link.eval_link;
-            return parent_eval;
-        }
-    }
-
-    // リーフの評価値から取得した場合、INFOレベルのデバッグログを出力
-    if (parent_position.leaf.move == move) {
-        parent_eval = parent_position.leaf.eval;
-        manager.debug_log("Found matching leaf - move: " + std::to_string(static_cast<int>(move)) +
-            ", parent_eval: " + std::to_string(static_cast<int>(parent_eval)), PositionManager::LogLevel::INFO);
-    }
-
-    // 返値 親の評価値
-    return parent_eval;
-}
-
-// ミスマッチ判定のための関数
-bool judge_mismatch(const Position& child_position, const Position& parent_position, uint8_t move, int mode, PositionManager& manager) {
-    int8_t child_eval = child_position.eval_value;
-    bool mismatch = false;
-    std::string comparison_details;
-
-    if (mode == 3) {
-        // Mode 3: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションの評価値の反転を比較
-        int8_t parent_eval = calculate_parent_eval(parent_position, move, manager);
-        mismatch = parent_eval != -child_eval;
-        comparison_details = "Mode 3: parent_eval (" + std::to_string(parent_eval) +
-            ") vs -child_eval (" + std::to_string(-child_eval) + ")";
-    }
-    else {
-        // リンクの最大評価値を計算（リーフを除く）
-        int8_t max_child_link_eval = -64; // -64で初期化
-        for (const auto& link : child_position.links) {
-            if (link.eval_link > max_child_link_eval) {
-                max_child_link_eval = link.eval_link;
-            }
-        }
-
-        switch (mode) {
-        case 1: {
-            // Mode 1: リンクが存在し、子ポジションのリーフの評価値がリンクの最大評価値より大きい場合に不一致
-            if (!child_position.links.empty()) {
-                mismatch = child_position.leaf.eval > max_child_link_eval;
-                comparison_details = "Mode 1: leaf_eval (" + std::to_string(child_position.leaf.eval) +
-                    ") vs max_child_link_eval (" + std::to_string(max_child_link_eval) + ")";
-            }
-            else {
-                // リンクが存在しない場合は不一致としない
-                mismatch = false;
-                comparison_details = "Mode 1: No links present, skipping mismatch check";
-            }
-            break;
-        }
-        case 2:
-        case 4: {
-            // Mode 2と4用のmax_child_move_evalを計算
-            int8_t max_child_move_eval = max_child_link_eval;  // max_child_link_evalで初期化
-            if (child_position.leaf.eval > max_child_move_eval) {
-                max_child_move_eval = child_position.leaf.eval;
-            }
-
-            if (mode == 2) {
-                // Mode 2: 子ポジションの評価値と最大評価値を比較
-                mismatch = child_eval != max_child_move_eval;
-                comparison_details = "Mode 2: child_eval (" + std::to_string(child_eval) +
-                    ") vs max_child_move_eval (" + std::to_string(max_child_move_eval) + ")";
-            }
-            else { // mode == 4
-                // Mode 4: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションのリンクやリーフの内の最大評価値の反転を比較
-                int8_t parent_eval = calculate_parent_eval(parent_position, move, manager);
-                mismatch = parent_eval != -max_child_move_eval;
-                comparison_details = "Mode 4: parent_eval (" + std::to_string(parent_eval) +
-                    ") vs -max_child_move_eval (" + std::to_string(-max_child_move_eval) + ")";
-            }
-            break;
-        }
-        }
-    }
-
-    if (mismatch) {
-        manager.debug_log("Mismatch detected: " + comparison_details, PositionManager::LogLevel::DEBUG);
-    }
-    else {
-        manager.debug_log("No mismatch: " + comparison_details, PositionManager::LogLevel::DEBUG);
-    }
-
-    return mismatch;
-}
-
-// 不一致発見の場合の処理
-void mismatch_process(const Position& child_position, const std::string& kifu, const std::string& transformation_name, const std::string& output_path, PositionManager& manager, int8_t child_eval, int8_t parent_eval, int mode) {
-
-    // 出力ファイルを開く
-    std::ofstream output_file(output_path, std::ios::app | std::ios::binary);
-    if (!output_file.is_open()) {
-        manager.debug_log("Failed to open or create output file: " + output_path, PositionManager::LogLevel::ERROR);
-        return;
-    }
-
-    // ファイルが新規作成された場合、BOMを書き込む
-    output_file.seekp(0, std::ios::end);
-    if (output_file.tellp() == 0) {
-        output_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
-    }
-
-    if (mode == 1) {
-        // Mode 1: 子ポジションのリーフまでの棋譜を出力
-        std::string move_str, updated_kifu;
-        std::tie(move_str, updated_kifu) = convert_move_to_str(child_position.leaf.move, kifu, manager);
-        output_file << updated_kifu << std::endl;
-        manager.debug_log("Mismatch found (Mode 1, leaf move). Kifu: " + updated_kifu + " (Move: " + std::to_string(child_position.leaf.move) + ")", PositionManager::LogLevel::DEBUG);
-    }
-    else {
-        // max_child_move_evalの再計算
-        int8_t max_child_move_eval = INT8_MIN;
-        for (const auto& link : child_position.links) {
-            if (link.eval_link > max_child_move_eval) {
-                max_child_move_eval = link.eval_link;
-            }
-        }
-        if (child_position.leaf.eval > max_child_move_eval) {
-            max_child_move_eval = child_position.leaf.eval;
-        }
-
-        bool is_greater = false;
-        int8_t comparison_value;
-
-        // モードに応じて不一致の条件と比較値を設定
-        switch (mode) {
-        case 2:
-            // Mode 2: 子ポジションの評価値と最大評価値を比較
-            is_greater = max_child_move_eval > child_eval;
-            comparison_value = -child_eval;
-            break;
-        case 3:
-            // Mode 3: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションの評価値の反転を比較
-            is_greater = -child_eval > parent_eval;
-            comparison_value = -parent_eval;
-            break;
-        case 4:
-            // Mode 4: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションのリンクやリーフの内の最大評価値の反転を比較
-            is_greater = -max_child_move_eval > parent_eval;
-            comparison_value = -parent_eval;
-            break;
-        }
-
-        if (is_greater) {
-            // 分岐その1: 条件を満たす全ての子ポジションのリンクやリーフを出力
-            for (const auto& link : child_position.links) {
-                if (link.eval_link > comparison_value) {
-                    std::string move_str, updated_kifu;
-                    std::tie(move_str, updated_kifu) = convert_move_to_str(link.move, kifu, manager);
-                    output_file << updated_kifu << std::endl;
-                    manager.debug_log("Mismatch found (multiple moves). Kifu: " + updated_kifu + " (Move: " + std::to_string(link.move) + ")", PositionManager::LogLevel::DEBUG);
-                }
-            }
-            if (child_position.leaf.eval > comparison_value) {
-                std::string move_str, updated_kifu;
-                std::tie(move_str, updated_kifu) = convert_move_to_str(child_position.leaf.move, kifu, manager);
-                output_file << updated_kifu << std::endl;
-                manager.debug_log("Mismatch found (leaf move). Kifu: " + updated_kifu + " (Move: " + std::to_string(child_position.leaf.move) + ")", PositionManager::LogLevel::DEBUG);
-            }
-        }
-        else {
-            // 分岐その2: 判定に使った子ポジションの手までの棋譜を出力
-            uint8_t max_child_move = 0;
-            for (const auto& link : child_position.links) {
-                if (link.eval_link == max_child_move_eval) {
-                    max_child_move = link.move;
-                    break;
-                }
-            }
-            if (child_position.leaf.eval == max_child_move_eval) {
-                max_child_move = child_position.leaf.move;
-                manager.debug_log("Leaf evaluation used for max_child_move_eval", PositionManager::LogLevel::INFO);
-            }
-
-            std::string move_str, updated_kifu;
-            std::tie(move_str, updated_kifu) = convert_move_to_str(max_child_move, kifu, manager);
-            output_file << updated_kifu << std::endl;
-            manager.debug_log("Mismatch found (single move). Kifu: " + updated_kifu + " (Move: " + std::to_string(max_child_move) + ")", PositionManager::LogLevel::DEBUG);
-        }
-    }
-}
-
-void main_process_recursive(Position& current_position, std::string current_kifu, const std::string& output_path, PositionManager& manager, int mode){
-    // ループカウンターをインクリメント
-    manager.loop_count++;
-
-    // ループごとにコマンドラインの表示を更新（表示頻度を調整可能）
-    if (manager.loop_count == 1 || manager.loop_count % 100000 == 0) {
-        std::cout << "\r" << manager.loop_count << " Links or Leaf processed" << std::flush;
-    }
-
-    // 子positionを得る
-    Position child_position;
-    std::string new_kifu, transformation_name;
-    uint8_t move;
-    while (true){
-        manager.current_position = current_position;
-        manager.current_kifu = current_kifu;
-        manager.debug_log("Current position: " + format_position(current_position), PositionManager::LogLevel::DEBUG);
-        manager.debug_log("Current kifu: " + current_kifu, PositionManager::LogLevel::DEBUG);
-
-        std::tie(child_position, new_kifu, transformation_name, move) = get_children(manager, current_position);
-
-        // この条件を満たしたらこのmain_process_recursiveの処理を終わり一つ上のmain_process_recursiveへ移動
-        if (transformation_name == "child_not_found") {
-            manager.debug_log("Child position not found. Ending current branch.", PositionManager::LogLevel::DEBUG);
-            break;
-        }
-            
-        // 比較関数と不一致の場合出力をする関数を呼び出し
-        else {
-            if (new_kifu.length() >= 4 && new_kifu.substr(new_kifu.length() - 4) == "Pass") {
-                new_kifu.resize(new_kifu.length() - 4);
-                manager.debug_log("Pass detected and removed from new_kifu, updated kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
-            }
-            
-            bool mismatch = judge_mismatch(child_position, current_position, move, mode, manager);
-            if (mismatch) {
-                mismatch_process(child_position, new_kifu, transformation_name, output_path, manager,
-                    child_position.eval_value, current_position.eval_value, mode);
-            }
-
-            // 親ポジションを更新
-            manager.current_position = child_position;
-            manager.current_kifu = new_kifu;
-
-            // 先頭へ戻る (子positionで同じ処理を行う)
-            main_process_recursive(child_position, new_kifu, output_path, manager, mode);
-        }
-    }
-}
-
-// メイン関数　本来スタック管理と不一致の発見は関数を分けるべきなんだろうけれども　最初の部分は開始処理
-void main_process(const std::string& output_path, PositionManager& manager, int mode) {
-    try {
-        // プログラム全体の実行時間の測定
-        manager.program_start_time = std::chrono::steady_clock::now();
-
-        // 初期局面をbookから読み取る
-        const Position* initial_book_position = read_position(0x0000000810000000ULL, 0x0000001008000000ULL);
-        if (!initial_book_position) {
-            manager.debug_log("Initial position not found in book. Terminating program.", PositionManager::LogLevel::ERROR);
-            std::exit(1);
-        }
-
-        // 初期局面を設定
-        manager.current_position = *initial_book_position;
-        manager.current_kifu = "";
-
-        // メイン処理 (再帰的に実装)
-        main_process_recursive(manager.current_position, manager.current_kifu, output_path, manager, mode);
-    }
-    // エラー処理が起動される日は来るのだろうか
-    catch (const std::exception& e) {
-        manager.debug_log("Exception in main_process: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
-        std::cerr << "Critical error in main_process: " << e.what() << std::endl;
-        std::exit(1);// プログラムを終了
-    }
-
-    // 最終ループ数を出力、デバッグログにも最終ループ数を記録
-    std::cout << "\r" << manager.loop_count << " Links or Leaf processed (Final)" << std::endl;
-    manager.debug_log("Total Links or Leaf processed: " + std::to_string(manager.loop_count), PositionManager::LogLevel::WARNING);
-
-    // プログラム全体の実行時間を計算して実行時間をログに出力、コンソールにも実行時間を出力
-    auto program_end_time = std::chrono::steady_clock::now();
-    std::chrono::duration<double> program_duration = program_end_time - manager.program_start_time;
-    manager.debug_log("Total program execution time: " + std::to_string(program_duration.count()) + " seconds", PositionManager::LogLevel::WARNING);
-    std::cout << "Total program execution time: " << program_duration.count() << " seconds" << std::endl;
-}
-
-std::tuple<Position, std::string, std::string, uint8_t> get_children(PositionManager& manager, Position& position) {
-    try {
-
-        // リンクの処理
-        for (auto& link : position.links) {
-            if (!link.visited) {
-                link.visited = true;  // リンクを訪問済みにマーク
-                manager.debug_log("Unvisited link found: Move=" + std::to_string(link.move) + ", Eval=" + std::to_string(link.eval_link) + ", Visited: False", PositionManager::LogLevel::DEBUG);
-                auto [child_position, new_kifu, transformation] = process_position(position, manager.current_kifu, link.move, manager);
-                if (transformation != "child_not_found") {
-                    // 返値: 子ポジション、新しい棋譜、変換名、リンクの手の値のタプル
-                    return std::make_tuple(child_position, new_kifu, transformation, link.move);
-                }
-            }
-        }
-
-        // リーフの処理
-        if (!(position.leaf.move == 0 && position.leaf.eval == 0 && !position.leaf.visited) && position.leaf.move != 65) {
-            if (!position.leaf.visited) {
-                position.leaf.visited = true;  // リーフを訪問済みにマーク
-                manager.debug_log("Unvisited leaf found: Move=" + std::to_string(position.leaf.move) + ", Eval=" + std::to_string(position.leaf.eval) + ", Visited: False", PositionManager::LogLevel::DEBUG);
-                auto [child_position, new_kifu, transformation] = process_position(position, manager.current_kifu, position.leaf.move, manager);
-                if (transformation != "child_not_found") {
-                    // 返値: 子ポジション、新しい棋譜、変換名、リーフの手の値のタプル
-                    return std::make_tuple(child_position, new_kifu, transformation, position.leaf.move);
-                }
-            }
-        }
-        // move値が65 noneの場合は処理をスキップしてデバッグ出力のみ
-        else if (position.leaf.move == 65) {
-            manager.debug_log("Leaf with move value 65 encountered. Skipping processing.", PositionManager::LogLevel::DEBUG);
-        }
-        // 返値: 空のポジション、現在の棋譜、"child_not_found"文字列、0のタプル（探索終了を指示）
-        return std::make_tuple(Position(), manager.current_kifu, "child_not_found", static_cast<uint8_t>(0));
-    }
-    catch (const std::exception& e) {
-        manager.debug_log("Critical error in get_children: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
-        std::cerr << "Critical error: " << e.what() << std::endl;
-        std::exit(1);  // プログラムを終了
-    }
-}
-
-std::tuple<Position, std::string, std::string> process_position(Position& position, const std::string& kifu, uint8_t move, PositionManager& manager) {
-
-    // 子ポジションを生成し、一時変数に保存する
-    Position original_child_position;
-    std::string new_kifu;
-    std::tie(original_child_position, new_kifu) = create_position_data(manager, move);
-    manager.debug_log("Generated original child position: " + format_position(original_child_position), PositionManager::LogLevel::DEBUG);
-    manager.debug_log("New kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
-
-    // 親ポジションの正規化とフラグ更新を行う
-    auto [normalized_parent, parent_transformation] = normalize_position(position.my_stones, position.opponent_stones, manager);
-    auto normalized_parent_key = std::make_pair(std::get<0>(normalized_parent), std::get<1>(normalized_parent));
-
-    // 正規化された親ポジションをread_positionを使用して取得
-    const Position* normalized_parent_position = read_position(std::get<0>(normalized_parent), std::get<1>(normalized_parent));
-    //　万一見つからなかった場合のエラー処理
-    if (!normalized_parent_position) {
-        manager.debug_log("Critical error: Parent position not found in book", PositionManager::LogLevel::ERROR);
-        std::cerr << "Critical error: Parent position not found in book. Terminating program." << std::endl;
-        std::exit(1);  // プログラムを終了
-    }
-    manager.debug_log("Book position retrieved: " + format_position(*normalized_parent_position), PositionManager::LogLevel::DEBUG);
-
-    // 正規化された親ポジションの該当する手のVisitedフラグを直接更新 直接更新したいのでconstが付いているread_position関数は使えない
-    uint8_t normalized_move = normalize_move(move, parent_transformation, manager);
-    auto it = book_positions.find(normalized_parent_key);
-    if (it != book_positions.end()) {
-        Position& book_position = it->second;
-        bool updated = false;
-        for (Link& link : book_position.links) {
-            if (link.move == normalized_move) {
-                link.visited = true;
-                manager.debug_log("Parent link visited flag updated: move=" + std::to_string(normalized_move) + ", visited=True", PositionManager::LogLevel::DEBUG);
-                updated = true;
-                break;
-            }
-        }
-        // リーフも同様に処理
-        if (!updated && book_position.leaf.move == normalized_move) {
-            book_position.leaf.visited = true;
-            manager.debug_log("Parent leaf visited flag updated: move=" + std::to_string(normalized_move) + ", visited=True", PositionManager::LogLevel::DEBUG);
-            updated = true;
-        }
-            // 更新された正規化親ポジションをbook_positionに直接保存
-        if (updated) {
-            manager.debug_log("Updated parent book position: " + format_position(book_position), PositionManager::LogLevel::DEBUG);
-        }
-    }
-
-    // 子ポジションを正規化し、bookと照合する
-    std::tuple<uint64_t, uint64_t> normalized_child_position;
-    std::string transformation;
-    std::tie(normalized_child_position, transformation) = normalize_position(original_child_position.my_stones, original_child_position.opponent_stones, manager);
-
-    uint64_t normalized_child_my_stones = std::get<0>(normalized_child_position);
-    uint64_t normalized_child_opponent_stones = std::get<1>(normalized_child_position);
-
-    const Position* book_child_position = read_position(normalized_child_my_stones, normalized_child_opponent_stones);
-
-    if (book_child_position) {
-        manager.debug_log("Child position found in book: " + format_position(*book_child_position), PositionManager::LogLevel::DEBUG);
-
-        // bookから得られた情報を使って、正規化前の子ポジションを更新する
-        original_child_position.links = book_child_position->links;
-        original_child_position.leaf = book_child_position->leaf;
-        original_child_position.eval_value = book_child_position->eval_value;
-
-        // move値を正規化前の状態に戻す
-        for (auto& link : original_child_position.links) {
-            link.move = denormalize_move(link.move, transformation, manager);
-        }
-        original_child_position.leaf.move = denormalize_move(original_child_position.leaf.move, transformation, manager);
-
-        manager.debug_log("Final denormalized child position: " + format_position(original_child_position), PositionManager::LogLevel::DEBUG);
-
-        // 返値: 正規化前の子ポジション、新しい棋譜、変換名のタプル
-        return std::make_tuple(original_child_position, new_kifu, transformation);
-    }
-    else {
-        std::stringstream ss2;
-        ss2 << "Child position not found in book: (my_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << normalized_child_my_stones
-            << ", opponent_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << normalized_child_opponent_stones << ")";
-        manager.debug_log(ss2.str(), PositionManager::LogLevel::DEBUG);
-
-        // 返値: 空のポジション、新しい棋譜、"child_not_found"文字列のタプル（子ポジションがbookに見つからなかったことを示す）
-        return std::make_tuple(Position(), new_kifu, "child_not_found");
-    }
-}
-// moveの例外処理と関数二つの呼び出し
-std::tuple<Position, std::string> create_position_data(PositionManager& manager, int move) {
-    std::string move_str, new_kifu;
-
-    if (move == 64) {  // パス
-        move_str = "Pass";
-        new_kifu = manager.current_kifu + move_str;
-        manager.debug_log("Pass move detected. New kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
-
-        // パスの場合はflip_stonesと同様の処理を行うが、石の反転は行わない
-        Position child_position;
-        child_position.my_stones = manager.current_position.opponent_stones;
-        child_position.opponent_stones = manager.current_position.my_stones;
-        child_position.eval_value = -manager.current_position.eval_value;  // 評価値を反転
-
-        // 返値: 新しいポジション、更新された棋譜のタプル
-        return std::make_tuple(child_position, new_kifu);
-    }
-    // ここに65が来ることはあり得ないはず
-    else if (move == 65) {  // 無効な手
-        move_str = "None";
-        new_kifu = manager.current_kifu + move_str;
-        manager.debug_log("Invalid move (None) detected. Terminating program. New kifu: " + new_kifu, PositionManager::LogLevel::ERROR);
-        // プログラムを終了
-        std::exit(1);
-    }
-    // 二つの関数を呼び出して子ポジションを実際に作るところ
-    std::tie(move_str, new_kifu) = convert_move_to_str(move, manager.current_kifu, manager);
-
-    Position child_position = flip_stones(manager.current_position, move_str);
-    child_position.links.clear();
-
-    // 返値: 手を表す文字列、更新された棋譜のタプル
-    return std::make_tuple(child_position, new_kifu);
-}
-// moveを棋譜に変換する
-std::tuple<std::string, std::string> convert_move_to_str(int move, const std::string& kifu, PositionManager& manager) {
-    char col = 'a' + (move % 8);
-    int row = (move / 8) + 1;
-    std::string move_str = std::string(1, col) + std::to_string(row);
-
-    // 棋譜を更新
-    std::string previous_kifu = kifu.empty() ? manager.current_kifu : kifu;
-    std::string new_kifu = previous_kifu + move_str;
-    manager.debug_log("Updated kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
-
-    manager.current_kifu = new_kifu;
-    return std::make_tuple(move_str, new_kifu);
-}
-
-// グローバル変数として定義
-constexpr uint64_t direction_mask[8] = {
-    0xfefefefefefefefe, 0x7f7f7f7f7f7f7f7f,
-    0xffffffffffffffff, 0xffffffffffffffff,
-    0x7f7f7f7f7f7f7f7f, 0xfefefefefefefefe,
-    0xfefefefefefefefe, 0x7f7f7f7f7f7f7f7f
-};
-// ビットシフト
-inline uint64_t shift(uint64_t b, int dir) {
-    switch (dir) {
-    case 0: return (b << 1) & direction_mask[0];
-    case 1: return (b >> 1) & direction_mask[1];
-    case 2: return b << 8;
-    case 3: return b >> 8;
-    case 4: return (b << 7) & direction_mask[4];
-    case 5: return (b >> 7) & direction_mask[5];
-    case 6: return (b << 9) & direction_mask[6];
-    case 7: return (b >> 9) & direction_mask[7];
-    default: return 0;
-    }
-}
-//　1方向ひっくり返し
-inline uint64_t flip_line(uint64_t player, uint64_t opponent, int dir, uint64_t move) {
-    uint64_t mask = shift(move, dir) & opponent;
-    mask |= shift(mask, dir) & opponent;
-    mask |= shift(mask, dir) & opponent;
-    mask |= shift(mask, dir) & opponent;
-    mask |= shift(mask, dir) & opponent;
-    mask |= shift(mask, dir) & opponent;
-    uint64_t outflank = shift(mask, dir) & player;
-    return outflank ? mask : 0;
-}
-//　全方向ひっくり返し
-inline uint64_t flip_all_directions(uint64_t player, uint64_t opponent, uint64_t move) {
-    return flip_line(player, opponent, 0, move) |
-        flip_line(player, opponent, 1, move) |
-        flip_line(player, opponent, 2, move) |
-        flip_line(player, opponent, 3, move) |
-        flip_line(player, opponent, 4, move) |
-        flip_line(player, opponent, 5, move) |
-        flip_line(player, opponent, 6, move) |
-        flip_line(player, opponent, 7, move);
-}
-//　ひっくり返し関数本体
-Position flip_stones(const Position& position, const std::string& move_str) {
-    uint64_t my_stones = position.my_stones;
-    uint64_t opponent_stones = position.opponent_stones;
-
-    // 打つ手の変換
-    int move_index = ((8 * (8 - (move_str[1] - '0'))) + (7 - static_cast<int>(move_str[0]) + 'a'));
-    uint64_t move = 1ULL << move_index;
-
-    // 石のひっくり返し
-    uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move);
-    my_stones |= move | flipped;
-    opponent_stones ^= flipped;
-
-    // 返値: 石を裏返した後の新しいポジション
-    return Position{ opponent_stones, my_stones, {}, {0, 0, false}, static_cast<int8_t>(-position.eval_value) };
-}
-
-//　デルタ関数　これが早いらしい
-template<uint64_t Mask, int Delta>
-constexpr uint64_t delta_swap(uint64_t x) {
-    uint64_t t = (x ^ (x >> Delta)) & Mask;
-    return x ^ t ^ (t << Delta);
-}
-//　コンパイル時に処理してくれて早くなるらしい
-constexpr uint64_t flip_horizontal(uint64_t x) {
-    return delta_swap<0x5555555555555555ULL, 1>(
-        delta_swap<0x3333333333333333ULL, 2>(
-            delta_swap<0x0F0F0F0F0F0F0F0FULL, 4>(x)
-        )
-    );
-}
-
-constexpr uint64_t flip_vertical(uint64_t x) {
-    return delta_swap<0x00000000FFFFFFFFULL, 32>(
-        delta_swap<0x0000FFFF0000FFFFULL, 16>(
-            delta_swap<0x00FF00FF00FF00FFULL, 8>(x)
-        )
-    );
-}
-
-constexpr uint64_t flip_diag_a1h8(uint64_t x) {
-    return delta_swap<0x00000000F0F0F0F0ULL, 28>(
-        delta_swap<0x0000CCCC0000CCCCULL, 14>(
-            delta_swap<0x00AA00AA00AA00AAULL, 7>(x)
-        )
-    );
-}
-
-constexpr uint64_t flip_diag_a8h1(uint64_t x) {
-    return delta_swap<0x000000000F0F0F0FULL, 36>(
-        delta_swap<0x0000333300003333ULL, 18>(
-            delta_swap<0x0055005500550055ULL, 9>(x)
-        )
-    );
-}
-
-constexpr uint64_t rotate_90(uint64_t x) {
-    return flip_horizontal(flip_diag_a1h8(x));
-}
-
-constexpr uint64_t rotate_270(uint64_t x) {
-    return flip_vertical(flip_diag_a1h8(x));
-}
-
-constexpr uint64_t rotate_180(uint64_t x) {
-    return flip_vertical(flip_horizontal(x));
-}
-
-//　正規化とはこれのこと　これのせいで散々苦労したその1
-std::tuple<std::tuple<uint64_t, uint64_t>, std::string> normalize_position(uint64_t my_stones, uint64_t opponent_stones, PositionManager& manager) {
-    std::tuple<uint64_t, uint64_t> min_value = std::make_tuple(my_stones, opponent_stones);
-    std::string min_transformation = "identity";
-
-    //　変換用辞書
-    const std::unordered_map<std::string, std::function<uint64_t(uint64_t)>> transformations = {
-        {"rotate_90", rotate_90},
-        {"rotate_180", rotate_180},
-        {"rotate_270", rotate_270},
-        {"flip_vertical", flip_vertical},
-        {"flip_horizontal", flip_horizontal},
-        {"flip_diag_a1h8", flip_diag_a1h8},
-        {"flip_diag_a8h1", flip_diag_a8h1}
-    };
-
-    //　最小の64bit値を出す変換がどれか調べて最小値への変換を採用
-    for (const auto& [name, transform] : transformations) {
-        uint64_t transformed_my_stones = transform(my_stones);
-        uint64_t transformed_opponent_stones = transform(opponent_stones);
-        if (std::make_tuple(transformed_my_stones, transformed_opponent_stones) < min_value) {
-            min_value = std::make_tuple(transformed_my_stones, transformed_opponent_stones);
-            min_transformation = name;
-        }
-    }
-
-    //　デバッグログを出力するのに整形処理がいる
-    std::stringstream ss;
-    ss << "Final min transformation: " << min_transformation
-        << ", min_value: (my_stones=0x" << std::hex << std::setw(16) << std::setfill('0') << std::get<0>(min_value)
-        << ", opponent_stones=0x" << std::hex << std::setw(16) << std::setfill('0') << std::get<1>(min_value) << ")";
-    manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
-
-    // 返値: 正規化された盤面（自分の石、相手の石のタプル）と変換名のタプル
-    return std::make_tuple(min_value, min_transformation);
-}
-
-//　move値の正規化処理　結局必要になってしまった ここにpassがいくことはある　noneはないはずなのでエラー出力して落とそう
-int normalize_move(int move, const std::string& transformation_name, PositionManager& manager) {
-    manager.debug_log("Normalizing move: " + std::to_string(move) + ", using transformation: " + transformation_name, PositionManager::LogLevel::DEBUG);
-
-    if (move == 64) {  // パス
-        manager.debug_log("At normalize move is a pass, returning move unchanged.", PositionManager::LogLevel::DEBUG);
-        return move;
-    }
-    else if (move == 65) {  // 無効な手
-        manager.debug_log("Invalid move (None) detected. Terminating program.", PositionManager::LogLevel::ERROR);
-        std::exit(1);  // プログラムを終了
-    }
-    //　かたくなにunorderd mapしか使わない
-    const std::unordered_map<std::string, std::function<int(int)>> transformations = {
-        {"identity", [](int x) { return x; }},
-        {"rotate_90", rotate_move_90},
-        {"rotate_180", rotate_move_180},
-        {"rotate_270", rotate_move_270},
-        {"flip_vertical", flip_move_vertical},
-        {"flip_horizontal", flip_move_horizontal},
-        {"flip_diag_a1h8", flip_move_diag_a1h8},
-        {"flip_diag_a8h1", flip_move_diag_a8h1}
-    };
-    //　move値の正規化処理　ここも前で何を使った記憶しておけば十分
-    const auto& transform = transformations.at(transformation_name);
-
-    // 返値: 正規化された手の値
-    return transform(move);
-}
-
-//　非正規化があるのはmove値のみ ここにnoneが行くことはあるので落としてはいけない。全消し時とか
-int denormalize_move(int move, const std::string& transformation_name, PositionManager& manager) {
-    manager.debug_log("Denormalizing move: " + std::to_string(move) + ", using transformation: " + transformation_name, PositionManager::LogLevel::DEBUG);
-
-    if (move == 64) {
-        manager.debug_log("At denormalize move is a pass, returning move unchanged.", PositionManager::LogLevel::DEBUG);
-        return move;
-    }
-    else if (move == 65) {
-        manager.debug_log("Move is invalid (none), returning move unchanged.", PositionManager::LogLevel::DEBUG);
-        return move;
-    }
-
-    //　逆変換用辞書
-    const std::unordered_map<std::string, std::function<int(int)>> reverse_transformations = {
-        {"identity", [](int x) { return x; }},
-        {"rotate_90", rotate_move_270},
-        {"rotate_180", rotate_move_180},
-        {"rotate_270", rotate_move_90},
-        {"flip_vertical", flip_move_vertical},
-        {"flip_horizontal", flip_move_horizontal},
-        {"flip_diag_a1h8", flip_move_diag_a1h8},
-        {"flip_diag_a8h1", flip_move_diag_a8h1}
-    };
-
-    //　前回使った正規化関数を覚えておいて、その逆変換関数を使用
-    const auto& reverse_transform = reverse_transformations.at(transformation_name);
-    return reverse_transform(move);
-}
-
-//　move値変換関数
-inline int rotate_move_90(int move) {
-    return (move % 8) * 8 + (7 - move / 8);
-}
-
-inline int rotate_move_270(int move) {
-    return (7 - move % 8) * 8 + move / 8;
-}
-
-inline int flip_move_vertical(int move) {
-    return (7 - move / 8) * 8 + move % 8;
-}
-
-inline int flip_move_horizontal(int move) {
-    return (move / 8) * 8 + (7 - move % 8);
-}
-
-inline int flip_move_diag_a1h8(int move) {
-    return (move % 8) * 8 + (move / 8);
-}
-
-inline int flip_move_diag_a8h1(int move) {
-    return (7 - move % 8) * 8 + (7 - move / 8);
-}
-
-//　bookを読む関数はこんなところに
-const Position* read_position(uint64_t my_stones, uint64_t opponent_stones) {
-    auto it = book_positions.find(std::make_pair(my_stones, opponent_stones));
-    return (it != book_positions.end()) ? &(it->second) : nullptr;
-}
-
-// 主にデバッグ用 mode5で動作。特定のポジション情報をbookから読み込んでdebuglogに表示するだけ
-void read_specified_positions(const std::string& input_file_path, PositionManager& manager) {
-    std::ifstream input_file(input_file_path);
-    if (!input_file.is_open()) {
-        manager.debug_log("Failed to open input file: " + input_file_path, PositionManager::LogLevel::ERROR);
-        return;
-    }
-    // ファイルの読み込み
-    std::string line;
-    while (std::getline(input_file, line)) {
-        std::istringstream iss(line);
-        std::string my_position_str, opponent_position_str;
-
-        if (!(iss >> my_position_str >> opponent_position_str)) {
-            manager.debug_log("Invalid line format: " + line, PositionManager::LogLevel::ERROR);
-            continue;
-        }
-        // 各行ごとに盤面情報の取得
-        uint64_t my_position, opponent_position;
-        try {
-            my_position = std::stoull(my_position_str, nullptr, 16);
-            opponent_position = std::stoull(opponent_position_str, nullptr, 16);
-        }
-        catch (const std::exception& e) {
-            manager.debug_log("Error parsing hex values: " + line + " - " + e.what(), PositionManager::LogLevel::ERROR);
-            continue;
-        }
-        // bookから読んでくる
-        const Position* position = read_position(my_position, opponent_position);
-        if (position) {
-            std::stringstream ss;
-            ss << "Position found - My stones: " << my_position_str
-                << ", Opponent stones: " << opponent_position_str
-                << "\n" << format_position(*position);
-            manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
-        }
-        else {
-            std::stringstream ss;
-            ss << "Position not found - My stones: " << my_position_str
-                << ", Opponent stones: " << opponent_position_str;
-            manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
-        }
-    }
-
-    input_file.close();
-}
-
-// メイン関数　ファイルパスの指定とコンフィグ読み込み→book読み込み→メイン関数読み込み
-int main() {
-    std::string book_path = "book.dat";
-    std::string debug_log_path = "debuglog.txt";
-    std::string output_path = "mismatched_positions.txt";
-    std::string config_path = "config.ini";
-    std::string specified_positions_path = "specified_positions.txt";
-
-    try {
-        auto [log_level, auto_adjust, adjusted_level, mode] = read_config(config_path);
-        PositionManager manager(book_path, debug_log_path, log_level, auto_adjust, adjusted_level);
-
-        if (mode < 1 || mode > 5) {
-            std::cerr << "Error: Invalid mode (" << mode << "). Mode must be between 1 and 5." << std::endl;
-            manager.debug_log("Invalid mode: " + std::to_string(mode), PositionManager::LogLevel::ERROR);
-            return 1;  // エラーコードを返して終了
-        }
-
-        load_all_positions(book_path, manager);
-
-        switch (mode) {
-        case 1:
-        case 2:
-        case 3:
-        case 4:
-            main_process(output_path, manager, mode);
-            break;
-        case 5:
-            read_specified_positions(specified_positions_path, manager);
-            break;
-        }
-    }
-    catch (const std::exception& e) {
-        // エラーメッセージをデバッグログに出力
-        PositionManager manager("", "debuglog.txt");  // 一時的なmanagerオブジェクトを作成
-        manager.debug_log("Critical error in main: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
-        std::cerr << "Error: " << e.what() << std::endl;
-        return 1;
-    }
-    // 返値　虚無
-    return 0;
-}
+﻿#include <iostream>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <set>
+#include <stack>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <filesystem>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <array>
+#include <utility>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/container/vector.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+
+// 各種構造体
+struct Link {
+    uint8_t move;
+    int8_t eval_link;
+    bool visited;
+};
+
+struct Leaf {
+    uint8_t move;
+    int8_t eval;
+    bool visited;
+};
+
+// ハッシュ関数 シンプルいずベスト
+struct PairHash {
+    std::size_t operator()(const std::pair<uint64_t, uint64_t>& p) const {
+        uint64_t combined = p.first + 0x9e3779b97f4a7c15ULL + (p.second << 12) + (p.second >> 4);
+        return std::hash<uint64_t>{}(combined);
+    }
+};
+
+// 等価比較演算子の定義
+struct PairEqual {
+    template <class T1, class T2>
+    bool operator()(const std::pair<T1, T2>& lhs, const std::pair<T1, T2>& rhs) const {
+        return lhs.first == rhs.first && lhs.second == rhs.second;
+    }
+};
+
+struct Position {
+    uint64_t my_stones = 0;
+    uint64_t opponent_stones = 0;
+    boost::container::small_vector<Link, 1> links;
+    Leaf leaf = { 0, 0, false };
+    int8_t eval_value = 0;
+    uint32_t game_count = 0;  // win + draw + lose の合計 rankedの重み付け用 (パディングに収まる)
+
+    // 読み込み時に計算しておく派生値　update_derived_evalsで作る
+    // ここから下は1バイトずつで、全部でポジション1つにつき8バイトに収まるようにする (手→添え字の表は探索でMoveIndexに作る)
+    int8_t max_link_eval = -64;       // リンクの最大評価値 (リーフを除く)　リンクが無ければ-64
+    int8_t max_move_eval = INT8_MIN;  // リンクとリーフの最大評価値
+    uint8_t best_move = 0;            // max_move_evalになる手 (最初のリンク、リーフも同値ならリーフ)
+
+    int8_t propagated_eval = 0;       // mode 7でbookのリンクとリーフだけからnegamaxした値
+    bool reachable = false;           // mode 9で初期局面からリンクとリーフで辿れたか
+    mutable bool subtree_completed = false;  // 探索でこのポジションから先を全て辿り終わったか (正規化したレコードに付ける　探索の印なのでconstのレコードにも付けられる)
+};
+
+// unorderd map 本体
+using PositionMap = boost::unordered_map<std::pair<uint64_t, uint64_t>, Position, PairHash, PairEqual>;
+
+// グローバル変数の宣言と定義
+extern PositionMap book_positions;
+PositionMap book_positions;
+
+class TraversalCheckpoint;
+
+// lookup_workersを設定した場合のワーカーへの問い合わせ　bookを全部読み込む普段の動作ではnullptr
+class RemoteLookup;
+RemoteLookup* remote_lookup = nullptr;
+
+// book_imageを割り当てた場合のイメージ　bookを全部読み込む普段の動作ではnullptr
+class BookImage;
+BookImage* book_image = nullptr;
+
+// book_indexを割り当てた場合の索引　bookを全部読み込む普段の動作ではnullptr
+class BookIndex;
+BookIndex* book_index = nullptr;
+
+class PositionManager {
+public:
+    // ログレベル一覧
+    enum class LogLevel {
+        DEBUG,
+        INFO,
+        WARNING,
+        ERROR,
+        NONE
+    };
+
+    // 時間カウントとループ回数測定
+    std::chrono::steady_clock::time_point program_start_time;
+    size_t loop_count = 0;
+    size_t completed_skip_count = 0;  // 辿り終わったポジションに別の手順で来てすぐ戻った回数
+    size_t symmetry_pruned_count = 0; // 対称な盤面で同じ子ポジションになる手を辿らなかった数
+
+    // 探索中のポジションの並び (初期局面から今のポジションまで)　チェックポイントに書き出す
+    std::vector<std::pair<const Position*, const std::string*>> traversal_stack;
+    TraversalCheckpoint* checkpoint = nullptr;
+
+    // 探索の手数の上限 (0なら無し)　上限の手数で止めたポジションの数
+    int max_ply = 0;
+    size_t max_ply_cutoff_count = 0;
+
+    // ポジションマネージャーの変数宣言部分
+    std::string book_path;
+    std::string debug_log_path;
+    Position current_position;
+    std::string current_kifu;
+    mutable LogLevel log_level;
+    bool auto_adjust_log_level;
+    LogLevel adjusted_log_level;
+
+    // 初期設定等
+    PositionManager(const std::string& book_path, const std::string& debug_log_path,
+        LogLevel level = LogLevel::ERROR,
+        bool auto_adjust = false,
+        LogLevel adjusted_level = LogLevel::INFO)
+        : book_path(book_path),
+        debug_log_path(debug_log_path),
+        current_position(),  // デフォルト初期化
+        current_kifu(""),
+        log_level(level),
+        auto_adjust_log_level(auto_adjust),
+        adjusted_log_level(adjusted_level) {
+        init_debug_log();
+    }
+
+    // デバッグログ出力関数本体
+    void debug_log(const std::string& message, LogLevel level, bool is_adjustment_message = false) {
+        if (level >= log_level) {
+            std::ofstream log_file(debug_log_path, std::ios_base::app | std::ios_base::binary);
+            if (log_file.is_open()) {
+                log_file << message << std::endl;
+
+                // WARNING 以上のレベルでログ出力された場合、ログレベルを自動調整
+                if (!is_adjustment_message && auto_adjust_log_level && level >= LogLevel::WARNING && log_level > adjusted_log_level) {
+                    LogLevel previous_level = log_level;
+                    log_level = adjusted_log_level;
+
+                    std::string warning_message = "Log level automatically adjusted from "
+                        + log_level_to_string(previous_level) + " to "
+                        + log_level_to_string(log_level);
+
+                    // 調整メッセージを直接書き込み、再帰呼び出しを避ける
+                    log_file << warning_message << std::endl;
+                }
+            }
+        }
+    }
+
+    // デバッグログ出力用
+private:
+    void init_debug_log() {
+        std::ofstream log_file(debug_log_path, std::ios_base::trunc | std::ios_base::binary);
+        if (log_file.is_open()) {
+            // UTF-8 BOMを書き込む
+            log_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
+            //時刻を記録
+            auto now = std::chrono::system_clock::now();
+            auto now_c = std::chrono::system_clock::to_time_t(now);
+            std::tm local_tm;
+            localtime_s(&local_tm, &now_c);
+
+            log_file << "[" << std::put_time(&local_tm, "%Y-%m-%d %H:%M:%S") << "] "
+                << "[" << log_level_to_string(log_level) << "]" << std::endl;
+        }
+    }
+
+private:
+    // const 修飾子を追加　デバッグ出力用
+    std::string log_level_to_string(LogLevel level) const {
+        switch (level) {
+        case LogLevel::ERROR: return "ERROR";
+        case LogLevel::WARNING: return "WARNING";
+        case LogLevel::INFO: return "INFO";
+        case LogLevel::DEBUG: return "DEBUG";
+        default: return "UNKNOWN";
+        }
+    }
+};
+
+// レポートの形式
+enum class ReportFormat {
+    NONE,
+    CSV,
+    JSONL
+};
+
+// config.ini の設定値一覧 項目が増えてきたのでタプルから構造体に変更
+struct ToolConfig {
+    PositionManager::LogLevel log_level = PositionManager::LogLevel::ERROR;
+    bool auto_adjust = false;
+    PositionManager::LogLevel adjusted_level = PositionManager::LogLevel::INFO;
+    int mode = 4;  // デフォルトモードを4に設定
+
+    // ranked出力 (不一致の大きい順に並べて出力)
+    bool ranked_output = false;
+    size_t ranked_top_k = 0;  // 0なら全件
+    bool ranked_weight_by_games = false;
+
+    // 機械可読なレポート (none, csv, jsonl)
+    ReportFormat report_format = ReportFormat::NONE;
+
+    // mode 6 で1回の探索でまとめて判定するmode
+    std::vector<int> multi_modes = { 1, 2, 3, 4 };
+
+    // mode 1～4 をmapを作らずにbook.datの流し読みで判定する
+    // mode 3, 4 の親と子の組 (辺) の外部ソートで1回にメモリに置く大きさ (MB)
+    bool streaming_check = false;
+    size_t streaming_memory_mb = 1024;
+
+    // mode 7 などで使うスレッド数　0ならCPUのスレッド数
+    unsigned threads = 0;
+
+    // mode 9 で辿れないポジションのキーをファイルに出力する
+    bool dump_orphans = false;
+
+    // mode 11 で比べる前のbookと、外部ソートで1回にメモリに置くポジション数
+    std::string diff_book;
+    size_t diff_chunk_positions = 1000000;
+
+    // mode 12 で判定し直すポジションの一覧 (空ならdiff_bookと比べる)
+    std::string changed_positions;
+
+    // 読み込み後に子ポジション → 親ポジションの逆引きの索引を作る　スナップショットのパスが空なら保存しない
+    bool parent_index = false;
+    std::string parent_index_snapshot = "parent_index.dat";
+
+    // mode 1～4, 6 の探索のチェックポイント　間隔は秒で0なら定期的には書かない (Ctrl+Cなどで止めた時だけ)、パスが空なら書かない
+    unsigned checkpoint_interval = 0;
+    std::string checkpoint_file = "traversal_checkpoint.dat";
+    bool resume = false;  // コマンドラインの --resume
+
+    // mode 1～4, 6 の探索を始める棋譜 (カンマ区切りで複数、空なら初期局面) と手数の上限 (0なら無し)
+    std::vector<std::string> start_kifu;
+    int max_ply = 0;
+
+    // 複数のプロセスに分ける場合の分け方　shard_plyの手数のポジションをshard_count個に分ける
+    // 大きさは1つのポジションにつきshard_samples回のランダムな道筋で見積もる
+    int shard_ply = 8;
+    size_t shard_count = 4;
+    size_t shard_samples = 32;
+    std::string shard_dir = "shards";
+    bool plan_shards = false;   // コマンドラインの --plan-shards
+    bool merge_shards = false;  // コマンドラインの --merge-shards
+    std::string shard_file;     // コマンドラインの --shard <ファイル>
+
+    // bookを分けて持つワーカーの数 (0ならbookを全部読み込む)とソケットのパス　ワーカーiは edax_lookup_i.sock
+    // 1回に送るキーの数、応答を待たずに送っておけるバッチの数、子ポジションを先に送っておく手数
+    size_t lookup_workers = 0;
+    std::string lookup_socket = "edax_lookup";
+    size_t lookup_batch_size = 64;
+    size_t lookup_in_flight = 8;
+    int lookup_lookahead = 2;
+    int lookup_worker = -1;  // コマンドラインの --lookup-worker <番号>
+
+    // bookのイメージ (shm:名前 なら共有メモリ、それ以外はファイルのパス)　空なら使わない
+    std::string book_image;
+    bool publish_image = false;  // コマンドラインの --publish-image
+    bool remove_image = false;   // コマンドラインの --remove-image
+
+    // book.datの索引ファイル (空なら使わない)　mode 1～6, 13 はbookを読み込まずに索引で引いたレコードだけ読む
+    std::string book_index;
+    bool build_index = false;    // コマンドラインの --build-index
+
+    // mode 1～6, 13 でbookを読み込む代わりに、起動時にレコードの位置だけの索引を作って使うレコードだけ読む
+    bool lazy_decode = false;
+    // mode 13 の問い合わせのデーモン　空なら標準入力と標準出力で答える　パスを書くとそのUnixドメインソケットで答える
+    std::string query_socket;
+
+    // mode 5, 13 で棋譜を調べる場合に、途中のポジションを覚えておく木の節の数の上限 (1節40バイト)
+    size_t kifu_cache_nodes = 1000000;
+};
+
+// "key = value" 形式の行から値を取り出す　一致しなければfalse
+bool read_config_value(const std::string& line, const std::string& key, std::string& value) {
+    size_t pos = line.find('=');
+    if (pos == std::string::npos) {
+        return false;
+    }
+    std::string name = line.substr(0, pos);
+    name.erase(name.find_last_not_of(" \t") + 1);
+    if (name != key) {
+        return false;
+    }
+    value = line.substr(pos + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return true;
+}
+
+// true/false の判定 大文字小文字は区別しない
+bool config_value_to_bool(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+    return value == "true";
+}
+
+// config.ini 読み込み関数を修正
+ToolConfig read_config(const std::string& config_path) {
+    // 設定ファイルを開く
+    std::ifstream config_file(config_path);
+    std::string line;
+
+    // デフォルト値の設定
+    ToolConfig config;
+
+    // ログレベルの文字列と列挙型のマッピング
+    std::unordered_map<std::string, PositionManager::LogLevel> log_level_map = {
+        {"DEBUG", PositionManager::LogLevel::DEBUG},
+        {"INFO", PositionManager::LogLevel::INFO},
+        {"WARNING", PositionManager::LogLevel::WARNING},
+        {"ERROR", PositionManager::LogLevel::ERROR},
+        {"NONE", PositionManager::LogLevel::NONE}
+    };
+
+    // 設定ファイルを1行ずつ読み込む
+    while (std::getline(config_file, line)) {
+        std::string setting;
+        // ログレベルの設定を読み込む
+        if (line.substr(0, 9) == "log_level") {
+            size_t pos = line.find('=');
+            if (pos != std::string::npos) {
+                std::string level = line.substr(pos + 1);
+                level.erase(0, level.find_first_not_of(" \t"));
+                level.erase(level.find_last_not_of(" \t") + 1);
+                auto it = log_level_map.find(level);
+                if (it != log_level_map.end()) {
+                    config.log_level = it->second;
+                }
+            }
+        }
+        // 自動調整レベルの設定を読み込む
+        else if (line.substr(0, 18) == "auto_adjust_level=") {
+            std::string value = line.substr(18);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t") + 1);
+            config.auto_adjust = config_value_to_bool(value);
+        }
+        // 調整後のログレベルの設定を読み込む
+        else if (line.substr(0, 15) == "adjusted_level=") {
+            std::string level = line.substr(15);
+            level.erase(0, level.find_first_not_of(" \t"));
+            level.erase(level.find_last_not_of(" \t") + 1);
+            auto it = log_level_map.find(level);
+            if (it != log_level_map.end()) {
+                config.adjusted_level = it->second;
+            }
+        }
+        // モードの設定を読み込む
+        else if (line.substr(0, 5) == "mode=") {
+            config.mode = std::stoi(line.substr(5));
+        }
+        // ranked出力の設定を読み込む
+        else if (read_config_value(line, "ranked_output", setting)) {
+            config.ranked_output = config_value_to_bool(setting);
+        }
+        else if (read_config_value(line, "ranked_top_k", setting)) {
+            config.ranked_top_k = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "ranked_weight_by_games", setting)) {
+            config.ranked_weight_by_games = config_value_to_bool(setting);
+        }
+        // mode 6 でまとめて判定するmodeの一覧を読み込む (例: multi_modes= 1,2,3,4)
+        else if (read_config_value(line, "multi_modes", setting)) {
+            config.multi_modes.clear();
+            std::stringstream ss(setting);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                item.erase(0, item.find_first_not_of(" \t"));
+                if (!item.empty()) {
+                    config.multi_modes.push_back(std::stoi(item));
+                }
+            }
+        }
+        // スレッド数の設定を読み込む
+        else if (read_config_value(line, "threads", setting)) {
+            config.threads = static_cast<unsigned>(std::stoul(setting));
+        }
+        // 辿れないポジションの出力の設定を読み込む
+        else if (read_config_value(line, "dump_orphans", setting)) {
+            config.dump_orphans = config_value_to_bool(setting);
+        }
+        // mode 11 の設定を読み込む
+        else if (read_config_value(line, "diff_book", setting)) {
+            config.diff_book = setting;
+        }
+        else if (read_config_value(line, "diff_chunk_positions", setting)) {
+            config.diff_chunk_positions = static_cast<size_t>(std::stoull(setting));
+        }
+        // mode 12 の設定を読み込む
+        else if (read_config_value(line, "changed_positions", setting)) {
+            config.changed_positions = setting;
+        }
+        // 逆引きの索引の設定を読み込む
+        else if (read_config_value(line, "parent_index", setting)) {
+            config.parent_index = config_value_to_bool(setting);
+        }
+        else if (read_config_value(line, "parent_index_snapshot", setting)) {
+            config.parent_index_snapshot = setting;
+        }
+        // チェックポイントの設定を読み込む
+        else if (read_config_value(line, "checkpoint_interval", setting)) {
+            config.checkpoint_interval = static_cast<unsigned>(std::stoul(setting));
+        }
+        else if (read_config_value(line, "checkpoint_file", setting)) {
+            config.checkpoint_file = setting;
+        }
+        // 探索を始める棋譜と手数の上限の設定を読み込む (例: start_kifu= f5d6c3, f5f6)
+        else if (read_config_value(line, "start_kifu", setting)) {
+            config.start_kifu.clear();
+            std::stringstream ss(setting);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                item.erase(0, item.find_first_not_of(" \t"));
+                item.erase(item.find_last_not_of(" \t") + 1);
+                std::transform(item.begin(), item.end(), item.begin(),
+                    [](unsigned char c) { return std::tolower(c); });
+                config.start_kifu.push_back(item);
+            }
+        }
+        else if (read_config_value(line, "max_ply", setting)) {
+            config.max_ply = std::stoi(setting);
+        }
+        // 複数のプロセスに分ける設定を読み込む
+        else if (read_config_value(line, "shard_ply", setting)) {
+            config.shard_ply = std::stoi(setting);
+        }
+        else if (read_config_value(line, "shard_count", setting)) {
+            config.shard_count = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "shard_samples", setting)) {
+            config.shard_samples = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "shard_dir", setting)) {
+            config.shard_dir = setting;
+        }
+        // 問い合わせのデーモンの設定を読み込む
+        else if (read_config_value(line, "query_socket", setting)) {
+            config.query_socket = setting;
+        }
+        // bookのイメージの設定を読み込む
+        else if (read_config_value(line, "book_image", setting)) {
+            config.book_image = setting;
+        }
+        else if (read_config_value(line, "book_index", setting)) {
+            config.book_index = setting;
+        }
+        else if (read_config_value(line, "lazy_decode", setting)) {
+            config.lazy_decode = config_value_to_bool(setting);
+        }
+        else if (read_config_value(line, "kifu_cache_nodes", setting)) {
+            config.kifu_cache_nodes = static_cast<size_t>(std::stoull(setting));
+        }
+        // bookを分けて持つワーカーの設定を読み込む
+        else if (read_config_value(line, "lookup_workers", setting)) {
+            config.lookup_workers = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "lookup_socket", setting)) {
+            config.lookup_socket = setting;
+        }
+        else if (read_config_value(line, "lookup_batch_size", setting)) {
+            config.lookup_batch_size = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "lookup_in_flight", setting)) {
+            config.lookup_in_flight = static_cast<size_t>(std::stoull(setting));
+        }
+        else if (read_config_value(line, "lookup_lookahead", setting)) {
+            config.lookup_lookahead = std::stoi(setting);
+        }
+        // 流し読みでの判定の設定を読み込む
+        else if (read_config_value(line, "streaming_check", setting)) {
+            config.streaming_check = config_value_to_bool(setting);
+        }
+        else if (read_config_value(line, "streaming_memory_mb", setting)) {
+            config.streaming_memory_mb = static_cast<size_t>(std::stoull(setting));
+        }
+        // レポート形式の設定を読み込む
+        else if (read_config_value(line, "report_format", setting)) {
+            std::transform(setting.begin(), setting.end(), setting.begin(),
+                [](unsigned char c) { return std::tolower(c); });
+            if (setting == "csv") {
+                config.report_format = ReportFormat::CSV;
+            }
+            else if (setting == "jsonl") {
+                config.report_format = ReportFormat::JSONL;
+            }
+            else {
+                config.report_format = ReportFormat::NONE;
+            }
+        }
+    }
+
+    // 返値: 設定値の構造体
+    return config;
+}
+
+// move値の実際の実装が説明と異なる部分があるための修正用
+inline uint8_t rotate_move_180(uint8_t move) {
+    if (move >= 64) {
+        return move;
+    }
+    return 63 - move;
+}
+
+// unorderd_map用のハッシュ関数の衝突回数を調べる　ハッシュ領域が足りてないのでどんなハッシュ関数を用意しても衝突率33％はある
+size_t count_collisions(const PositionMap& map) {
+    boost::container::vector<size_t> bucket_sizes(map.bucket_count());
+    for (size_t i = 0; i < map.bucket_count(); ++i) {
+        bucket_sizes[i] = map.bucket_size(i);
+    }
+
+    size_t collisions = 0;
+    for (size_t size : bucket_sizes) {
+        if (size > 1) {
+            collisions += size - 1;
+        }
+    }
+    // 返値 衝突回数
+    return collisions;
+}
+
+// win, draw, lose の合計　uint32_tに収まらない場合は飽和させる
+inline uint32_t sum_game_count(const uint32_t win_draw_lose[3]) {
+    uint64_t total = static_cast<uint64_t>(win_draw_lose[0]) + win_draw_lose[1] + win_draw_lose[2];
+    return static_cast<uint32_t>(std::min<uint64_t>(total, UINT32_MAX));
+}
+
+// 64ビットの立っているビット数
+inline int popcount64(uint64_t x) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(x));
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// リンクの手のマスクと 手→linksの添え字 の表　レコードごとに持つとbookの分だけメモリが増えるので
+// 探索で親ポジションに入った時に1回作り、そのポジションの子の判定の間だけ使う
+struct MoveIndex {
+    bool valid = false;  // mask/slotsが使えるか (リンク16個以内、パスと重複無し)
+    uint64_t mask = 0;   // リンクの手のビット
+    uint64_t slots = 0;  // maskの下位から数えた順位ごとのlinksの添え字 4ビットずつ
+};
+
+inline MoveIndex make_move_index(const Position& position) {
+    MoveIndex index;
+    if (position.links.size() > 16) return index;
+
+    uint64_t mask = 0;
+    for (const auto& link : position.links) {
+        // パスや重複した手は表に入れられないので線形探索に任せる
+        if (link.move >= 64 || (mask & (1ULL << link.move))) return index;
+        mask |= 1ULL << link.move;
+    }
+
+    uint64_t slots = 0;
+    for (size_t i = 0; i < position.links.size(); ++i) {
+        int rank = popcount64(mask & ((1ULL << position.links[i].move) - 1));
+        slots |= static_cast<uint64_t>(i) << (4 * rank);
+    }
+    index.mask = mask;
+    index.slots = slots;
+    index.valid = true;
+    return index;
+}
+
+// 手に対応するリンクの添え字　無ければ-1　表が無ければリンクを順に見る
+inline int find_link_slot(const Position& position, uint8_t move, const MoveIndex* index = nullptr) {
+    if (index && index->valid) {
+        if (move >= 64 || !(index->mask & (1ULL << move))) return -1;
+        int rank = popcount64(index->mask & ((1ULL << move) - 1));
+        return static_cast<int>((index->slots >> (4 * rank)) & 0xF);
+    }
+    for (size_t i = 0; i < position.links.size(); ++i) {
+        if (position.links[i].move == move) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+// 判定で毎回使うリンクとリーフの最大評価値などを先に計算しておく
+inline void update_derived_evals(Position& position) {
+    int8_t max_link_eval = -64;
+    int8_t max_move_eval = INT8_MIN;
+    for (const auto& link : position.links) {
+        if (link.eval_link > max_link_eval) max_link_eval = link.eval_link;
+        if (link.eval_link > max_move_eval) max_move_eval = link.eval_link;
+    }
+    if (position.leaf.eval > max_move_eval) max_move_eval = position.leaf.eval;
+
+    uint8_t best_move = 0;
+    for (const auto& link : position.links) {
+        if (link.eval_link == max_move_eval) {
+            best_move = link.move;
+            break;
+        }
+    }
+    if (position.leaf.eval == max_move_eval) best_move = position.leaf.move;
+
+    position.max_link_eval = max_link_eval;
+    position.max_move_eval = max_move_eval;
+    position.best_move = best_move;
+}
+
+// マップしたbook.datの1レコードをそのまま読むビュー　Positionを作らずに盤面や評価値、リンク、リーフを見られる
+// 形式: 盤面(8+8), 勝ち引き分け負け(4x3), line(4), 評価値(2), minvalue, maxvalue(2+2), リンクの数(1), level(1), リンク(評価値1+手1)の並び, リーフ(評価値1+手1)
+// 手はbook.datの向きなので、読むときにrotate_move_180で直す
+struct BookRecordView {
+    const char* data;
+
+    template<class T>
+    T field(size_t offset) const {
+        T value;
+        std::memcpy(&value, data + offset, sizeof(T));
+        return value;
+    }
+
+    uint64_t my_stones() const { return field<uint64_t>(0); }
+    uint64_t opponent_stones() const { return field<uint64_t>(8); }
+    std::pair<uint64_t, uint64_t> key() const { return std::make_pair(my_stones(), opponent_stones()); }
+    uint32_t game_count() const {
+        uint32_t win_draw_lose[3] = { field<uint32_t>(16), field<uint32_t>(20), field<uint32_t>(24) };
+        return sum_game_count(win_draw_lose);
+    }
+    int16_t raw_eval() const { return field<int16_t>(32); }
+    uint8_t link_count() const { return field<uint8_t>(38); }
+    Link link(size_t i) const { return Link{ rotate_move_180(field<uint8_t>(41 + 2 * i)), field<int8_t>(40 + 2 * i), false }; }
+    Leaf leaf() const {
+        size_t offset = 40 + 2 * static_cast<size_t>(link_count());
+        return Leaf{ rotate_move_180(field<uint8_t>(offset + 1)), field<int8_t>(offset), false };
+    }
+    // 次のレコードまでのバイト数
+    size_t size() const { return 42 + 2 * static_cast<size_t>(link_count()); }
+
+    // Positionに読む
+    Position decode(PositionManager& manager) const {
+        // 評価値が範囲外だった場合
+        int16_t raw_value = raw_eval();
+        if (raw_value < -127 || raw_value > 127) {
+            manager.debug_log("Error: Value out of int8_t range: " + std::to_string(raw_value), PositionManager::LogLevel::ERROR);
+            std::exit(1);
+        }
+        Position position;
+        position.my_stones = my_stones();
+        position.opponent_stones = opponent_stones();
+        uint8_t numberline = link_count();
+        for (size_t i = 0; i < numberline; ++i) {
+            position.links.push_back(link(i));
+        }
+        position.leaf = leaf();
+        position.eval_value = static_cast<int8_t>(raw_value);
+        position.game_count = game_count();
+        update_derived_evals(position);
+        return position;
+    }
+};
+
+// book.datのレコードを先頭から1つずつ読んでcallbackに渡す　mapには入れないので読むだけならメモリは一定
+// 返値: ファイルを開けなかった場合はfalse
+template<class Callback>
+bool for_each_book_record(const std::string& book_path, PositionManager& manager, Callback&& callback) {
+    // ファイルマッピングを作成
+    boost::interprocess::file_mapping file(book_path.c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+
+    // マップされたリージョンの先頭ポインタを取得
+    const char* data = static_cast<const char*>(region.get_address());
+    std::size_t filesize = region.get_size();
+
+    // ヘッダーをスキップ
+    const char* current = data + 42;
+
+    while (current < data + filesize) {
+        BookRecordView record{ current };
+        current += record.size();
+        callback(record.decode(manager));
+    }
+    return true;
+}
+
+// bookデータをbook posiitons unorderd mapへ全てぶち込む　いらないデータは捨てる
+void load_all_positions(const std::string& book_path, PositionManager& manager) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // ファイルサイズを取得　開けない場合はここで終了
+    std::error_code size_error;
+    std::uintmax_t filesize = std::filesystem::file_size(book_path, size_error);
+    if (size_error) {
+        manager.debug_log("Failed to open book file: " + book_path, PositionManager::LogLevel::ERROR);
+        return;
+    }
+    manager.debug_log("File size: " + std::to_string(filesize) + " bytes", PositionManager::LogLevel::INFO);
+
+    // ポジション数を推定
+    constexpr double avg_position_size = 44.0720;
+    double estimated_positions_double = static_cast<double>(filesize) / avg_position_size;
+    size_t estimated_positions = static_cast<size_t>(estimated_positions_double);
+
+    // 負荷係数を考慮してバケット数を計算
+    size_t estimated_buckets = static_cast<size_t>(estimated_positions * 1.10);
+
+    // reserveの前にバケット数を出力　そしてreserve
+    manager.debug_log("Estimated number of buckets: " + std::to_string(estimated_buckets), PositionManager::LogLevel::DEBUG);
+    book_positions.reserve(estimated_buckets);
+
+    if (manager.log_level == PositionManager::LogLevel::DEBUG) {
+        manager.debug_log("Actual bucket count after reserve: " + std::to_string(book_positions.bucket_count()), PositionManager::LogLevel::DEBUG);
+        manager.debug_log("Estimated number of positions: " + std::to_string(estimated_positions), PositionManager::LogLevel::DEBUG);
+
+        // バケットのメモリ使用量（ポインタサイズ）
+        size_t bucket_memory = book_positions.bucket_count() * sizeof(void*);
+
+        // 要素のメモリ使用量
+        constexpr double bytes_per_position = 47.0;  // Position構造体の平均サイズ
+        double element_memory = estimated_positions * bytes_per_position;
+
+        // 合計推定メモリ使用量
+        double total_estimated_memory_mb = (bucket_memory + element_memory) / (1048576);
+        manager.debug_log("Estimated total memory usage: " + std::to_string(total_estimated_memory_mb) + " MB", PositionManager::LogLevel::DEBUG);
+    }
+
+    // 読み込み時間の測定
+    auto read_start_time = std::chrono::high_resolution_clock::now();
+
+    // 変数の初期化
+    size_t positions_loaded = 0;
+
+    bool opened = for_each_book_record(book_path, manager, [&](Position&& position) {
+        auto key = std::make_pair(position.my_stones, position.opponent_stones);
+        book_positions.emplace(key, std::move(position));
+        positions_loaded++;
+
+        // 10万ポジションごとに進捗を表示
+        if (positions_loaded % 100000 == 0) {
+            std::cout << "\r" << positions_loaded << " Loading Completed" << std::flush;
+        }
+    });
+    if (!opened) {
+        return;
+    }
+
+    // 最終的な読み込み数を表示
+    std::cout << "\r" << positions_loaded << " Loading Completed" << std::endl;
+
+    // 読み込み時間測定終了
+    auto read_end_time = std::chrono::high_resolution_clock::now();
+    auto read_duration = std::chrono::duration_cast<std::chrono::milliseconds>(read_end_time - read_start_time);
+
+    manager.debug_log("Actual number of positions loaded: " + std::to_string(positions_loaded), PositionManager::LogLevel::INFO);
+
+    if (manager.log_level == PositionManager::LogLevel::DEBUG) {
+        // unordered_mapのメモリ使用量を推定
+        size_t bucket_memory_actual = book_positions.bucket_count() * sizeof(void*);
+
+        // ノードサイズの計算（small_vectorのサイズを除外）
+        size_t node_size = sizeof(std::pair<const std::pair<uint64_t, uint64_t>, Position>) - sizeof(boost::container::small_vector<Link, 1>);
+        size_t aligned_node_size = (node_size + 15) & ~15;  // 16バイトアラインメント
+
+        // ノードのメモリ（small_vectorを除く）
+        size_t nodes_memory = aligned_node_size * book_positions.size();
+
+        // linksのメモリ使用量を推定（small_vectorオブジェクト自体のサイズを含む）
+        size_t total_links_memory = 0;
+        size_t small_vector_size = sizeof(boost::container::small_vector<Link, 1>);
+        for (const auto& pair : book_positions) {
+            const Position& pos = pair.second;
+            size_t links_memory = small_vector_size + (pos.links.capacity() * sizeof(Link));
+            total_links_memory += links_memory;
+        }
+
+        // 総メモリ使用量
+        size_t total_memory = bucket_memory_actual + nodes_memory + total_links_memory;
+
+        // メモリ使用量をデバッグログに出力
+        std::stringstream ss;
+        ss << "Estimated memory usage of book_positions:"
+            << "\n  Bucket memory: " << bucket_memory_actual << " bytes"
+            << "\n  Node size (excluding small_vector): " << node_size << " bytes (aligned to " << aligned_node_size << " bytes)"
+            << "\n  Nodes memory: " << nodes_memory << " bytes"
+            << "\n  Links memory (including small_vector objects): " << total_links_memory << " bytes"
+            << "\n  Total memory: " << total_memory << " bytes"
+            << "\n  Total memory (MB): " << (total_memory / (1024.0 * 1024.0)) << " MB";
+        manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
+
+        // Position構造体のサイズを出力
+        ss.str("");
+        ss << "Size of structures:"
+            << "\n  Position: " << sizeof(Position) << " bytes"
+            << "\n  Link: " << sizeof(Link) << " bytes"
+            << "\n  Leaf: " << sizeof(Leaf) << " bytes"
+            << "\n  boost::container::small_vector<Link, 1>: " << sizeof(boost::container::small_vector<Link, 1>) << " bytes";
+        manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
+
+        // ハッシュ関数の衝突回数の測定
+        size_t collisions = count_collisions(book_positions);
+        manager.debug_log("Number of hash collisions: " + std::to_string(collisions), PositionManager::LogLevel::DEBUG);
+        manager.debug_log("Collision rate: " + std::to_string(static_cast<double>(collisions) / positions_loaded), PositionManager::LogLevel::DEBUG);
+    }
+
+    // ファイル読み込み時間の測定
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto total_duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+
+    manager.debug_log("File I/O time: " + std::to_string(read_duration.count()) + " ms", PositionManager::LogLevel::INFO);
+    manager.debug_log("Total load time: " + std::to_string(total_duration.count()) + " ms", PositionManager::LogLevel::INFO);
+}
+
+// デバッグログの整地
+std::string format_position(const Position& position) {
+    std::stringstream ss;
+    ss << "my_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << position.my_stones
+        << ", opponent_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << position.opponent_stones
+        << ", eval_value: " << std::dec << static_cast<int>(position.eval_value)
+        << "\nLinks: ";
+    for (const auto& link : position.links) {
+        ss << "{move: " << static_cast<int>(link.move)
+            << ", eval_link: " << static_cast<int>(link.eval_link)
+            << ", visited: " << (link.visited ? "True" : "False") << "} ";
+    }
+    ss << "\nLeaf: {move: " << static_cast<int>(position.leaf.move)
+        << ", eval: " << static_cast<int>(position.leaf.eval)
+        << ", visited: " << (position.leaf.visited ? "True" : "False") << "}";
+
+    // 返値: 盤面の状態を表す文字列
+    return ss.str();
+}
+
+// 出力ファイル名の拡張子の前に文字列を足す　mismatched_positions.txt → mismatched_positions_ranked.txt
+std::string add_path_suffix(const std::string& path, const std::string& suffix) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return path + suffix;
+    }
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// 不一致1件分の情報　judge_mismatchとmismatch_processで分かっているものを出力まで持っていく
+struct MismatchDetail {
+    int mode = 0;
+    int severity = 0;            // 評価値の差の絶対値
+    int depth = 0;               // 子ポジションまでの手数
+    bool has_parent_eval = false; // mode 1, 2は親を見ないので無し
+    int8_t parent_eval = 0;      // 親ポジションの該当するリンクやリーフの評価値
+    int8_t child_eval = 0;
+    int8_t max_child_eval = 0;   // mode 1はリンクのみ、それ以外はリンクとリーフの最大
+    uint64_t canonical_my_stones = 0;
+    uint64_t canonical_opponent_stones = 0;
+    std::string transformation;  // 子ポジションを正規化した変換名
+    uint32_t game_count = 0;
+};
+
+// 不一致の出力先　毎回ファイルを開き直さずにバッファ付きで開きっぱなしにする
+// rankedの場合は全件(またはtop Kだけをヒープで)ためておき、最後に不一致の大きい順に書き出す
+class MismatchOutput {
+public:
+    struct RankedEntry {
+        double score;        // 重み付け後の不一致の大きさ
+        int severity;        // 評価値の差の絶対値
+        int depth;           // 子ポジションまでの手数
+        uint32_t game_count;
+        size_t sequence;     // 同点の場合は見つかった順
+        std::string kifu;
+    };
+
+    MismatchOutput(const std::string& output_path, PositionManager& manager,
+        bool ranked = false, size_t top_k = 0, bool weight_by_games = false,
+        ReportFormat report_format = ReportFormat::NONE)
+        : output_path(output_path),
+        manager(manager),
+        ranked(ranked),
+        top_k(top_k),
+        weight_by_games(weight_by_games),
+        report_format(report_format),
+        buffer(1 << 20) {
+        open_outputs().push_back(this);
+    }
+
+    ~MismatchOutput() {
+        finish();
+        auto& outputs = open_outputs();
+        outputs.erase(std::remove(outputs.begin(), outputs.end(), this), outputs.end());
+    }
+
+    // 不一致1行分の出力　レポートは常にその場で流し、rankedでなければ棋譜もそのままバッファへ
+    void write(const std::string& kifu, const MismatchDetail& detail) {
+        lines_written++;
+        if (report_format != ReportFormat::NONE) {
+            write_report(kifu, detail);
+        }
+        if (!ranked) {
+            write_line(kifu);
+            return;
+        }
+
+        double score = detail.severity;
+        if (weight_by_games) {
+            score *= 1.0 + std::log2(1.0 + detail.game_count);
+        }
+        RankedEntry entry{ score, detail.severity, detail.depth, detail.game_count, sequence++, kifu };
+
+        if (top_k == 0) {
+            entries.push_back(std::move(entry));
+            return;
+        }
+        // topが一番軽い不一致になっているのでK件を超えたら捨てる
+        ranked_heap.push(std::move(entry));
+        if (ranked_heap.size() > top_k) {
+            ranked_heap.pop();
+        }
+    }
+
+    // rankedの書き出しとフラッシュ
+    void finish() {
+        if (finished) {
+            return;
+        }
+        finished = true;
+
+        if (ranked) {
+            while (!ranked_heap.empty()) {
+                entries.push_back(ranked_heap.top());
+                ranked_heap.pop();
+            }
+            std::sort(entries.begin(), entries.end(), RankedOrder());
+            for (const RankedEntry& entry : entries) {
+                write_line(entry.kifu);
+            }
+            if (!entries.empty()) {
+                write_ranked_file(add_path_suffix(output_path, "_ranked"));
+            }
+            manager.debug_log("Ranked mismatches written: " + std::to_string(entries.size()) + " (found: " + std::to_string(sequence) + ")", PositionManager::LogLevel::INFO);
+            entries.clear();
+        }
+
+        if (file.is_open()) {
+            file.flush();
+        }
+        if (report_file.is_open()) {
+            report_file.flush();
+        }
+    }
+
+    // std::exit(1)で終わる場合にバッファに溜まっている不一致の行を書き出す　rankedの並べ替え前の分は書けない
+    static void flush_open_outputs() {
+        for (MismatchOutput* output : open_outputs()) {
+            if (output->file.is_open()) {
+                output->file.flush();
+            }
+            if (output->report_file.is_open()) {
+                output->report_file.flush();
+            }
+        }
+    }
+
+    // このファイルに出した不一致の行数
+    size_t line_count() const {
+        return lines_written;
+    }
+
+    // チェックポイント用　バッファを書き出して出力とレポートのファイルの大きさを返す (まだ無ければ0)
+    std::pair<uint64_t, uint64_t> flushed_sizes() {
+        if (file.is_open()) {
+            file.flush();
+        }
+        if (report_file.is_open()) {
+            report_file.flush();
+        }
+        std::error_code error;
+        uint64_t file_size = std::filesystem::exists(output_path, error) ? std::filesystem::file_size(output_path, error) : 0;
+        std::string report_path = report_path_for(output_path, report_format);
+        uint64_t report_size = report_format != ReportFormat::NONE && std::filesystem::exists(report_path, error) ? std::filesystem::file_size(report_path, error) : 0;
+        return { file_size, report_size };
+    }
+
+    // チェックポイントからの再開用　開く前にチェックポイントの後に書いた分を切り捨てて行数を戻す
+    bool restore(size_t lines, uint64_t file_size, uint64_t report_size) {
+        if (file.is_open() || report_file.is_open()) {
+            return false;
+        }
+        if (!truncate_output(output_path, file_size)) {
+            return false;
+        }
+        if (report_format != ReportFormat::NONE && !truncate_output(report_path_for(output_path, report_format), report_size)) {
+            return false;
+        }
+        lines_written = lines;
+        return true;
+    }
+
+    // レポートのパス　mismatched_positions.txt → mismatched_positions_report.csv
+    static std::string report_path_for(const std::string& output_path, ReportFormat format) {
+        std::string base = add_path_suffix(output_path, "_report");
+        size_t dot = base.find_last_of('.');
+        if (dot != std::string::npos) {
+            base.resize(dot);
+        }
+        return base + (format == ReportFormat::JSONL ? ".jsonl" : ".csv");
+    }
+
+private:
+    // 開いている出力の一覧　最初に使うときにexitで書き出すように登録する (一覧より先に登録すると一覧が先に消える)
+    static std::vector<MismatchOutput*>& open_outputs() {
+        static std::vector<MismatchOutput*> outputs;
+        static bool registered = (std::atexit(flush_open_outputs), true);
+        (void)registered;
+        return outputs;
+    }
+
+    // 大きい順　同点なら浅い順、さらに同じなら見つかった順
+    struct RankedOrder {
+        bool operator()(const RankedEntry& lhs, const RankedEntry& rhs) const {
+            if (lhs.score != rhs.score) return lhs.score > rhs.score;
+            if (lhs.depth != rhs.depth) return lhs.depth < rhs.depth;
+            return lhs.sequence < rhs.sequence;
+        }
+    };
+
+    // ファイルをsizeバイトに切り詰める　チェックポイントの時より短い場合は再開できない
+    bool truncate_output(const std::string& path, uint64_t size) {
+        std::error_code error;
+        uint64_t current_size = std::filesystem::exists(path, error) ? std::filesystem::file_size(path, error) : 0;
+        if (current_size < size) {
+            manager.debug_log("Output file is shorter than the checkpoint: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+        if (current_size > size) {
+            std::filesystem::resize_file(path, size, error);
+            if (error) {
+                manager.debug_log("Failed to truncate output file: " + path + " (" + error.message() + ")", PositionManager::LogLevel::ERROR);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // _ranked.txtは並べ替えた結果なので追記せずに書き直す
+    // 前回の行 (mode 12で変わらなかった分など) があれば今回の分と合わせて大きい順に並べ直し、ヘッダーは1回だけ　top Kも合わせた分に掛ける
+    void write_ranked_file(const std::string& ranked_path) {
+        std::vector<RankedEntry> merged;
+        std::ifstream previous_file(ranked_path, std::ios::binary);
+        std::string line;
+        while (std::getline(previous_file, line)) {
+            if (merged.empty() && line.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+                line.erase(0, 3);
+            }
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            // score, severity, depth, games, kifu のタブ区切り
+            std::istringstream fields(line);
+            RankedEntry entry{};
+            if (!(fields >> entry.score >> entry.severity >> entry.depth >> entry.game_count) || fields.get() != '\t') {
+                manager.debug_log("Malformed ranked line dropped: " + line, PositionManager::LogLevel::WARNING);
+                continue;
+            }
+            std::getline(fields, entry.kifu);
+            entry.sequence = merged.size();
+            merged.push_back(std::move(entry));
+        }
+        previous_file.close();
+
+        // 同点なら前回の行が先
+        size_t previous_count = merged.size();
+        for (const RankedEntry& entry : entries) {
+            merged.push_back(entry);
+            merged.back().sequence += previous_count;
+        }
+        std::sort(merged.begin(), merged.end(), RankedOrder());
+        if (top_k > 0 && merged.size() > top_k) {
+            merged.resize(top_k);
+        }
+
+        std::ofstream ranked_file(ranked_path, std::ios::binary | std::ios::trunc);
+        if (!ranked_file.is_open()) {
+            manager.debug_log("Failed to open or create output file: " + ranked_path, PositionManager::LogLevel::ERROR);
+            return;
+        }
+        ranked_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
+        ranked_file << "# score\tseverity\tdepth\tgames\tkifu" << '\n';
+        for (const RankedEntry& entry : merged) {
+            ranked_file << entry.score << '\t' << entry.severity << '\t' << entry.depth << '\t'
+                << entry.game_count << '\t' << entry.kifu << '\n';
+        }
+        if (previous_count > 0) {
+            manager.debug_log("Ranked file rewritten with " + std::to_string(previous_count) + " previous lines: " + ranked_path, PositionManager::LogLevel::INFO);
+        }
+    }
+
+    // 追記モードで開く　新規作成の場合はBOMを書き込む
+    bool open_output(std::ofstream& stream, const std::string& path) {
+        if (stream.is_open()) {
+            return true;
+        }
+        stream.open(path, std::ios::app | std::ios::binary);
+        if (!stream.is_open()) {
+            manager.debug_log("Failed to open or create output file: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+        stream.seekp(0, std::ios::end);
+        if (stream.tellp() == 0) {
+            stream << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
+        }
+        return true;
+    }
+
+    // レポート1行分　CSVは1行目にヘッダーを入れる
+    void write_report(const std::string& kifu, const MismatchDetail& detail) {
+        if (!report_file.is_open()) {
+            if (report_open_failed) {
+                return;
+            }
+            report_file.rdbuf()->pubsetbuf(report_buffer.data(), report_buffer.size());
+            report_file.open(report_path_for(output_path, report_format), std::ios::app | std::ios::binary);
+            if (!report_file.is_open()) {
+                report_open_failed = true;
+                manager.debug_log("Failed to open or create report file: " + report_path_for(output_path, report_format), PositionManager::LogLevel::ERROR);
+                return;
+            }
+            report_file.seekp(0, std::ios::end);
+            if (report_format == ReportFormat::CSV && report_file.tellp() == 0) {
+                report_file << "mode,kifu,severity,depth,parent_eval,child_eval,max_child_eval,canonical_my_stones,canonical_opponent_stones,symmetry,games\n";
+            }
+        }
+
+        std::string parent_eval = detail.has_parent_eval ? std::to_string(detail.parent_eval) : (report_format == ReportFormat::JSONL ? "null" : "");
+        std::stringstream my_hex, opponent_hex;
+        my_hex << "0x" << std::hex << std::setw(16) << std::setfill('0') << detail.canonical_my_stones;
+        opponent_hex << "0x" << std::hex << std::setw(16) << std::setfill('0') << detail.canonical_opponent_stones;
+
+        if (report_format == ReportFormat::CSV) {
+            report_file << detail.mode << ',' << kifu << ',' << detail.severity << ',' << detail.depth << ','
+                << parent_eval << ',' << static_cast<int>(detail.child_eval) << ',' << static_cast<int>(detail.max_child_eval) << ','
+                << my_hex.str() << ',' << opponent_hex.str() << ',' << detail.transformation << ',' << detail.game_count << '\n';
+        }
+        else {
+            report_file << "{\"mode\":" << detail.mode << ",\"kifu\":\"" << kifu << "\",\"severity\":" << detail.severity
+                << ",\"depth\":" << detail.depth << ",\"parent_eval\":" << parent_eval
+                << ",\"child_eval\":" << static_cast<int>(detail.child_eval) << ",\"max_child_eval\":" << static_cast<int>(detail.max_child_eval)
+                << ",\"canonical_my_stones\":\"" << my_hex.str() << "\",\"canonical_opponent_stones\":\"" << opponent_hex.str()
+                << "\",\"symmetry\":\"" << detail.transformation << "\",\"games\":" << detail.game_count << "}\n";
+        }
+    }
+
+    void write_line(const std::string& line) {
+        if (!file.is_open()) {
+            if (open_failed) {
+                return;
+            }
+            file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+            open_failed = !open_output(file, output_path);
+            if (open_failed) {
+                return;
+            }
+        }
+        file << line << '\n';
+    }
+
+    std::string output_path;
+    PositionManager& manager;
+    bool ranked;
+    size_t top_k;
+    bool weight_by_games;
+    ReportFormat report_format;
+    std::vector<char> buffer;
+    std::vector<char> report_buffer = std::vector<char>(1 << 20);
+    std::ofstream file;
+    std::ofstream report_file;
+    bool open_failed = false;
+    bool report_open_failed = false;
+    bool finished = false;
+    size_t sequence = 0;
+    size_t lines_written = 0;
+    std::vector<RankedEntry> entries;
+    std::priority_queue<RankedEntry, std::vector<RankedEntry>, RankedOrder> ranked_heap;
+};
+
+// 1回の探索で判定するmodeとその出力先の組　mode 6では複数並べて1回の探索で全部判定する
+struct ModeTarget {
+    int mode;
+    std::unique_ptr<MismatchOutput> output;
+};
+
+// modeごとの出力先　添え字がmode (0は使わない)
+using ModeOutputTable = std::array<MismatchOutput*, 5>;
+
+// modeをビットにしたもの　mode 1～4 を下位4ビットに割り当ててModeMaskのテンプレート引数に使う
+constexpr unsigned mode_bit(int mode) {
+    return 1u << (mode - 1);
+}
+
+// 各関数の宣言
+std::tuple<Position, std::string, std::string, uint8_t, const Position*> get_children(PositionManager& manager, Position& position);
+std::tuple<Position, std::string, std::string, const Position*> process_position(Position& position, const std::string& kifu, uint8_t move, PositionManager& manager);
+std::tuple<Position, std::string> create_position_data(PositionManager& manager, int move = -1);
+std::tuple<std::string, std::string> convert_move_to_str(int move, const std::string& kifu, PositionManager& manager);
+Position flip_stones(const Position& position, const std::string& move_str);
+uint64_t shift(uint64_t b, int dir);
+std::tuple<std::tuple<uint64_t, uint64_t>, std::string> normalize_position(uint64_t my_stones, uint64_t opponent_stones, PositionManager& manager);
+int denormalize_move(int move, const std::string& transformation_name, PositionManager& manager);
+int rotate_move_90(int move);
+int rotate_move_270(int move);
+int flip_move_vertical(int move);
+int flip_move_horizontal(int move);
+int flip_move_diag_a1h8(int move);
+int flip_move_diag_a8h1(int move);
+int normalize_move(int move, const std::string& transformation_name, PositionManager& manager);
+const Position* read_position(uint64_t my_stones, uint64_t opponent_stones);
+void prefetch_lookup_children(const Position& position);
+void release_book_records(const Position* record);
+uint64_t transform_board(uint64_t x, const std::string& transformation_name);
+int8_t calculate_parent_eval(const Position& parent_position, uint8_t move, PositionManager& manager, const MoveIndex* parent_moves = nullptr);
+Position denormalize_book_position(const Position& book_position, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, PositionManager& manager);
+Position denormalize_book_position(const BookRecordView& record, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, PositionManager& manager);
+bool normalize_book_position(Position& position, PositionManager& manager);
+std::string move_to_str(int move);
+uint64_t flip_all_directions(uint64_t player, uint64_t opponent, uint64_t move);
+uint64_t get_legal_moves(uint64_t player, uint64_t opponent);
+std::pair<uint64_t, uint64_t> normalize_key(uint64_t my_stones, uint64_t opponent_stones);
+int normalize_symmetry(uint64_t my_stones, uint64_t opponent_stones);
+uint8_t symmetry_stabilizer(uint64_t my_stones, uint64_t opponent_stones);
+int transform_move(int move, int symmetry);
+bool symmetric_moves(int from, int to, uint8_t stabilizer);
+extern const char* const symmetry_names[8];
+extern uint64_t (*const symmetry_transforms[8])(uint64_t);
+inline bool make_child_stones(const Position& position, uint8_t move, uint64_t& child_my_stones, uint64_t& child_opponent_stones);
+
+// 親ポジションのリンクやリーフのうち最良のものの評価値を取得する関数
+// parent_movesは探索で親ポジションに作った表　無ければリンクを順に見る
+inline int8_t calculate_parent_eval(const Position& parent_position, uint8_t move, PositionManager& manager, const MoveIndex* parent_moves) {
+    int8_t parent_eval = -64;// -64で初期化
+
+    // 親ポジションの該当するリンクの評価値を検索　手のマスクから添え字を引く
+    int slot = find_link_slot(parent_position, move, parent_moves);
+    if (slot >= 0) {
+        parent_eval = parent_position.links[slot].eval_link;
+        return parent_eval;
+    }
+
+    // リーフの評価値から取得した場合、INFOレベルのデバッグログを出力
+    if (parent_position.leaf.move == move) {
+        parent_eval = parent_position.leaf.eval;
+        manager.debug_log("Found matching leaf - move: " + std::to_string(static_cast<int>(move)) +
+            ", parent_eval: " + std::to_string(static_cast<int>(parent_eval)), PositionManager::LogLevel::INFO);
+    }
+
+    // 返値 親の評価値
+    return parent_eval;
+}
+
+// ミスマッチ判定のための関数　modeごとにコンパイル時に分けて、そのmodeに必要な値だけを計算する
+// 判定に使った値と不一致の大きさ(評価値の差の絶対値)をdetailに入れる
+template<int Mode>
+bool judge_mismatch(const Position& child_position, const Position& parent_position, uint8_t move, PositionManager& manager, MismatchDetail& detail, const MoveIndex* parent_moves = nullptr) {
+    static_assert(Mode >= 1 && Mode <= 4, "judge_mismatch: mode must be 1-4");
+    int8_t child_eval = child_position.eval_value;
+    detail.mode = Mode;
+    detail.child_eval = child_eval;
+    bool mismatch = false;
+
+    // 比較内容の文字列はDEBUGのときだけ作る
+    const bool debug = manager.log_level == PositionManager::LogLevel::DEBUG;
+    std::string comparison_details;
+
+    if constexpr (Mode == 1) {
+        // Mode 1: リンクが存在し、子ポジションのリーフの評価値がリンクの最大評価値より大きい場合に不一致　親は見ない
+        if (!child_position.links.empty()) {
+            int8_t max_child_link_eval = child_position.max_link_eval;
+            mismatch = child_position.leaf.eval > max_child_link_eval;
+            detail.severity = child_position.leaf.eval - max_child_link_eval;
+            detail.max_child_eval = max_child_link_eval;
+            if (debug) {
+                comparison_details = "Mode 1: leaf_eval (" + std::to_string(child_position.leaf.eval) +
+                    ") vs max_child_link_eval (" + std::to_string(max_child_link_eval) + ")";
+            }
+        }
+        else if (debug) {
+            // リンクが存在しない場合は不一致としない
+            comparison_details = "Mode 1: No links present, skipping mismatch check";
+        }
+    }
+    else if constexpr (Mode == 2) {
+        // Mode 2: 子ポジションの評価値と最大評価値を比較　親は見ない
+        int8_t raw_max_child_move_eval = child_position.max_move_eval;
+        int8_t max_child_move_eval = std::max<int8_t>(raw_max_child_move_eval, -64);
+        mismatch = child_eval != max_child_move_eval;
+        detail.severity = std::abs(child_eval - max_child_move_eval);
+        detail.max_child_eval = raw_max_child_move_eval;
+        if (debug) {
+            comparison_details = "Mode 2: child_eval (" + std::to_string(child_eval) +
+                ") vs max_child_move_eval (" + std::to_string(max_child_move_eval) + ")";
+        }
+    }
+    else if constexpr (Mode == 3) {
+        // Mode 3: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションの評価値の反転を比較　子の最大評価値は不要
+        int8_t parent_eval = calculate_parent_eval(parent_position, move, manager, parent_moves);
+        mismatch = parent_eval != -child_eval;
+        detail.severity = std::abs(parent_eval + child_eval);
+        detail.has_parent_eval = true;
+        detail.parent_eval = parent_eval;
+        if (debug) {
+            comparison_details = "Mode 3: parent_eval (" + std::to_string(parent_eval) +
+                ") vs -child_eval (" + std::to_string(-child_eval) + ")";
+        }
+    }
+    else {
+        // Mode 4: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションのリンクやリーフの内の最大評価値の反転を比較
+        int8_t raw_max_child_move_eval = child_position.max_move_eval;
+        int8_t max_child_move_eval = std::max<int8_t>(raw_max_child_move_eval, -64);
+        int8_t parent_eval = calculate_parent_eval(parent_position, move, manager, parent_moves);
+        mismatch = parent_eval != -max_child_move_eval;
+        detail.severity = std::abs(parent_eval + max_child_move_eval);
+        detail.has_parent_eval = true;
+        detail.parent_eval = parent_eval;
+        detail.max_child_eval = raw_max_child_move_eval;
+        if (debug) {
+            comparison_details = "Mode 4: parent_eval (" + std::to_string(parent_eval) +
+                ") vs -max_child_move_eval (" + std::to_string(-max_child_move_eval) + ")";
+        }
+    }
+
+    if (debug) {
+        if (mismatch) {
+            manager.debug_log("Mismatch detected: " + comparison_details, PositionManager::LogLevel::DEBUG);
+        }
+        else {
+            manager.debug_log("No mismatch: " + comparison_details, PositionManager::LogLevel::DEBUG);
+        }
+    }
+
+    return mismatch;
+}
+
+// 不一致発見の場合の処理　判定で計算済みの最大評価値はdetailから使い回す
+template<int Mode>
+void mismatch_process(const Position& child_position, const std::string& kifu, const std::string& transformation_name, MismatchOutput& output, PositionManager& manager, int8_t child_eval, int8_t parent_eval, MismatchDetail& detail) {
+
+    // 子ポジションまでの手数 (パスは棋譜に残らないので数えない)　とレポート用の正規化後の盤面
+    detail.depth = static_cast<int>(kifu.length() / 2);
+    detail.canonical_my_stones = transform_board(child_position.my_stones, transformation_name);
+    detail.canonical_opponent_stones = transform_board(child_position.opponent_stones, transformation_name);
+    detail.transformation = transformation_name;
+    detail.game_count = child_position.game_count;
+
+    if constexpr (Mode == 1) {
+        // Mode 1: 子ポジションのリーフまでの棋譜を出力
+        std::string move_str, updated_kifu;
+        std::tie(move_str, updated_kifu) = convert_move_to_str(child_position.leaf.move, kifu, manager);
+        output.write(updated_kifu, detail);
+        manager.debug_log("Mismatch found (Mode 1, leaf move). Kifu: " + updated_kifu + " (Move: " + std::to_string(child_position.leaf.move) + ")", PositionManager::LogLevel::DEBUG);
+    }
+    else {
+        // mode 3 は判定で最大評価値を使わないのでここで入れる
+        if constexpr (Mode == 3) {
+            detail.max_child_eval = child_position.max_move_eval;
+        }
+        int8_t max_child_move_eval = detail.max_child_eval;
+
+        bool is_greater = false;
+        int8_t comparison_value;
+
+        // モードに応じて不一致の条件と比較値を設定
+        if constexpr (Mode == 2) {
+            // Mode 2: 子ポジションの評価値と最大評価値を比較
+            is_greater = max_child_move_eval > child_eval;
+            comparison_value = -child_eval;
+        }
+        else if constexpr (Mode == 3) {
+            // Mode 3: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションの評価値の反転を比較
+            is_greater = -child_eval > parent_eval;
+            comparison_value = -parent_eval;
+        }
+        else {
+            // Mode 4: 親ポジションの該当するリンクやリーフの手の評価値と子ポジションのリンクやリーフの内の最大評価値の反転を比較
+            is_greater = -max_child_move_eval > parent_eval;
+            comparison_value = -parent_eval;
+        }
+
+        if (is_greater) {
+            // 分岐その1: 条件を満たす全ての子ポジションのリンクやリーフを出力
+            for (const auto& link : child_position.links) {
+                if (link.eval_link > comparison_value) {
+                    std::string move_str, updated_kifu;
+                    std::tie(move_str, updated_kifu) = convert_move_to_str(link.move, kifu, manager);
+                    output.write(updated_kifu, detail);
+                    manager.debug_log("Mismatch found (multiple moves). Kifu: " + updated_kifu + " (Move: " + std::to_string(link.move) + ")", PositionManager::LogLevel::DEBUG);
+                }
+            }
+            if (child_position.leaf.eval > comparison_value) {
+                std::string move_str, updated_kifu;
+                std::tie(move_str, updated_kifu) = convert_move_to_str(child_position.leaf.move, kifu, manager);
+                output.write(updated_kifu, detail);
+                manager.debug_log("Mismatch found (leaf move). Kifu: " + updated_kifu + " (Move: " + std::to_string(child_position.leaf.move) + ")", PositionManager::LogLevel::DEBUG);
+            }
+        }
+        else {
+            // 分岐その2: 判定に使った子ポジションの手までの棋譜を出力　手は読み込み時に計算済み
+            uint8_t max_child_move = child_position.best_move;
+            if (child_position.leaf.eval == max_child_move_eval) {
+                manager.debug_log("Leaf evaluation used for max_child_move_eval", PositionManager::LogLevel::INFO);
+            }
+
+            std::string move_str, updated_kifu;
+            std::tie(move_str, updated_kifu) = convert_move_to_str(max_child_move, kifu, manager);
+            output.write(updated_kifu, detail);
+            manager.debug_log("Mismatch found (single move). Kifu: " + updated_kifu + " (Move: " + std::to_string(max_child_move) + ")", PositionManager::LogLevel::DEBUG);
+        }
+    }
+}
+
+// 1つのmodeの判定と出力　ModeMaskに含まれないmodeはコンパイル時に消える
+template<int Mode, unsigned ModeMask>
+inline void check_mode(const Position& child_position, const Position& parent_position, const MoveIndex& parent_moves, uint8_t move, const std::string& new_kifu,
+    const std::string& transformation_name, const ModeOutputTable& outputs, PositionManager& manager) {
+    if constexpr ((ModeMask & mode_bit(Mode)) != 0) {
+        MismatchDetail detail;
+        if (judge_mismatch<Mode>(child_position, parent_position, move, manager, detail, &parent_moves)) {
+            mismatch_process<Mode>(child_position, new_kifu, transformation_name, *outputs[Mode], manager,
+                child_position.eval_value, parent_position.eval_value, detail);
+        }
+    }
+}
+
+// リーフを値の計算に使うか　get_children と同じく、手が無い(65)か空のリーフは使わない
+inline bool is_usable_leaf(const Leaf& leaf) {
+    return leaf.move != 65 && !(leaf.move == 0 && leaf.eval == 0);
+}
+
+// 対称な盤面では対称な手は同じ子ポジションになるので、評価値も同じなら前の手だけ辿るように後の手を訪問済みにする
+// 評価値が違う場合は判定の結果が変わるので両方辿る　返値: 訪問済みにした手の数
+size_t prune_symmetric_moves(Position& position) {
+    uint8_t stabilizer = symmetry_stabilizer(position.my_stones, position.opponent_stones);
+    if (stabilizer == 0) {
+        return 0;
+    }
+    size_t pruned = 0;
+    auto has_representative = [&](size_t end, uint8_t move, int8_t eval) {
+        for (size_t j = 0; j < end; ++j) {
+            const Link& link = position.links[j];
+            if (!link.visited && link.eval_link == eval && symmetric_moves(link.move, move, stabilizer)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    for (size_t i = 0; i < position.links.size(); ++i) {
+        Link& link = position.links[i];
+        if (!link.visited && has_representative(i, link.move, link.eval_link)) {
+            link.visited = true;
+            pruned++;
+        }
+    }
+    if (is_usable_leaf(position.leaf) && !position.leaf.visited && has_representative(position.links.size(), position.leaf.move, position.leaf.eval)) {
+        position.leaf.visited = true;
+        pruned++;
+    }
+    return pruned;
+}
+
+// 探索を止めたシグナル (SIGINT, SIGTERM)　0なら止めていない
+volatile std::sig_atomic_t traversal_interrupt_signal = 0;
+
+void on_traversal_signal(int signal) {
+    traversal_interrupt_signal = signal;
+}
+
+// チェックポイントのファイル　ヘッダー → modeごとの出力の状態 → 探索中のポジション (棋譜付き) → bookの訪問済みフラグを詰めたもの
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t book_size;
+    int64_t book_time;
+    uint64_t position_count;
+    uint64_t key_order_hash;  // book_positionsを回す順番の確認用　フラグはこの順番で詰める
+    uint32_t mode_mask;
+    uint32_t output_count;
+    uint64_t loop_count;
+    uint64_t completed_skip_count;
+    uint64_t symmetry_pruned_count;
+    uint64_t frame_count;
+    uint64_t flag_bytes;
+};
+
+struct CheckpointOutput {
+    uint64_t line_count;
+    uint64_t file_size;
+    uint64_t report_size;
+};
+
+struct CheckpointFrame {
+    uint64_t my_stones;
+    uint64_t opponent_stones;
+    uint64_t link_visited;  // linksの添え字ごとの訪問済みフラグ
+    uint32_t leaf_visited;
+    uint32_t kifu_length;
+};
+
+// チェックポイントから作り直した探索中のポジション
+struct TraversalFrame {
+    Position position;
+    std::string kifu;
+    const Position* record = nullptr;  // 正規化したbookのレコード　辿り終わった印を付ける
+};
+
+// 探索のチェックポイント　探索中のポジションの並びとbookの訪問済みフラグ、出力の大きさを書き出し、--resume でそこから続ける
+// 中身は探索のループの先頭で作り、ファイルへの書き込みだけ別スレッドで行う
+class TraversalCheckpoint {
+public:
+    TraversalCheckpoint(const std::string& path, unsigned interval_seconds, const std::string& book_path, unsigned mode_mask,
+        std::vector<ModeTarget>& targets, PositionManager& manager)
+        : path(path),
+        interval(interval_seconds),
+        targets(targets),
+        manager(manager),
+        next_save_time(std::chrono::steady_clock::now() + std::chrono::seconds(interval_seconds)) {
+        std::memcpy(base_header.magic, "EDXCKPT1", sizeof(base_header.magic));
+        std::error_code error;
+        base_header.book_size = static_cast<uint64_t>(std::filesystem::file_size(book_path, error));
+        base_header.book_time = static_cast<int64_t>(std::filesystem::last_write_time(book_path, error).time_since_epoch().count());
+        base_header.position_count = book_positions.size();
+        base_header.mode_mask = mode_mask;
+        base_header.output_count = static_cast<uint32_t>(targets.size());
+        if (path.empty()) {
+            return;
+        }
+        // 回す順番とフラグのビット数はbookを読んだ後は変わらないので1回だけ数える
+        uint64_t hash = 14695981039346656037ULL;
+        for (const auto& entry : book_positions) {
+            hash = (hash ^ entry.first.first) * 1099511628211ULL;
+            hash = (hash ^ entry.first.second) * 1099511628211ULL;
+            flag_bits += entry.second.links.size() + 2;
+        }
+        base_header.key_order_hash = hash;
+    }
+
+    ~TraversalCheckpoint() {
+        wait_for_writer();
+    }
+
+    // 探索のループの先頭で呼ぶ　シグナルが来ていれば最後のチェックポイントと出力を書いて終了、時間が来ていれば書き出す
+    void poll() {
+        if (traversal_interrupt_signal != 0) {
+            interrupt();
+        }
+        if (path.empty() || interval == 0 || (++poll_count & 1023) != 0) {
+            return;
+        }
+        if (std::chrono::steady_clock::now() >= next_save_time) {
+            std::string data = serialize();
+            wait_for_writer();
+            writer = std::thread([this, data = std::move(data)]() { write_file(data); });
+            saved_count++;
+            next_save_time = std::chrono::steady_clock::now() + std::chrono::seconds(interval);
+        }
+    }
+
+    // チェックポイントを読んでbookのフラグと出力、カウンターを戻し、探索中のポジションを作り直す
+    bool restore(std::vector<TraversalFrame>& frames) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            manager.debug_log("Checkpoint not found: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+        CheckpointHeader header{};
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, base_header.magic, sizeof(header.magic)) != 0 ||
+            header.book_size != base_header.book_size || header.book_time != base_header.book_time ||
+            header.position_count != base_header.position_count || header.key_order_hash != base_header.key_order_hash ||
+            header.flag_bytes != (flag_bits + 7) / 8) {
+            manager.debug_log("Checkpoint does not match the book: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+        if (header.mode_mask != base_header.mode_mask || header.output_count != base_header.output_count) {
+            manager.debug_log("Checkpoint was written with different modes: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+
+        // 全部読んで確かめてから戻す
+        std::vector<CheckpointOutput> outputs(header.output_count);
+        bool ok = static_cast<bool>(file.read(reinterpret_cast<char*>(outputs.data()), outputs.size() * sizeof(CheckpointOutput)));
+        for (uint64_t i = 0; ok && i < header.frame_count; ++i) {
+            CheckpointFrame saved{};
+            ok = static_cast<bool>(file.read(reinterpret_cast<char*>(&saved), sizeof(saved)));
+            std::string kifu(ok ? saved.kifu_length : 0, '\0');
+            ok = ok && file.read(kifu.data(), kifu.size());
+            if (!ok) {
+                break;
+            }
+            auto [normalized, transformation] = normalize_position(saved.my_stones, saved.opponent_stones, manager);
+            const Position* record = read_position(std::get<0>(normalized), std::get<1>(normalized));
+            if (!record) {
+                manager.debug_log("Checkpoint position not found in book", PositionManager::LogLevel::ERROR);
+                return false;
+            }
+            TraversalFrame frame{ denormalize_book_position(*record, saved.my_stones, saved.opponent_stones, transformation, manager), std::move(kifu), record };
+            for (size_t link = 0; link < frame.position.links.size() && link < 64; ++link) {
+                frame.position.links[link].visited = (saved.link_visited >> link) & 1;
+            }
+            frame.position.leaf.visited = saved.leaf_visited != 0;
+            frames.push_back(std::move(frame));
+        }
+        std::vector<uint8_t> flags(header.flag_bytes);
+        ok = ok && file.read(reinterpret_cast<char*>(flags.data()), flags.size());
+        if (!ok || frames.empty()) {
+            manager.debug_log("Checkpoint is truncated: " + path, PositionManager::LogLevel::ERROR);
+            return false;
+        }
+
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (!targets[i].output->restore(outputs[i].line_count, outputs[i].file_size, outputs[i].report_size)) {
+                return false;
+            }
+        }
+        size_t bit = 0;
+        auto get = [&]() { bool value = (flags[bit >> 3] >> (bit & 7)) & 1; bit++; return value; };
+        for (auto& entry : book_positions) {
+            for (auto& link : entry.second.links) {
+                link.visited = get();
+            }
+            entry.second.leaf.visited = get();
+            entry.second.subtree_completed = get();
+        }
+        manager.loop_count = header.loop_count;
+        manager.completed_skip_count = header.completed_skip_count;
+        manager.symmetry_pruned_count = header.symmetry_pruned_count;
+        return true;
+    }
+
+    // 探索が最後まで終わったらチェックポイントは要らないので消す
+    void complete() {
+        wait_for_writer();
+        if (path.empty()) {
+            return;
+        }
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        std::filesystem::remove(path + ".tmp", error);
+        if (saved_count > 0) {
+            manager.debug_log("Checkpoints written: " + std::to_string(saved_count), PositionManager::LogLevel::INFO);
+        }
+    }
+
+private:
+    // シグナルで止めた場合　最後のチェックポイントを書き、バッファの出力を書き出して終了
+    [[noreturn]] void interrupt() {
+        int signal = traversal_interrupt_signal;
+        std::cout << std::endl << "Interrupted (signal " << signal << ") at " << manager.loop_count << " Links or Leaf processed" << std::endl;
+        wait_for_writer();
+        if (!path.empty()) {
+            write_file(serialize());
+            report_write_error();
+            std::cout << "Checkpoint written: " << path << " (run with --resume to continue)" << std::endl;
+        }
+        for (ModeTarget& target : targets) {
+            target.output->finish();
+        }
+        manager.debug_log("Traversal interrupted by signal " + std::to_string(signal) + " at " + std::to_string(manager.loop_count) + " Links or Leaf processed", PositionManager::LogLevel::WARNING);
+        std::exit(128 + signal);
+    }
+
+    std::string serialize() {
+        CheckpointHeader header = base_header;
+        header.loop_count = manager.loop_count;
+        header.completed_skip_count = manager.completed_skip_count;
+        header.symmetry_pruned_count = manager.symmetry_pruned_count;
+        header.frame_count = manager.traversal_stack.size();
+        header.flag_bytes = (flag_bits + 7) / 8;
+
+        std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (ModeTarget& target : targets) {
+            auto [file_size, report_size] = target.output->flushed_sizes();
+            CheckpointOutput output{ target.output->line_count(), file_size, report_size };
+            data.append(reinterpret_cast<const char*>(&output), sizeof(output));
+        }
+        for (const auto& [position, kifu] : manager.traversal_stack) {
+            CheckpointFrame frame{ position->my_stones, position->opponent_stones, 0, position->leaf.visited, static_cast<uint32_t>(kifu->size()) };
+            for (size_t link = 0; link < position->links.size() && link < 64; ++link) {
+                frame.link_visited |= static_cast<uint64_t>(position->links[link].visited) << link;
+            }
+            data.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+            data.append(*kifu);
+        }
+        // レコードごとにリンクの数 + 2 ビット (リンク、リーフ、辿り終わった印)
+        size_t offset = data.size();
+        data.resize(offset + header.flag_bytes, '\0');
+        size_t bit = 0;
+        auto put = [&](bool value) { data[offset + (bit >> 3)] |= static_cast<char>(value << (bit & 7)); bit++; };
+        for (const auto& entry : book_positions) {
+            for (const auto& link : entry.second.links) {
+                put(link.visited);
+            }
+            put(entry.second.leaf.visited);
+            put(entry.second.subtree_completed);
+        }
+        return data;
+    }
+
+    // 一時ファイルに書いてから置き換える　途中で止まっても前のチェックポイントは壊れない
+    void write_file(const std::string& data) {
+        std::string temp_path = path + ".tmp";
+        bool ok;
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            ok = file.is_open() && file.write(data.data(), data.size()) && file.flush();
+        }
+        std::error_code error;
+        if (ok) {
+            std::filesystem::rename(temp_path, path, error);
+        }
+        write_failed = !ok || error;
+    }
+
+    void wait_for_writer() {
+        if (writer.joinable()) {
+            writer.join();
+            report_write_error();
+        }
+    }
+
+    void report_write_error() {
+        if (write_failed) {
+            manager.debug_log("Failed to write checkpoint: " + path, PositionManager::LogLevel::ERROR);
+            write_failed = false;
+        }
+    }
+
+    std::string path;
+    unsigned interval;
+    std::vector<ModeTarget>& targets;
+    PositionManager& manager;
+    std::chrono::steady_clock::time_point next_save_time;
+    CheckpointHeader base_header{};
+    size_t flag_bits = 0;
+    size_t poll_count = 0;
+    size_t saved_count = 0;
+    std::thread writer;
+    bool write_failed = false;  // 書き込みのスレッドが書き、joinした後に読む
+};
+
+template<unsigned ModeMask>
+void main_process_recursive(Position& current_position, const Position* current_record, std::string current_kifu, const ModeOutputTable& outputs, PositionManager& manager);
+
+// 子ポジションを順番に辿るループ　チェックポイントからの再開ではここから続ける
+// current_recordは正規化したbookのレコード (親のprocess_positionで引いたもの)　辿り終わったら印を付ける
+template<unsigned ModeMask>
+void traverse_children(Position& current_position, const Position* current_record, const std::string& current_kifu, const ModeOutputTable& outputs, PositionManager& manager) {
+    // 子positionを得る　親ポジションの手→添え字の表は子の判定で使い回す
+    Position child_position;
+    std::string new_kifu, transformation_name;
+    uint8_t move;
+    const Position* child_record = nullptr;
+    const MoveIndex parent_moves = make_move_index(current_position);
+    while (true){
+        // チェックポイントの時間とシグナルの確認　ここなら探索中のポジションの並びがそのまま書き出せる
+        if (manager.checkpoint) {
+            manager.checkpoint->poll();
+        }
+        manager.current_position = current_position;
+        manager.current_kifu = current_kifu;
+        manager.debug_log("Current position: " + format_position(current_position), PositionManager::LogLevel::DEBUG);
+        manager.debug_log("Current kifu: " + current_kifu, PositionManager::LogLevel::DEBUG);
+
+        std::tie(child_position, new_kifu, transformation_name, move, child_record) = get_children(manager, current_position);
+
+        // この条件を満たしたらこのmain_process_recursiveの処理を終わり一つ上のmain_process_recursiveへ移動
+        if (transformation_name == "child_not_found") {
+            manager.debug_log("Child position not found. Ending current branch.", PositionManager::LogLevel::DEBUG);
+            break;
+        }
+            
+        // 比較関数と不一致の場合出力をする関数を呼び出し
+        else {
+            if (new_kifu.length() >= 4 && new_kifu.substr(new_kifu.length() - 4) == "Pass") {
+                new_kifu.resize(new_kifu.length() - 4);
+                manager.debug_log("Pass detected and removed from new_kifu, updated kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
+            }
+            
+            // 子ポジションの生成とbookの照合は共通　判定だけmodeの数だけ行う
+            check_mode<1, ModeMask>(child_position, current_position, parent_moves, move, new_kifu, transformation_name, outputs, manager);
+            check_mode<2, ModeMask>(child_position, current_position, parent_moves, move, new_kifu, transformation_name, outputs, manager);
+            check_mode<3, ModeMask>(child_position, current_position, parent_moves, move, new_kifu, transformation_name, outputs, manager);
+            check_mode<4, ModeMask>(child_position, current_position, parent_moves, move, new_kifu, transformation_name, outputs, manager);
+
+            // 親ポジションを更新
+            manager.current_position = child_position;
+            manager.current_kifu = new_kifu;
+
+            // 先頭へ戻る (子positionで同じ処理を行う)
+            main_process_recursive<ModeMask>(child_position, child_record, new_kifu, outputs, manager);
+        }
+    }
+
+    // このポジションから先は全て辿り終わったので正規化したレコードに印を付ける　レコードは引き直さない
+    if (current_record) {
+        current_record->subtree_completed = true;
+    }
+    // bookを分けて持っている場合は、辿り終わった印を残してこのポジションで読んだレコードを捨てる
+    if (remote_lookup || book_image || book_index) {
+        release_book_records(current_record);
+    }
+    manager.traversal_stack.pop_back();
+}
+
+// 探索本体　ModeMaskでどのmodeを判定するかをコンパイル時に決める　dispatchはmain_processで1回だけ
+template<unsigned ModeMask>
+void main_process_recursive(Position& current_position, const Position* current_record, std::string current_kifu, const ModeOutputTable& outputs, PositionManager& manager){
+    // ループカウンターをインクリメント
+    manager.loop_count++;
+
+    // ループごとにコマンドラインの表示を更新（表示頻度を調整可能）
+    if (manager.loop_count == 1 || manager.loop_count % 100000 == 0) {
+        std::cout << "\r" << manager.loop_count << " Links or Leaf processed" << std::flush;
+    }
+
+    // 手数の上限がある場合は上限の手数のポジションから先は辿らない
+    // 手数 (パスを除く) は石の数で決まるので、どの手順で来ても同じ手数になり辿り終わった印もそのまま使える
+    if (manager.max_ply > 0 && current_kifu.size() / 2 >= static_cast<size_t>(manager.max_ply)) {
+        manager.max_ply_cutoff_count++;
+        return;
+    }
+    // 別の手順(転置)で来たポジションの先を全て辿り終わっていればすぐ戻る　印はbookのレコードからコピーされてくる
+    if (current_position.subtree_completed) {
+        manager.completed_skip_count++;
+        return;
+    }
+    manager.symmetry_pruned_count += prune_symmetric_moves(current_position);
+
+    // bookを分けて持っている場合は子ポジションを先にまとめて問い合わせておく　レコードはこのポジションを辿り終わるまで持つ
+    manager.traversal_stack.emplace_back(&current_position, &current_kifu);
+    if (remote_lookup) {
+        prefetch_lookup_children(current_position);
+    }
+    traverse_children<ModeMask>(current_position, current_record, current_kifu, outputs, manager);
+}
+
+// チェックポイントから作り直したポジションの並びの続きを辿る　深い方のポジションの残りを辿ってから浅い方に戻る
+template<unsigned ModeMask>
+void resume_main_process_recursive(std::vector<TraversalFrame>& frames, size_t depth, const ModeOutputTable& outputs, PositionManager& manager) {
+    TraversalFrame& frame = frames[depth];
+    manager.traversal_stack.emplace_back(&frame.position, &frame.kifu);
+    if (depth + 1 < frames.size()) {
+        resume_main_process_recursive<ModeMask>(frames, depth + 1, outputs, manager);
+    }
+    traverse_children<ModeMask>(frame.position, frame.record, frame.kifu, outputs, manager);
+}
+
+// 実行時のmodeの組み合わせに合うModeMaskを1回だけ選んでbodyに渡す　body(std::integral_constant<unsigned, ModeMask>)
+template<unsigned... Masks, class Body>
+void dispatch_mode_mask(std::integer_sequence<unsigned, Masks...>, unsigned mode_mask, Body&& body) {
+    ((mode_mask == Masks ? body(std::integral_constant<unsigned, Masks>()) : void()), ...);
+}
+
+// メイン関数　本来スタック管理と不一致の発見は関数を分けるべきなんだろうけれども　最初の部分は開始処理
+// 判定するmodeと出力先を用意　mode 6はmodeごとに mismatched_positions_mode1.txt のように分ける
+std::vector<ModeTarget> make_mode_targets(const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    std::vector<ModeTarget> targets;
+    if (config.mode == 6) {
+        for (int mode : config.multi_modes) {
+            std::string mode_output_path = add_path_suffix(output_path, "_mode" + std::to_string(mode));
+            targets.push_back({ mode, std::make_unique<MismatchOutput>(mode_output_path, manager, config.ranked_output, config.ranked_top_k, config.ranked_weight_by_games, config.report_format) });
+        }
+    }
+    else {
+        targets.push_back({ config.mode, std::make_unique<MismatchOutput>(output_path, manager, config.ranked_output, config.ranked_top_k, config.ranked_weight_by_games, config.report_format) });
+    }
+    return targets;
+}
+
+// 棋譜を初期局面から並べたポジション　パスは棋譜に残らないので打てる手が無ければパスして進める
+// 返値: 棋譜が読めないか打てない手があればfalse
+bool replay_kifu(const std::string& kifu, uint64_t& my_stones, uint64_t& opponent_stones) {
+    if (kifu.size() % 2 != 0) {
+        return false;
+    }
+    my_stones = 0x0000000810000000ULL;
+    opponent_stones = 0x0000001008000000ULL;
+    for (size_t i = 0; i < kifu.size(); i += 2) {
+        char col = kifu[i], row = kifu[i + 1];
+        if (col < 'a' || col > 'h' || row < '1' || row > '8') {
+            return false;
+        }
+        uint64_t move_bit = 1ULL << (63 - ((row - '1') * 8 + (col - 'a')));
+        if (get_legal_moves(my_stones, opponent_stones) == 0) {
+            std::swap(my_stones, opponent_stones);
+        }
+        if (!(get_legal_moves(my_stones, opponent_stones) & move_bit)) {
+            return false;
+        }
+        uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+        my_stones |= move_bit | flipped;
+        opponent_stones ^= flipped;
+        std::swap(my_stones, opponent_stones);
+    }
+    return true;
+}
+
+// start_kifuの棋譜を初期局面から並べて、探索を始めるポジションをbookから作る
+// 最後に打てる手が無い場合はパスした後のポジションも探す
+bool make_prefix_root(const std::string& kifu, TraversalFrame& root, PositionManager& manager) {
+    uint64_t my_stones, opponent_stones;
+    if (!replay_kifu(kifu, my_stones, opponent_stones)) {
+        return false;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        auto [normalized, transformation] = normalize_position(my_stones, opponent_stones, manager);
+        const Position* record = read_position(std::get<0>(normalized), std::get<1>(normalized));
+        if (record) {
+            root.position = denormalize_book_position(*record, my_stones, opponent_stones, transformation, manager);
+            root.kifu = kifu;
+            root.record = record;
+            return true;
+        }
+        if (get_legal_moves(my_stones, opponent_stones) != 0) {
+            break;
+        }
+        std::swap(my_stones, opponent_stones);
+    }
+    return false;
+}
+
+// プログラム全体の実行時間を計算して実行時間をログに出力、コンソールにも実行時間を出力　どのmodeも最後に呼ぶ
+void report_total_time(PositionManager& manager) {
+    auto program_end_time = std::chrono::steady_clock::now();
+    std::chrono::duration<double> program_duration = program_end_time - manager.program_start_time;
+    manager.debug_log("Total program execution time: " + std::to_string(program_duration.count()) + " seconds", PositionManager::LogLevel::WARNING);
+    std::cout << "Total program execution time: " << program_duration.count() << " seconds" << std::endl;
+}
+
+void main_process(const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    std::vector<ModeTarget> targets = make_mode_targets(output_path, manager, config);
+
+    try {
+        // プログラム全体の実行時間の測定
+        manager.program_start_time = std::chrono::steady_clock::now();
+
+        // 初期局面をbookから読み取る
+        const Position* initial_book_position = read_position(0x0000000810000000ULL, 0x0000001008000000ULL);
+        if (!initial_book_position) {
+            manager.debug_log("Initial position not found in book. Terminating program.", PositionManager::LogLevel::ERROR);
+            std::exit(1);
+        }
+
+        // 探索を始めるポジションを設定　start_kifuが無ければ初期局面
+        // 探索中はmanager.current_positionが書き換わるので始めるポジションは別に持つ
+        std::vector<TraversalFrame> roots;
+        if (config.start_kifu.empty()) {
+            roots.push_back({ *initial_book_position, "", initial_book_position });
+        }
+        for (const std::string& kifu : config.start_kifu) {
+            TraversalFrame root;
+            if (!make_prefix_root(kifu, root, manager)) {
+                std::cout << "Start kifu skipped (invalid or not in book): " << kifu << std::endl;
+                manager.debug_log("Start kifu is invalid or not in book: " + kifu, PositionManager::LogLevel::WARNING);
+                continue;
+            }
+            roots.push_back(std::move(root));
+        }
+        manager.max_ply = config.max_ply;
+
+        // modeごとの出力先の表とModeMaskを作る
+        ModeOutputTable outputs = {};
+        unsigned mode_mask = 0;
+        for (ModeTarget& target : targets) {
+            outputs[target.mode] = target.output.get();
+            mode_mask |= mode_bit(target.mode);
+        }
+
+        // チェックポイント　rankedは最後に並べ替えるまで出力をためているので途中の状態を書き出せない
+        // start_kifu, max_plyの探索は始めるポジションの並びと上限を書き出していないので再開できない
+        // lookup_workers, book_image, book_indexの場合は手元にbookの一部しか無いのでフラグを書き出せない
+        std::string checkpoint_path = config.checkpoint_file;
+        if (config.ranked_output || !config.start_kifu.empty() || config.max_ply > 0 || remote_lookup || book_image || book_index) {
+            if (config.resume) {
+                std::cerr << "Error: --resume is not supported with ranked_output, start_kifu, max_ply, lookup_workers, book_image or book_index." << std::endl;
+                manager.debug_log("--resume is not supported with ranked_output, start_kifu, max_ply, lookup_workers, book_image or book_index", PositionManager::LogLevel::ERROR);
+                std::exit(1);
+            }
+            if (!checkpoint_path.empty() && config.checkpoint_interval > 0) {
+                manager.debug_log("Checkpoints are disabled with ranked_output, start_kifu, max_ply, lookup_workers, book_image or book_index", PositionManager::LogLevel::WARNING);
+            }
+            checkpoint_path.clear();
+        }
+        TraversalCheckpoint checkpoint(checkpoint_path, config.checkpoint_interval, manager.book_path, mode_mask, targets, manager);
+        manager.checkpoint = &checkpoint;
+        traversal_interrupt_signal = 0;
+        std::signal(SIGINT, on_traversal_signal);
+        std::signal(SIGTERM, on_traversal_signal);
+
+        // メイン処理 (再帰的に実装)　--resume の場合はチェックポイントの続きから
+        if (config.resume) {
+            std::vector<TraversalFrame> frames;
+            if (!checkpoint.restore(frames)) {
+                std::cerr << "Error: Failed to resume from checkpoint: " << checkpoint_path << std::endl;
+                std::exit(1);
+            }
+            std::cout << "Resuming from " << checkpoint_path << ": " << manager.loop_count << " Links or Leaf processed, depth " << frames.size() << std::endl;
+            manager.debug_log("Resuming from checkpoint: " + std::to_string(manager.loop_count) + " Links or Leaf processed, depth " + std::to_string(frames.size()), PositionManager::LogLevel::INFO);
+            dispatch_mode_mask(std::make_integer_sequence<unsigned, 16>(), mode_mask, [&](auto mask) {
+                resume_main_process_recursive<decltype(mask)::value>(frames, 0, outputs, manager);
+            });
+        }
+        else {
+            for (TraversalFrame& root : roots) {
+                manager.current_position = root.position;
+                manager.current_kifu = root.kifu;
+                dispatch_mode_mask(std::make_integer_sequence<unsigned, 16>(), mode_mask, [&](auto mask) {
+                    main_process_recursive<decltype(mask)::value>(root.position, root.record, root.kifu, outputs, manager);
+                });
+            }
+        }
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        checkpoint.complete();
+        manager.checkpoint = nullptr;
+    }
+    // エラー処理が起動される日は来るのだろうか
+    catch (const std::exception& e) {
+        manager.debug_log("Exception in main_process: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
+        std::cerr << "Critical error in main_process: " << e.what() << std::endl;
+        std::exit(1);// プログラムを終了
+    }
+
+    // rankedの場合はここで並べ替えて書き出す
+    for (ModeTarget& target : targets) {
+        target.output->finish();
+        manager.debug_log("Mode " + std::to_string(target.mode) + " mismatches written: " + std::to_string(target.output->line_count()), PositionManager::LogLevel::INFO);
+    }
+
+    // 最終ループ数を出力、デバッグログにも最終ループ数を記録
+    std::cout << "\r" << manager.loop_count << " Links or Leaf processed (Final)" << std::endl;
+    manager.debug_log("Total Links or Leaf processed: " + std::to_string(manager.loop_count), PositionManager::LogLevel::WARNING);
+    std::cout << manager.completed_skip_count << " Re-entries into completed positions skipped" << std::endl;
+    manager.debug_log("Re-entries into completed positions skipped: " + std::to_string(manager.completed_skip_count), PositionManager::LogLevel::WARNING);
+    std::cout << manager.symmetry_pruned_count << " Symmetric moves pruned" << std::endl;
+    manager.debug_log("Symmetric moves pruned: " + std::to_string(manager.symmetry_pruned_count), PositionManager::LogLevel::WARNING);
+    if (manager.max_ply > 0) {
+        std::cout << manager.max_ply_cutoff_count << " Positions stopped at max_ply " << manager.max_ply << std::endl;
+        manager.debug_log("Positions stopped at max_ply: " + std::to_string(manager.max_ply_cutoff_count), PositionManager::LogLevel::WARNING);
+    }
+
+    report_total_time(manager);
+}
+
+// streaming_checkで使える設定か　mode 1, 2 は親を見ないのでbook.datを流し読みして判定できる
+// mode 3, 4 は親の手と子ポジションの組 (辺) を外部ソートしてbookと突き合わせる
+bool streaming_check_supported(const ToolConfig& config) {
+    std::vector<int> modes = config.mode == 6 ? config.multi_modes : std::vector<int>{ config.mode };
+    return std::all_of(modes.begin(), modes.end(), [](int mode) { return mode >= 1 && mode <= 4; });
+}
+
+// streaming_checkのmode 3, 4 で使う親の手から子ポジションへの辺　外部ソートのランにそのまま書き出す
+struct StreamingEdge {
+    uint64_t child_my_stones;        // 正規化した子ポジション (ソートのキー)
+    uint64_t child_opponent_stones;
+    uint64_t parent_my_stones;       // 正規化した親ポジション
+    uint64_t parent_opponent_stones;
+    uint64_t parent_record;          // 親のレコードがbook.datの何番目か　同じポジションが何度もある場合は最初のレコードの辺だけ使う
+    uint8_t move;                    // 親の手 (正規化した向き)
+    int8_t parent_eval;              // 親のリンクかリーフの評価値
+    uint8_t mismatch_flags;          // 不一致のmodeのmode_bit　bookと突き合わせた後に入れる
+};
+
+std::vector<StreamingEdge> find_streaming_edge_mismatches(const std::string& book_path, const std::string& run_prefix, size_t memory_bytes, unsigned mode_mask, PositionManager& manager, size_t& positions_read, bool& opened);
+
+// 盤面のキーだけの索引で初期局面から辿って、出力したいポジションの棋譜を探すためのもの一式
+// mode 7 (bottom-upで棋譜が無い) とmode 12 で使う　streaming_checkは索引を作らずに、target_keysとreportだけ使って外部ソートで辿る
+// 棋譜を探す索引の1件　キーと、movesの中のこのポジションの手の位置
+struct KifuSearchNode {
+    std::pair<uint64_t, uint64_t> key;
+    uint64_t moves;
+};
+
+struct KifuSearch {
+    std::vector<KifuSearchNode> nodes;                         // bookの全ポジション (run_kifu_searchでキーの順に並べる)
+    std::vector<uint8_t> moves;                                // ポジションごとに手の数(1バイト)と、bookの向きのリンクとリーフの手
+    std::vector<bool> expanded;                                // nodesと同じ並びの展開済みフラグ
+    std::vector<std::pair<uint64_t, uint64_t>> target_keys;    // 棋譜が欲しいポジションのキー (ソート済み)
+    std::vector<bool> reported;                                // target_keysと同じ並びの出力済みフラグ
+    size_t reported_count = 0;
+    size_t symmetry_pruned = 0;                                // 対称な盤面で辿らなかった手の数
+
+    // 棋譜が欲しいポジションに最初に着いたときに呼ぶ (target_keysの添え字, 実際の盤面, 正規化の変換名, 棋譜)
+    std::function<void(size_t, uint64_t, uint64_t, const std::string&, const std::string&)> report;
+
+    // bookのポジションを索引に入れる　通常の探索と同じく、辿るのはリンクと使えるリーフの手だけ
+    // 1ポジションにつきキーと位置の24バイトと、手の数+手ごとに1バイト
+    void add(const std::pair<uint64_t, uint64_t>& key, const Position& record) {
+        nodes.push_back({ key, moves.size() });
+        size_t count_at = moves.size();
+        moves.push_back(0);
+        for (const Link& link : record.links) {
+            moves.push_back(link.move);
+        }
+        if (is_usable_leaf(record.leaf)) {
+            moves.push_back(record.leaf.move);
+        }
+        moves[count_at] = static_cast<uint8_t>(std::min<size_t>(moves.size() - count_at - 1, UINT8_MAX));
+    }
+};
+
+// キーのソート済み配列から二分探索　無ければ-1
+inline long long find_sorted_key(const std::vector<std::pair<uint64_t, uint64_t>>& keys, const std::pair<uint64_t, uint64_t>& key) {
+    auto it = std::lower_bound(keys.begin(), keys.end(), key);
+    if (it == keys.end() || *it != key) return -1;
+    return static_cast<long long>(it - keys.begin());
+}
+
+// 索引のポジションを二分探索　同じキーが何度もある場合は読み込みと同じく先に入れた方　無ければ-1
+inline long long find_search_node(const std::vector<KifuSearchNode>& nodes, const std::pair<uint64_t, uint64_t>& key) {
+    auto it = std::lower_bound(nodes.begin(), nodes.end(), key, [](const KifuSearchNode& node, const std::pair<uint64_t, uint64_t>& value) {
+        return node.key < value;
+    });
+    if (it == nodes.end() || it->key != key) return -1;
+    return static_cast<long long>(it - nodes.begin());
+}
+
+void kifu_search(uint64_t my_stones, uint64_t opponent_stones, size_t index, int symmetry, uint8_t stabilizer, const std::string& kifu, KifuSearch& search, PositionManager& manager);
+bool find_streaming_kifus(const std::string& book_path, const std::string& run_prefix, size_t memory_bytes, KifuSearch& search, const std::function<void(Position&)>& on_record, PositionManager& manager, bool report_root);
+
+// 変換名から変換の番号　無ければ0 (identity)
+inline int symmetry_index(const std::string& transformation) {
+    for (int i = 1; i < 8; ++i) {
+        if (transformation == symmetry_names[i]) return i;
+    }
+    return 0;
+}
+
+// 棋譜が欲しいポジションなら1回だけreportを呼ぶ　変換名はここで初めて作る
+void kifu_search_report(uint64_t my_stones, uint64_t opponent_stones, const std::pair<uint64_t, uint64_t>& key, int symmetry, const std::string& kifu, KifuSearch& search) {
+    long long target_index = find_sorted_key(search.target_keys, key);
+    if (target_index >= 0 && !search.reported[target_index]) {
+        search.reported[target_index] = true;
+        search.reported_count++;
+        search.report(static_cast<size_t>(target_index), my_stones, opponent_stones, symmetry_names[symmetry], kifu);
+    }
+}
+
+// 子ポジションがbookにあれば、棋譜が欲しいポジションなら出力して、まだ展開していなければその先を探す
+// 棋譜の文字列はbookにある子ポジションの分だけ作る (moveが64ならパスで棋譜はそのまま)
+void kifu_search_visit_child(uint64_t my_stones, uint64_t opponent_stones, const std::string& kifu, int move, KifuSearch& search, PositionManager& manager) {
+    int symmetry = normalize_symmetry(my_stones, opponent_stones);
+    auto key = symmetry == 0 ? std::make_pair(my_stones, opponent_stones)
+        : std::make_pair(symmetry_transforms[symmetry](my_stones), symmetry_transforms[symmetry](opponent_stones));
+    long long index = find_search_node(search.nodes, key);
+    if (index < 0) {
+        return;
+    }
+
+    // 対称な盤面は最小になる変換が複数あるので、通常の探索と同じ出力と棋譜になるようにnormalize_positionと同じ変換を使う
+    uint8_t stabilizer = symmetry_stabilizer(my_stones, opponent_stones);
+    if (stabilizer != 0) {
+        symmetry = symmetry_index(std::get<1>(normalize_position(my_stones, opponent_stones, manager)));
+    }
+    std::string child_kifu = move == 64 ? kifu : kifu + move_to_str(move);
+    kifu_search_report(my_stones, opponent_stones, key, symmetry, child_kifu, search);
+
+    if (!search.expanded[index]) {
+        search.expanded[index] = true;
+        kifu_search(my_stones, opponent_stones, static_cast<size_t>(index), symmetry, stabilizer, child_kifu, search, manager);
+    }
+}
+
+// 通常の探索と同じくbookのリンクとリーフの手で深さ優先で辿る　手はbookの向きなので実際の盤面の向きに戻して打つ
+// symmetryは実際の盤面を正規化する変換の番号、stabilizerは盤面の対称性 (symmetry_stabilizer)
+void kifu_search(uint64_t my_stones, uint64_t opponent_stones, size_t index, int symmetry, uint8_t stabilizer, const std::string& kifu, KifuSearch& search, PositionManager& manager) {
+    // 正規化した向きから実際の向きに戻す変換の番号 (rotate_90とrotate_270は互いに逆、他は自分自身が逆)
+    int inverse = symmetry == 1 ? 3 : symmetry == 3 ? 1 : symmetry;
+
+    // 出力する棋譜が前と変わらないように、実際の向きの手の小さい順に辿る
+    const uint8_t* record_moves = search.moves.data() + search.nodes[index].moves;
+    uint8_t move_count = record_moves[0];
+    uint8_t moves[256];
+    for (uint8_t i = 0; i < move_count; ++i) {
+        moves[i] = static_cast<uint8_t>(transform_move(record_moves[1 + i], inverse));
+    }
+    std::sort(moves, moves + move_count);
+
+    // 対称な盤面では前の手と対称な手は同じ子ポジションなので辿らない
+    for (uint8_t i = 0; i < move_count; ++i) {
+        int move = moves[i];
+        if (stabilizer != 0) {
+            bool pruned = false;
+            for (uint8_t j = 0; j < i && !pruned; ++j) {
+                pruned = symmetric_moves(moves[j], move, stabilizer);
+            }
+            if (pruned) {
+                search.symmetry_pruned++;
+                continue;
+            }
+        }
+        // 棋譜が欲しいポジションを全部出力したらそれ以上辿らない
+        if (search.reported_count == search.target_keys.size()) {
+            return;
+        }
+        // パスは棋譜に残らない
+        if (move == 64) {
+            kifu_search_visit_child(opponent_stones, my_stones, kifu, move, search, manager);
+            continue;
+        }
+        if (move > 64) {
+            continue;
+        }
+        uint64_t move_bit = 1ULL << (63 - move);
+        uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+        if (flipped == 0 || ((my_stones | opponent_stones) & move_bit)) {
+            continue;
+        }
+        kifu_search_visit_child(opponent_stones ^ flipped, my_stones | move_bit | flipped, kifu, move, search, manager);
+    }
+}
+
+// 初期局面から探す　report_rootなら初期局面自身も出力の対象にする
+void run_kifu_search(KifuSearch& search, PositionManager& manager, bool report_root) {
+    std::stable_sort(search.nodes.begin(), search.nodes.end(), [](const KifuSearchNode& lhs, const KifuSearchNode& rhs) { return lhs.key < rhs.key; });
+    search.expanded.assign(search.nodes.size(), false);
+    search.reported.assign(search.target_keys.size(), false);
+    search.reported_count = 0;
+
+    uint64_t initial_my_stones = 0x0000000810000000ULL;
+    uint64_t initial_opponent_stones = 0x0000001008000000ULL;
+    auto [normalized_initial, initial_transformation] = normalize_position(initial_my_stones, initial_opponent_stones, manager);
+    auto initial_key = std::make_pair(std::get<0>(normalized_initial), std::get<1>(normalized_initial));
+    int initial_symmetry = symmetry_index(initial_transformation);
+    long long initial_index = find_search_node(search.nodes, initial_key);
+    if (initial_index < 0) {
+        manager.debug_log("Initial position not found in book. Terminating program.", PositionManager::LogLevel::ERROR);
+        std::exit(1);
+    }
+    search.expanded[initial_index] = true;
+    manager.current_kifu = "";
+    if (report_root) {
+        kifu_search_report(initial_my_stones, initial_opponent_stones, initial_key, initial_symmetry, "", search);
+    }
+    kifu_search(initial_my_stones, initial_opponent_stones, static_cast<size_t>(initial_index), initial_symmetry,
+        symmetry_stabilizer(initial_my_stones, initial_opponent_stones), "", search, manager);
+    if (search.symmetry_pruned > 0) {
+        manager.debug_log("Kifu search: " + std::to_string(search.symmetry_pruned) + " symmetric moves pruned", PositionManager::LogLevel::INFO);
+    }
+
+    // 初期局面から辿れないポジションは通常の探索でも出力されないので数だけ残す
+    size_t unreachable = search.target_keys.size() - search.reported_count;
+    if (unreachable > 0) {
+        manager.debug_log("Kifu search: " + std::to_string(unreachable) + " positions are not reachable from the initial position", PositionManager::LogLevel::WARNING);
+    }
+}
+
+// streaming_check本体　mapを作らずにbook.datを1回流し読みしてmode 1, 2を判定し、不一致のポジションだけ残す
+// mode 3, 4 は辺を外部ソートしてbookとマージして判定し、不一致の辺だけ残す
+// 棋譜が要るのは不一致のポジションだけなので、不一致があった場合だけもう1回読んで、bookの手の一覧を外部ソートして初期局面から探す
+void streaming_check_process(const std::string& book_path, const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    std::vector<ModeTarget> targets = make_mode_targets(output_path, manager, config);
+    unsigned mode_mask = 0;
+    for (const ModeTarget& target : targets) {
+        mode_mask |= mode_bit(target.mode);
+    }
+    const unsigned position_modes = mode_bit(1) | mode_bit(2);
+    const unsigned edge_modes = mode_bit(3) | mode_bit(4);
+    size_t memory_bytes = std::max<size_t>(1, config.streaming_memory_mb) << 20;
+
+    // 1回目: 読みながら判定して不一致のポジションの正規化したキーだけ残す　レコードは棋譜を探すときに読み直す
+    std::vector<std::pair<uint64_t, uint64_t>> offender_keys;
+    size_t positions_checked = 0;
+    if (mode_mask & position_modes) {
+        bool opened = for_each_book_record(book_path, manager, [&](Position&& position) {
+            positions_checked++;
+            bool mismatch = false;
+            MismatchDetail detail;
+            if (mode_mask & mode_bit(1)) {
+                mismatch |= judge_mismatch<1>(position, position, 0, manager, detail);
+            }
+            if (mode_mask & mode_bit(2)) {
+                mismatch |= judge_mismatch<2>(position, position, 0, manager, detail);
+            }
+            if (mismatch) {
+                offender_keys.push_back(normalize_key(position.my_stones, position.opponent_stones));
+            }
+
+            // 10万ポジションごとに進捗を表示
+            if (positions_checked % 100000 == 0) {
+                std::cout << "\r" << positions_checked << " Positions checked" << std::flush;
+            }
+        });
+        if (!opened) {
+            return;
+        }
+        std::cout << "\r" << positions_checked << " Positions checked" << std::endl;
+        std::cout << offender_keys.size() << " Mismatched positions found" << std::endl;
+        manager.debug_log("Streaming check: " + std::to_string(offender_keys.size()) + " mismatched positions in " + std::to_string(positions_checked) + " positions", PositionManager::LogLevel::INFO);
+    }
+
+    // mode 3, 4: 辺を子ポジションの順に外部ソートしてbookとマージする　メモリはstreaming_memory_mb分と不一致の辺だけ
+    std::vector<StreamingEdge> edge_mismatches;
+    if (mode_mask & edge_modes) {
+        bool opened = false;
+        size_t positions_read = 0;
+        edge_mismatches = find_streaming_edge_mismatches(book_path, output_path + ".stream.run", memory_bytes, mode_mask & edge_modes, manager, positions_read, opened);
+        if (!opened) {
+            return;
+        }
+        positions_checked = positions_read;
+        std::cout << edge_mismatches.size() << " Mismatched edges found" << std::endl;
+    }
+
+    if (!offender_keys.empty() || !edge_mismatches.empty()) {
+        auto key_of = [](uint64_t my_stones, uint64_t opponent_stones) { return std::make_pair(my_stones, opponent_stones); };
+        // 同じポジションのレコードが何度もある場合は1回だけ
+        std::sort(offender_keys.begin(), offender_keys.end());
+        offender_keys.erase(std::unique(offender_keys.begin(), offender_keys.end()), offender_keys.end());
+        auto edge_parent_less = [&](const StreamingEdge& lhs, const StreamingEdge& rhs) {
+            return std::make_tuple(lhs.parent_my_stones, lhs.parent_opponent_stones, lhs.move) < std::make_tuple(rhs.parent_my_stones, rhs.parent_opponent_stones, rhs.move);
+        };
+        std::sort(edge_mismatches.begin(), edge_mismatches.end(), edge_parent_less);
+
+        // 不一致のポジションと、不一致の辺の親と子のレコードは出力で使うので、2回目に読むときに正規化して取っておく
+        // 同じポジションのレコードが何度もある場合は通常の探索と同じく最初のレコード
+        std::vector<std::pair<uint64_t, uint64_t>> parent_keys, record_keys(offender_keys);
+        for (const StreamingEdge& edge : edge_mismatches) {
+            parent_keys.push_back(key_of(edge.parent_my_stones, edge.parent_opponent_stones));
+            record_keys.push_back(parent_keys.back());
+            record_keys.push_back(key_of(edge.child_my_stones, edge.child_opponent_stones));
+        }
+        parent_keys.erase(std::unique(parent_keys.begin(), parent_keys.end()), parent_keys.end());
+        std::sort(record_keys.begin(), record_keys.end());
+        record_keys.erase(std::unique(record_keys.begin(), record_keys.end()), record_keys.end());
+        std::vector<Position> records(record_keys.size());
+        std::vector<bool> record_found(record_keys.size(), false);
+
+        // 棋譜が欲しいのは不一致のポジションと不一致の辺の親ポジション
+        KifuSearch search;
+        std::set_union(offender_keys.begin(), offender_keys.end(), parent_keys.begin(), parent_keys.end(), std::back_inserter(search.target_keys));
+
+        // 不一致のポジションと、不一致の辺の親ポジションには最初に着いたときの棋譜で1回だけ出力する
+        search.report = [&](size_t index, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, const std::string& kifu) {
+            const std::pair<uint64_t, uint64_t>& key = search.target_keys[index];
+            if (!kifu.empty() && std::binary_search(offender_keys.begin(), offender_keys.end(), key)) {
+                Position child_position = denormalize_book_position(records[find_sorted_key(record_keys, key)], my_stones, opponent_stones, transformation, manager);
+                for (ModeTarget& target : targets) {
+                    MismatchDetail detail;
+                    if (target.mode == 1 && judge_mismatch<1>(child_position, child_position, 0, manager, detail)) {
+                        mismatch_process<1>(child_position, kifu, transformation, *target.output, manager, child_position.eval_value, 0, detail);
+                    }
+                    else if (target.mode == 2 && judge_mismatch<2>(child_position, child_position, 0, manager, detail)) {
+                        mismatch_process<2>(child_position, kifu, transformation, *target.output, manager, child_position.eval_value, 0, detail);
+                    }
+                }
+            }
+
+            long long parent_index = find_sorted_key(record_keys, key);
+            if (parent_index < 0 || !std::binary_search(parent_keys.begin(), parent_keys.end(), key)) {
+                return;
+            }
+            Position parent_position = denormalize_book_position(records[parent_index], my_stones, opponent_stones, transformation, manager);
+            StreamingEdge probe{};
+            probe.parent_my_stones = key.first;
+            probe.parent_opponent_stones = key.second;
+            for (auto it = std::lower_bound(edge_mismatches.begin(), edge_mismatches.end(), probe, edge_parent_less);
+                it != edge_mismatches.end() && key_of(it->parent_my_stones, it->parent_opponent_stones) == key; ++it) {
+                // 通常の探索と同じく実際の向きの親ポジションから手を打って子ポジションを作り、同じ判定と出力を使う
+                uint8_t move = static_cast<uint8_t>(denormalize_move(it->move, transformation, manager));
+                uint64_t child_my_stones, child_opponent_stones;
+                if (!make_child_stones(parent_position, move, child_my_stones, child_opponent_stones)) {
+                    continue;
+                }
+                auto [normalized_child, child_transformation] = normalize_position(child_my_stones, child_opponent_stones, manager);
+                long long child_index = find_sorted_key(record_keys, key_of(std::get<0>(normalized_child), std::get<1>(normalized_child)));
+                if (child_index < 0) {
+                    continue;
+                }
+                Position child_position = denormalize_book_position(records[child_index], child_my_stones, child_opponent_stones, child_transformation, manager);
+                std::string child_kifu = move == 64 ? kifu : kifu + move_to_str(move);
+                for (ModeTarget& target : targets) {
+                    MismatchDetail detail;
+                    if (target.mode == 3 && judge_mismatch<3>(child_position, parent_position, move, manager, detail)) {
+                        mismatch_process<3>(child_position, child_kifu, child_transformation, *target.output, manager, child_position.eval_value, parent_position.eval_value, detail);
+                    }
+                    else if (target.mode == 4 && judge_mismatch<4>(child_position, parent_position, move, manager, detail)) {
+                        mismatch_process<4>(child_position, child_kifu, child_transformation, *target.output, manager, child_position.eval_value, parent_position.eval_value, detail);
+                    }
+                }
+            }
+        };
+        // 2回目: bookの手の一覧を外部ソートして初期局面からbookのリンクとリーフで辿る　通常の探索と同じポジションに着く
+        // 読みながら出力で使うレコードを取っておく
+        auto keep_record = [&](Position& position) {
+            long long record_index = find_sorted_key(record_keys, normalize_key(position.my_stones, position.opponent_stones));
+            if (record_index >= 0 && !record_found[record_index]) {
+                record_found[record_index] = true;
+                normalize_book_position(position, manager);
+                records[record_index] = std::move(position);
+            }
+        };
+        // 初期局面は子ポジションとしては判定しないが、初期局面からの辺は判定するので辺がある場合は初期局面も出力の対象にする
+        if (!find_streaming_kifus(book_path, output_path + ".stream.run", memory_bytes, search, keep_record, manager, !edge_mismatches.empty())) {
+            return;
+        }
+    }
+
+    for (ModeTarget& target : targets) {
+        target.output->finish();
+        manager.debug_log("Mode " + std::to_string(target.mode) + " mismatches written: " + std::to_string(target.output->line_count()), PositionManager::LogLevel::INFO);
+    }
+
+    report_total_time(manager);
+}
+
+// 使うスレッド数　0ならCPUのスレッド数
+unsigned resolve_thread_count(unsigned threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return std::max(1u, threads);
+}
+
+// [0, count) をスレッド数で分けて並列に処理する　body(begin, end, worker)
+template<class Body>
+void parallel_for(size_t count, unsigned threads, Body&& body) {
+    if (count == 0) {
+        return;
+    }
+    unsigned workers = static_cast<unsigned>(std::min<size_t>(threads, count));
+    if (workers <= 1) {
+        body(0, count, 0u);
+        return;
+    }
+    std::vector<std::thread> pool;
+    size_t chunk = (count + workers - 1) / workers;
+    for (unsigned worker = 0; worker < workers; ++worker) {
+        size_t begin = worker * chunk;
+        size_t end = std::min(count, begin + chunk);
+        if (begin >= end) {
+            break;
+        }
+        pool.emplace_back([&body, begin, end, worker]() { body(begin, end, worker); });
+    }
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+
+// ポジションから手を打った子ポジションの盤面 (正規化前)　打てない手の場合はfalse
+inline bool make_child_stones(const Position& position, uint8_t move, uint64_t& child_my_stones, uint64_t& child_opponent_stones) {
+    if (move == 64) {
+        child_my_stones = position.opponent_stones;
+        child_opponent_stones = position.my_stones;
+        return true;
+    }
+    if (move > 64) {
+        return false;
+    }
+    uint64_t move_bit = 1ULL << (63 - move);
+    if ((position.my_stones | position.opponent_stones) & move_bit) {
+        return false;
+    }
+    uint64_t flipped = flip_all_directions(position.my_stones, position.opponent_stones, move_bit);
+    if (flipped == 0) {
+        return false;
+    }
+    child_my_stones = position.opponent_stones ^ flipped;
+    child_opponent_stones = position.my_stones | move_bit | flipped;
+    return true;
+}
+
+// bookのポジションから手を打った子ポジションのレコード　打てない手やbookに無い場合はnullptr
+// ログを出さないのでスレッドから呼んでも大丈夫
+const Position* find_child_record(const Position& position, uint8_t move) {
+    uint64_t child_my_stones, child_opponent_stones;
+    if (!make_child_stones(position, move, child_my_stones, child_opponent_stones)) {
+        return nullptr;
+    }
+    std::pair<uint64_t, uint64_t> key = normalize_key(child_my_stones, child_opponent_stones);
+    return read_position(key.first, key.second);
+}
+
+// bookを複数のプロセスに分けて持つ場合の問い合わせ　大きいbookは1台のメモリに入らないので、正規化したキーのハッシュでワーカーに分ける
+// ワーカーは --lookup-worker <番号> で起動して自分の分のレコードだけ読み込み、探索する側は手元に無いレコードをまとめて問い合わせる
+// 通信はLookupTransportで差し替えられるようにしておく　今は同じマシンで試すためのUnixドメインソケットだけ
+// 形式: 長さ(uint32) + 中身のフレーム　要求はキーの数(uint32) + キー(16バイト)の並び、応答はキーの順に有無(1バイト) + あればレコード
+
+// キーを持つワーカーの番号　PairHashは下位ビットが偏るので混ぜ直してから割る
+inline size_t lookup_worker_of(const std::pair<uint64_t, uint64_t>& key, size_t worker_count) {
+    uint64_t hash = key.first * 0x9e3779b97f4a7c15ULL ^ (key.second + 0x632be59bd9b4e019ULL) * 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 31;
+    return static_cast<size_t>(hash % worker_count);
+}
+
+// ワーカーのソケットのパス　edax_lookup → edax_lookup_0.sock
+std::string lookup_socket_path(const std::string& prefix, size_t index) {
+    return prefix + "_" + std::to_string(index) + ".sock";
+}
+
+// 応答に入れるレコード　探索で使う値だけ (派生値は受け取った側でupdate_derived_evalsで作る)
+void append_lookup_record(std::vector<char>& frame, const Position& position) {
+    auto put = [&frame](const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        frame.insert(frame.end(), bytes, bytes + size);
+    };
+    uint8_t link_count = static_cast<uint8_t>(position.links.size());
+    put(&position.my_stones, sizeof(position.my_stones));
+    put(&position.opponent_stones, sizeof(position.opponent_stones));
+    put(&position.eval_value, sizeof(position.eval_value));
+    put(&position.game_count, sizeof(position.game_count));
+    put(&position.leaf.move, sizeof(position.leaf.move));
+    put(&position.leaf.eval, sizeof(position.leaf.eval));
+    put(&link_count, sizeof(link_count));
+    for (const Link& link : position.links) {
+        put(&link.move, sizeof(link.move));
+        put(&link.eval_link, sizeof(link.eval_link));
+    }
+}
+
+// append_lookup_recordの逆　足りなければfalse
+bool parse_lookup_record(const char*& current, const char* end, Position& position) {
+    auto get = [&current, end](void* data, size_t size) {
+        if (static_cast<size_t>(end - current) < size) {
+            return false;
+        }
+        std::memcpy(data, current, size);
+        current += size;
+        return true;
+    };
+    uint8_t link_count = 0;
+    if (!get(&position.my_stones, sizeof(position.my_stones)) ||
+        !get(&position.opponent_stones, sizeof(position.opponent_stones)) ||
+        !get(&position.eval_value, sizeof(position.eval_value)) ||
+        !get(&position.game_count, sizeof(position.game_count)) ||
+        !get(&position.leaf.move, sizeof(position.leaf.move)) ||
+        !get(&position.leaf.eval, sizeof(position.leaf.eval)) ||
+        !get(&link_count, sizeof(link_count))) {
+        return false;
+    }
+    position.leaf.visited = false;
+    position.links.clear();
+    for (uint8_t i = 0; i < link_count; ++i) {
+        Link link{ 0, 0, false };
+        if (!get(&link.move, sizeof(link.move)) || !get(&link.eval_link, sizeof(link.eval_link))) {
+            return false;
+        }
+        position.links.push_back(link);
+    }
+    return true;
+}
+
+// ワーカーとの通信　フレームを送って、送った順に応答のフレームを受け取る
+class LookupTransport {
+public:
+    virtual ~LookupTransport() = default;
+    virtual void write_frame(const std::vector<char>& frame) = 0;
+    virtual void read_frame(std::vector<char>& frame) = 0;
+    virtual bool frame_ready() = 0;  // 待たずに応答を読み始められるか
+};
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// フレームの読み書き　ワーカー側とUnixSocketTransportで共通　相手が閉じたらfalse
+template<class Stream>
+bool read_lookup_frame(Stream& stream, std::vector<char>& frame) {
+    uint32_t size = 0;
+    boost::system::error_code error;
+    boost::asio::read(stream, boost::asio::buffer(&size, sizeof(size)), error);
+    if (error) {
+        return false;
+    }
+    frame.resize(size);
+    boost::asio::read(stream, boost::asio::buffer(frame), error);
+    return !error;
+}
+
+template<class Stream>
+void write_lookup_frame(Stream& stream, const std::vector<char>& frame) {
+    uint32_t size = static_cast<uint32_t>(frame.size());
+    std::array<boost::asio::const_buffer, 2> buffers = { boost::asio::buffer(&size, sizeof(size)), boost::asio::buffer(frame) };
+    boost::asio::write(stream, buffers);
+}
+
+class UnixSocketTransport : public LookupTransport {
+public:
+    explicit UnixSocketTransport(const std::string& path) : socket(io) {
+        socket.connect(boost::asio::local::stream_protocol::endpoint(path));
+    }
+
+    void write_frame(const std::vector<char>& frame) override {
+        write_lookup_frame(socket, frame);
+    }
+
+    void read_frame(std::vector<char>& frame) override {
+        if (!read_lookup_frame(socket, frame)) {
+            throw std::runtime_error("Lookup worker closed the connection");
+        }
+    }
+
+    bool frame_ready() override {
+        boost::system::error_code error;
+        return socket.available(error) > 0 || error;  // エラーの場合はread_frameで例外にする
+    }
+
+private:
+    boost::asio::io_context io;
+    boost::asio::local::stream_protocol::socket socket;
+};
+#endif
+
+// キーごとに数ビットの印だけを持つ表　開番地法でキー16バイトと印1バイトを並べるので、埋まり具合を入れても1件24バイトくらい
+// unordered_setのノード (キー、次へのポインタ、ハッシュ、確保の分) の半分以下で済む　キーが(0, 0)の枠は空き (盤面が空のポジションは無い)
+class KeyFlagTable {
+public:
+    uint8_t get(const std::pair<uint64_t, uint64_t>& key) const {
+        if (keys.empty()) {
+            return 0;
+        }
+        size_t slot = find_slot(key);
+        return keys[slot] == key ? flags[slot] : 0;
+    }
+
+    void set(const std::pair<uint64_t, uint64_t>& key, uint8_t flag) {
+        if ((used + 1) * 4 > keys.size() * 3) {
+            grow();
+        }
+        size_t slot = find_slot(key);
+        if (keys[slot] != key) {
+            keys[slot] = key;
+            used++;
+        }
+        flags[slot] |= flag;
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+    size_t memory_bytes() const {
+        return keys.size() * (sizeof(keys[0]) + sizeof(flags[0]));
+    }
+
+private:
+    // keyの枠か、無ければkeyを入れる空きの枠
+    size_t find_slot(const std::pair<uint64_t, uint64_t>& key) const {
+        uint64_t hash = key.first * 0x9e3779b97f4a7c15ULL ^ (key.second + 0x632be59bd9b4e019ULL) * 0xbf58476d1ce4e5b9ULL;
+        size_t mask = keys.size() - 1;
+        size_t slot = static_cast<size_t>(hash ^ (hash >> 29)) & mask;
+        while (keys[slot] != key && keys[slot] != std::pair<uint64_t, uint64_t>(0, 0)) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void grow() {
+        std::vector<std::pair<uint64_t, uint64_t>> old_keys(std::max<size_t>(keys.size() * 2, 1024));
+        std::vector<uint8_t> old_flags(old_keys.size());
+        old_keys.swap(keys);
+        old_flags.swap(flags);
+        for (size_t i = 0; i < old_keys.size(); ++i) {
+            if (old_keys[i] != std::pair<uint64_t, uint64_t>(0, 0)) {
+                size_t slot = find_slot(old_keys[i]);
+                keys[slot] = old_keys[i];
+                flags[slot] = old_flags[i];
+            }
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> keys;
+    std::vector<uint8_t> flags;
+    size_t used = 0;
+};
+
+// 探索で使っている間だけ手元に持つレコード　lookup_workers, book_image, book_indexで使う
+// レコードは読んだ時の探索の深さ (traversal_stackの数) で持ち、その深さのポジションを辿り終わったらrelease_fromで捨てる
+// 浅い方でも使うレコードは浅い方の深さで持つので、深い方を辿り終わっても捨てない
+class HeldRecords {
+public:
+    // 持っていればdepthの深さまで持つようにして返す　無ければnullptr
+    const Position* find(const std::pair<uint64_t, uint64_t>& key, size_t depth) {
+        auto it = records.find(key);
+        if (it == records.end()) {
+            return nullptr;
+        }
+        keep_until(it, depth);
+        return &it->second.position;
+    }
+
+    bool contains(const std::pair<uint64_t, uint64_t>& key) const {
+        return records.count(key) != 0;
+    }
+
+    const Position& hold(const std::pair<uint64_t, uint64_t>& key, Position&& position, size_t depth) {
+        auto inserted = records.emplace(key, HeldRecord{ std::move(position), depth });
+        if (inserted.second) {
+            own(key, depth);
+            peak = std::max(peak, records.size());
+        }
+        else {
+            keep_until(inserted.first, depth);
+        }
+        return inserted.first->second.position;
+    }
+
+    // depth以上の深さで持っているレコードを捨てる
+    void release_from(size_t depth) {
+        for (size_t level = depth; level < owned_keys.size(); ++level) {
+            for (const auto& key : owned_keys[level]) {
+                auto it = records.find(key);
+                if (it != records.end() && it->second.depth == level) {
+                    records.erase(it);
+                }
+            }
+            owned_keys[level].clear();
+        }
+    }
+
+    size_t peak_size() const {
+        return peak;
+    }
+
+private:
+    struct HeldRecord {
+        Position position;
+        size_t depth;  // この深さのポジションを辿り終わったら捨てる
+    };
+    using RecordMap = std::unordered_map<std::pair<uint64_t, uint64_t>, HeldRecord, PairHash, PairEqual>;
+
+    void keep_until(RecordMap::iterator it, size_t depth) {
+        if (depth < it->second.depth) {
+            it->second.depth = depth;
+            own(it->first, depth);
+        }
+    }
+
+    void own(const std::pair<uint64_t, uint64_t>& key, size_t depth) {
+        if (owned_keys.size() <= depth) {
+            owned_keys.resize(depth + 1);
+        }
+        owned_keys[depth].push_back(key);
+    }
+
+    RecordMap records;
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> owned_keys;  // 深さごとの、その深さで持っているレコードのキー
+    size_t peak = 0;
+};
+
+// 探索する側の問い合わせ　受け取ったレコードは探索でそのレコードを使っている間だけ手元に持つ
+// レコードは問い合わせた時の探索の深さ (traversal_stackの数) でHeldRecordsに持ち、その深さのポジションを辿り終わったら捨てる
+// 辿り終わった印とbookに無かったキーは、レコードを捨てた後も使うのでKeyFlagTableに残す
+// 子ポジションはノードに入った時にまとめて先に送っておき (応答は待たない)、受け取ったレコードの子ポジションもlookahead手先まで続けて送る
+// 応答を待つのはread_positionで手元に無いレコードが要る時だけ　探索と同じスレッドから使う
+class RemoteLookup {
+public:
+    RemoteLookup(const ToolConfig& config, PositionManager& manager)
+        : batch_size(std::max<size_t>(config.lookup_batch_size, 1)), max_in_flight(std::max<size_t>(config.lookup_in_flight, 1)),
+        lookahead(config.lookup_lookahead), manager(manager) {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+        for (size_t i = 0; i < config.lookup_workers; ++i) {
+            std::string path = lookup_socket_path(config.lookup_socket, i);
+            try {
+                workers.emplace_back(std::make_unique<UnixSocketTransport>(path));
+            }
+            catch (const std::exception& e) {
+                manager.debug_log("Failed to connect to lookup worker: " + path + " (" + e.what() + ")", PositionManager::LogLevel::ERROR);
+                std::cerr << "Error: Failed to connect to lookup worker: " << path << std::endl;
+                std::exit(1);
+            }
+        }
+        manager.debug_log("Connected to " + std::to_string(workers.size()) + " lookup workers", PositionManager::LogLevel::INFO);
+#else
+        manager.debug_log("lookup_workers is not supported on this platform", PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: lookup_workers needs Unix domain sockets, which this build does not support." << std::endl;
+        std::exit(1);
+#endif
+    }
+
+    // 届いている応答を受け取ってから、ポジションの子ポジションを先に送っておく
+    // 受け取ったレコードの子ポジションもここで送るので、探索が待たなくても先の手のレコードが届いていく
+    void prefetch_children(const Position& position) {
+        if (lookahead > 0) {
+            for (Worker& worker : workers) {
+                while (!worker.pending.empty() && worker.transport->frame_ready()) {
+                    receive(worker);
+                }
+            }
+            request_children(position, lookahead - 1, manager.traversal_stack.size());
+            flush();
+        }
+    }
+
+    // 手元に無いレコードを問い合わせて応答を待つ　bookに無ければnullptr
+    // 返したレコードは今の探索の深さのポジションを辿り終わるまで使える
+    const Position* fetch(const std::pair<uint64_t, uint64_t>& key) {
+        if (flags.get(key) & missing_flag) {
+            return nullptr;
+        }
+        size_t depth = manager.traversal_stack.size();
+        if (!held.contains(key) && !in_flight.count(key)) {
+            unprefetched_count++;
+        }
+        request(key, 0, depth);
+        Worker& worker = workers[lookup_worker_of(key, workers.size())];
+        send(worker);
+        while (in_flight.count(key)) {
+            receive(worker);
+        }
+        flush();  // 受け取ったレコードの子ポジションを、このレコードを使っている間に送っておく
+        return held.find(key, depth);  // 先に送っておいたレコードは送った時の深さなので、使う深さまで持つようにする
+    }
+
+    // 今の深さのポジションを辿り終わった　辿り終わった印はレコードを捨てた後にまた問い合わせても付くように表に入れ、
+    // この深さ以上で問い合わせたレコードを捨てる　recordはそのポジションの正規化したレコード
+    void finish_subtree(const Position* record) {
+        if (record) {
+            flags.set(std::make_pair(record->my_stones, record->opponent_stones), completed_flag);
+        }
+        held.release_from(manager.traversal_stack.size());
+    }
+
+    void report() const {
+        std::stringstream ss;
+        ss << records_received << " Records fetched from " << workers.size() << " lookup workers in "
+            << batches_sent << " batches (" << unprefetched_count << " not prefetched, " << missing_count << " not in book, "
+            << held.peak_size() << " records held at most, " << flags.size() << " keys flagged in " << flags.memory_bytes() / 1024 << " KB)";
+        std::cout << ss.str() << std::endl;
+        manager.debug_log(ss.str(), PositionManager::LogLevel::WARNING);
+    }
+
+private:
+    static constexpr uint8_t completed_flag = 1;  // 探索で先を全て辿り終わった
+    static constexpr uint8_t missing_flag = 2;    // ワーカーのどこにも無かった
+
+    struct PendingKey {
+        std::pair<uint64_t, uint64_t> key;
+        int remaining;  // 受け取ったらあと何手先まで子ポジションを送るか
+        size_t depth;   // 問い合わせた時の探索の深さ　レコードはこの深さのポジションを辿り終わるまで持つ
+    };
+
+    struct Worker {
+        explicit Worker(std::unique_ptr<LookupTransport> transport) : transport(std::move(transport)) {}
+
+        std::unique_ptr<LookupTransport> transport;
+        std::vector<PendingKey> outgoing;             // まだ送っていない分
+        std::deque<std::vector<PendingKey>> pending;  // 送って応答を受け取っていないバッチ (送った順)
+    };
+
+    void request_children(const Position& position, int remaining, size_t depth) {
+        uint64_t child_my_stones, child_opponent_stones;
+        for (const Link& link : position.links) {
+            if (make_child_stones(position, link.move, child_my_stones, child_opponent_stones)) {
+                request(normalize_key(child_my_stones, child_opponent_stones), remaining, depth);
+            }
+        }
+        if (is_usable_leaf(position.leaf) && make_child_stones(position, position.leaf.move, child_my_stones, child_opponent_stones)) {
+            request(normalize_key(child_my_stones, child_opponent_stones), remaining, depth);
+        }
+    }
+
+    void request(const std::pair<uint64_t, uint64_t>& key, int remaining, size_t depth) {
+        if (held.find(key, depth)) {
+            return;
+        }
+        if ((flags.get(key) & missing_flag) || !in_flight.insert(key).second) {
+            return;
+        }
+        Worker& worker = workers[lookup_worker_of(key, workers.size())];
+        worker.outgoing.push_back({ key, remaining, depth });
+        if (worker.outgoing.size() >= batch_size) {
+            send(worker);
+        }
+    }
+
+    void flush() {
+        for (Worker& worker : workers) {
+            send(worker);
+        }
+    }
+
+    // 送りっぱなしのバッチが多すぎると、ワーカーの応答がソケットのバッファに溜まってお互いに書けなくなるので先に受け取る
+    void send(Worker& worker) {
+        while (!worker.outgoing.empty() && worker.pending.size() >= max_in_flight) {
+            receive(worker);
+        }
+        if (worker.outgoing.empty()) {
+            return;
+        }
+        std::vector<char> frame;
+        uint32_t key_count = static_cast<uint32_t>(worker.outgoing.size());
+        frame.resize(sizeof(key_count) + key_count * 16);
+        char* current = frame.data();
+        std::memcpy(current, &key_count, sizeof(key_count));
+        current += sizeof(key_count);
+        for (const PendingKey& pending_key : worker.outgoing) {
+            std::memcpy(current, &pending_key.key.first, 8);
+            std::memcpy(current + 8, &pending_key.key.second, 8);
+            current += 16;
+        }
+        worker.transport->write_frame(frame);
+        worker.pending.push_back(std::move(worker.outgoing));
+        worker.outgoing.clear();
+        batches_sent++;
+    }
+
+    // 一番古いバッチの応答を受け取って手元のレコードに入れる
+    void receive(Worker& worker) {
+        std::vector<PendingKey> batch = std::move(worker.pending.front());
+        worker.pending.pop_front();
+        std::vector<char> frame;
+        worker.transport->read_frame(frame);
+
+        const char* current = frame.data();
+        const char* end = current + frame.size();
+        for (const PendingKey& pending_key : batch) {
+            in_flight.erase(pending_key.key);
+            if (current >= end) {
+                throw std::runtime_error("Lookup response is truncated");
+            }
+            if (*current++ == 0) {
+                flags.set(pending_key.key, missing_flag);
+                missing_count++;
+                continue;
+            }
+            Position position;
+            if (!parse_lookup_record(current, end, position)) {
+                throw std::runtime_error("Lookup response is truncated");
+            }
+            update_derived_evals(position);
+            position.subtree_completed = (flags.get(pending_key.key) & completed_flag) != 0;
+            const Position& received = held.hold(pending_key.key, std::move(position), pending_key.depth);
+            records_received++;
+            if (pending_key.remaining > 0) {
+                request_children(received, pending_key.remaining - 1, pending_key.depth);
+            }
+        }
+    }
+
+    size_t batch_size;
+    size_t max_in_flight;
+    int lookahead;
+    PositionManager& manager;
+    std::vector<Worker> workers;
+    std::unordered_set<std::pair<uint64_t, uint64_t>, PairHash, PairEqual> in_flight;  // 送ったか送る予定で、まだ受け取っていないキー
+    HeldRecords held;                                         // 受け取って探索で使っているレコード
+    KeyFlagTable flags;                                       // 辿り終わった印とbookに無かった印
+    size_t records_received = 0;
+    size_t missing_count = 0;
+    size_t batches_sent = 0;
+    size_t unprefetched_count = 0;  // read_positionの時点でまだ送っていなかったキーの数
+};
+
+void prefetch_lookup_children(const Position& position) {
+    remote_lookup->prefetch_children(position);
+}
+
+// ワーカーの分のレコードだけをbook_positionsに読み込む
+void load_lookup_partition(const std::string& book_path, size_t index, PositionManager& manager, const ToolConfig& config) {
+    std::error_code file_error;
+    if (!std::filesystem::is_regular_file(book_path, file_error)) {
+        manager.debug_log("Failed to open book file: " + book_path, PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: Failed to open book file: " << book_path << std::endl;
+        std::exit(1);
+    }
+    size_t positions_read = 0;
+    for_each_book_record(book_path, manager, [&](Position&& position) {
+        auto key = std::make_pair(position.my_stones, position.opponent_stones);
+        if (++positions_read % 100000 == 0) {
+            std::cout << "\r" << positions_read << " Loading Completed" << std::flush;
+        }
+        if (lookup_worker_of(key, config.lookup_workers) == index) {
+            book_positions.emplace(key, std::move(position));
+        }
+    });
+    std::cout << "\r" << positions_read << " Loading Completed" << std::endl;
+    manager.debug_log("Lookup worker " + std::to_string(index) + " loaded " + std::to_string(book_positions.size()) + " / " + std::to_string(positions_read) + " positions", PositionManager::LogLevel::INFO);
+}
+
+// 要求のキーを順に引いて応答を作る　読むだけなので複数の接続のスレッドから呼んでも大丈夫
+bool answer_lookup_request(const std::vector<char>& request, std::vector<char>& response) {
+    uint32_t key_count = 0;
+    if (request.size() < sizeof(key_count)) {
+        return false;
+    }
+    std::memcpy(&key_count, request.data(), sizeof(key_count));
+    if (request.size() != sizeof(key_count) + static_cast<size_t>(key_count) * 16) {
+        return false;
+    }
+    response.clear();
+    const char* current = request.data() + sizeof(key_count);
+    for (uint32_t i = 0; i < key_count; ++i, current += 16) {
+        std::pair<uint64_t, uint64_t> key;
+        std::memcpy(&key.first, current, 8);
+        std::memcpy(&key.second, current + 8, 8);
+        auto it = book_positions.find(key);
+        response.push_back(it != book_positions.end() ? 1 : 0);
+        if (it != book_positions.end()) {
+            append_lookup_record(response, it->second);
+        }
+    }
+    return true;
+}
+
+// --lookup-worker <番号>: 自分の分のレコードを読み込んで、ソケットで問い合わせに答え続ける　止める時はCtrl+Cなど
+void serve_lookup_worker(const std::string& book_path, size_t index, PositionManager& manager, const ToolConfig& config) {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    load_lookup_partition(book_path, index, manager, config);
+
+    std::string path = lookup_socket_path(config.lookup_socket, index);
+    std::error_code remove_error;
+    std::filesystem::remove(path, remove_error);  // 前回のソケットのファイルが残っているとbindできない
+#ifdef SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);  // 探索する側が先に終わっても落ちないように
+#endif
+    boost::asio::io_context io;
+    boost::asio::local::stream_protocol::acceptor acceptor(io, boost::asio::local::stream_protocol::endpoint(path));
+    std::cout << "Lookup worker " << index << " / " << config.lookup_workers << " listening on " << path
+        << " (" << book_positions.size() << " positions)" << std::endl;
+    manager.debug_log("Lookup worker listening on " + path, PositionManager::LogLevel::INFO);
+
+    // 接続ごとにスレッドを作る　同じ接続の要求は順番に答えるので、応答は送られた順になる
+    while (true) {
+        boost::asio::local::stream_protocol::socket socket(io);
+        acceptor.accept(socket);
+        std::thread([socket = std::move(socket)]() mutable {
+            std::vector<char> request, response;
+            try {
+                while (read_lookup_frame(socket, request) && answer_lookup_request(request, response)) {
+                    write_lookup_frame(socket, response);
+                }
+            }
+            catch (const std::exception&) {
+                // 相手が閉じただけなので何もしない
+            }
+        }).detach();
+    }
+#else
+    manager.debug_log("--lookup-worker is not supported on this platform", PositionManager::LogLevel::ERROR);
+    std::cerr << "Error: --lookup-worker needs Unix domain sockets, which this build does not support." << std::endl;
+    std::exit(1);
+#endif
+}
+
+// bookのイメージ　同じbookで複数のツール (違うmode、問い合わせのデーモンなど) を同時に動かす場合に、bookを共有メモリかファイルに1回だけ置いて共有する
+// --publish-image で book_image に書き出し、book_image を設定した他のプロセスはbook.datを読まずにイメージを割り当てるだけで始められる
+// book_image が shm:名前 なら名前付きの共有メモリ、それ以外はファイル (Linuxなら /dev/shm に置けば共有メモリと同じ)
+// ポインタを持たず位置は全て先頭からのバイト数なので、どのプロセスのどのアドレスに割り当てても使える
+// 形式: ヘッダー、キーの順に並べたキー (16バイト)、キーと同じ順のレコード (16バイト)、リンク (2バイト)
+struct BookImageHeader {
+    char magic[8];
+    uint64_t book_size;
+    int64_t book_time;
+    uint64_t position_count;
+    uint64_t link_count;
+    uint64_t keys_offset;
+    uint64_t records_offset;
+    uint64_t links_offset;
+    uint64_t image_size;
+};
+
+struct BookImageRecord {
+    uint64_t first_link;  // linksの添え字
+    uint32_t game_count;
+    int8_t eval_value;
+    uint8_t leaf_move;
+    int8_t leaf_eval;
+    uint8_t link_count;
+};
+
+struct BookImageLink {
+    uint8_t move;
+    int8_t eval_link;
+};
+
+// shm:名前 なら共有メモリの名前を返す
+bool book_image_shm_name(const std::string& image, std::string& name) {
+    if (image.compare(0, 4, "shm:") != 0) {
+        return false;
+    }
+    name = image.substr(4);
+    return true;
+}
+
+BookImageHeader make_book_image_header(const std::string& book_path) {
+    BookImageHeader header{};
+    std::memcpy(header.magic, "EDXIMG01", sizeof(header.magic));
+    std::error_code error;
+    header.book_size = static_cast<uint64_t>(std::filesystem::file_size(book_path, error));
+    header.book_time = static_cast<int64_t>(std::filesystem::last_write_time(book_path, error).time_since_epoch().count());
+    return header;
+}
+
+// 読み込んだbook_positionsをイメージに書き出す　magicは最後に書くので、書いている途中に割り当てたプロセスは使わない
+void publish_book_image(const std::string& image, const std::string& book_path, PositionManager& manager) {
+    std::vector<std::pair<std::pair<uint64_t, uint64_t>, const Position*>> sorted;
+    sorted.reserve(book_positions.size());
+    uint64_t link_count = 0;
+    for (const auto& pair : book_positions) {
+        sorted.emplace_back(pair.first, &pair.second);
+        link_count += pair.second.links.size();
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+
+    BookImageHeader header = make_book_image_header(book_path);
+    header.position_count = sorted.size();
+    header.link_count = link_count;
+    header.keys_offset = sizeof(BookImageHeader);
+    header.records_offset = header.keys_offset + sorted.size() * sizeof(std::pair<uint64_t, uint64_t>);
+    header.links_offset = header.records_offset + sorted.size() * sizeof(BookImageRecord);
+    header.image_size = header.links_offset + link_count * sizeof(BookImageLink);
+
+    // 書き込み先を用意する　ファイルは一時ファイルに書いてから名前を変える
+    std::string shm_name, write_path;
+    std::unique_ptr<boost::interprocess::shared_memory_object> shm;
+    std::unique_ptr<boost::interprocess::file_mapping> file;
+    if (book_image_shm_name(image, shm_name)) {
+        boost::interprocess::shared_memory_object::remove(shm_name.c_str());
+        shm = std::make_unique<boost::interprocess::shared_memory_object>(boost::interprocess::create_only, shm_name.c_str(), boost::interprocess::read_write);
+        shm->truncate(static_cast<boost::interprocess::offset_t>(header.image_size));
+    }
+    else {
+        write_path = image + ".tmp";
+        std::ofstream(write_path, std::ios::binary | std::ios::trunc);
+        std::filesystem::resize_file(write_path, header.image_size);
+        file = std::make_unique<boost::interprocess::file_mapping>(write_path.c_str(), boost::interprocess::read_write);
+    }
+    {
+        boost::interprocess::mapped_region region = shm
+            ? boost::interprocess::mapped_region(*shm, boost::interprocess::read_write)
+            : boost::interprocess::mapped_region(*file, boost::interprocess::read_write);
+        char* base = static_cast<char*>(region.get_address());
+        auto* keys = reinterpret_cast<std::pair<uint64_t, uint64_t>*>(base + header.keys_offset);
+        auto* records = reinterpret_cast<BookImageRecord*>(base + header.records_offset);
+        auto* links = reinterpret_cast<BookImageLink*>(base + header.links_offset);
+        uint64_t next_link = 0;
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            const Position& position = *sorted[i].second;
+            keys[i] = sorted[i].first;
+            records[i] = { next_link, position.game_count, position.eval_value, position.leaf.move, position.leaf.eval, static_cast<uint8_t>(position.links.size()) };
+            for (const Link& link : position.links) {
+                links[next_link++] = { link.move, link.eval_link };
+            }
+        }
+        BookImageHeader published = header;
+        std::memset(published.magic, 0, sizeof(published.magic));
+        std::memcpy(base, &published, sizeof(published));
+        std::memcpy(base, header.magic, sizeof(header.magic));
+        region.flush();
+    }
+    if (file) {
+        file.reset();
+        std::error_code rename_error;
+        std::filesystem::rename(write_path, image, rename_error);
+        if (rename_error) {
+            manager.debug_log("Failed to write book image: " + image, PositionManager::LogLevel::ERROR);
+            std::cerr << "Error: Failed to write book image: " << image << std::endl;
+            std::exit(1);
+        }
+    }
+    std::cout << "Book image published: " << image << " (" << sorted.size() << " positions, " << header.image_size << " bytes)" << std::endl;
+    manager.debug_log("Book image published: " + image + " (" + std::to_string(header.image_size) + " bytes)", PositionManager::LogLevel::INFO);
+}
+
+// 割り当てたイメージ　read_positionで要るレコードだけをイメージから作る (book_positionsには入れない)
+// 探索 (mode 1～4, 6) はレコードをHeldRecordsに探索の深さで持ち、辿り終わった印はイメージの並びの位置ごとに1ビットで持つ
+// mode 5, 13 は読んだスレッドのレコード1つに作り直すだけで、そのスレッドで次に読むまで使える
+// イメージは読むだけなので、mode 13 のソケットで接続ごとのスレッドから読んでもロックは要らない
+class BookImage {
+public:
+    // 無いか、bookと合わない場合はnullptr　hold_records: 探索のようにレコードを深さで持つか
+    static std::unique_ptr<BookImage> attach(const std::string& image, const std::string& book_path, bool hold_records, PositionManager& manager) {
+        std::unique_ptr<BookImage> attached(new BookImage());
+        attached->manager = &manager;
+        attached->hold_records = hold_records;
+        std::string shm_name;
+        try {
+            if (book_image_shm_name(image, shm_name)) {
+                boost::interprocess::shared_memory_object shm(boost::interprocess::open_only, shm_name.c_str(), boost::interprocess::read_only);
+                attached->region = boost::interprocess::mapped_region(shm, boost::interprocess::read_only);
+            }
+            else {
+                boost::interprocess::file_mapping file(image.c_str(), boost::interprocess::read_only);
+                attached->region = boost::interprocess::mapped_region(file, boost::interprocess::read_only);
+            }
+        }
+        catch (const std::exception&) {
+            manager.debug_log("Book image not found: " + image, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+
+        const char* base = static_cast<const char*>(attached->region.get_address());
+        BookImageHeader expected = make_book_image_header(book_path);
+        const BookImageHeader& header = *reinterpret_cast<const BookImageHeader*>(base);
+        if (attached->region.get_size() < sizeof(BookImageHeader) || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+            attached->region.get_size() < header.image_size) {
+            manager.debug_log("Book image is incomplete: " + image, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+        // book.datがある場合は、イメージを書き出した時と同じbookか確かめる
+        if (std::filesystem::exists(book_path) && (header.book_size != expected.book_size || header.book_time != expected.book_time)) {
+            manager.debug_log("Book image is stale: " + image, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+        attached->keys = reinterpret_cast<const std::pair<uint64_t, uint64_t>*>(base + header.keys_offset);
+        attached->records = reinterpret_cast<const BookImageRecord*>(base + header.records_offset);
+        attached->links = reinterpret_cast<const BookImageLink*>(base + header.links_offset);
+        attached->count = header.position_count;
+        if (hold_records) {
+            attached->completed.assign((attached->count + 63) / 64, 0);
+        }
+        return attached;
+    }
+
+    const Position* read(const std::pair<uint64_t, uint64_t>& key) {
+        if (!hold_records) {
+            thread_local Position scratch;
+            size_t index;
+            if (!find_index(key, index)) {
+                return nullptr;
+            }
+            decode(index, scratch);
+            return &scratch;
+        }
+        size_t depth = manager->traversal_stack.size();
+        if (const Position* held_position = held.find(key, depth)) {
+            return held_position;
+        }
+        size_t index;
+        if (!find_index(key, index)) {
+            return nullptr;
+        }
+        Position position;
+        decode(index, position);
+        position.subtree_completed = (completed[index >> 6] >> (index & 63)) & 1;
+        return &held.hold(key, std::move(position), depth);
+    }
+
+    // 今の深さのポジションを辿り終わった　辿り終わった印をビットに残して、この深さ以上で読んだレコードを捨てる
+    void finish_subtree(const Position* record) {
+        size_t index;
+        if (record && find_index(std::make_pair(record->my_stones, record->opponent_stones), index)) {
+            completed[index >> 6] |= 1ULL << (index & 63);
+        }
+        held.release_from(manager->traversal_stack.size());
+    }
+
+    size_t position_count() const {
+        return count;
+    }
+
+    size_t peak_records() const {
+        return held.peak_size();
+    }
+
+    std::atomic<size_t> decoded_count{ 0 };
+
+private:
+    BookImage() = default;
+
+    bool find_index(const std::pair<uint64_t, uint64_t>& key, size_t& index) const {
+        const auto* found = std::lower_bound(keys, keys + count, key);
+        if (found == keys + count || *found != key) {
+            return false;
+        }
+        index = static_cast<size_t>(found - keys);
+        return true;
+    }
+
+    // レコードを作る　同じPositionに作り直す場合もあるので全部書く
+    void decode(size_t index, Position& position) {
+        const BookImageRecord& record = records[index];
+        position.my_stones = keys[index].first;
+        position.opponent_stones = keys[index].second;
+        position.eval_value = record.eval_value;
+        position.game_count = record.game_count;
+        position.leaf = { record.leaf_move, record.leaf_eval, false };
+        position.links.clear();
+        for (uint64_t i = record.first_link; i < record.first_link + record.link_count; ++i) {
+            position.links.push_back({ links[i].move, links[i].eval_link, false });
+        }
+        position.subtree_completed = false;
+        update_derived_evals(position);
+        decoded_count++;
+    }
+
+    boost::interprocess::mapped_region region;
+    const std::pair<uint64_t, uint64_t>* keys = nullptr;
+    const BookImageRecord* records = nullptr;
+    const BookImageLink* links = nullptr;
+    size_t count = 0;
+    PositionManager* manager = nullptr;
+    bool hold_records = false;
+    HeldRecords held;               // 探索で使っているレコード
+    std::vector<uint64_t> completed;  // 辿り終わった印　イメージの並びの位置ごとに1ビット
+};
+
+// --remove-image: 共有メモリのイメージを消す (ファイルのイメージはファイルを消すだけ)
+void remove_book_image(const std::string& image, PositionManager& manager) {
+    std::string shm_name;
+    std::error_code remove_error;
+    bool removed = book_image_shm_name(image, shm_name)
+        ? boost::interprocess::shared_memory_object::remove(shm_name.c_str())
+        : std::filesystem::remove(image, remove_error);
+    std::cout << (removed ? "Book image removed: " : "Book image not found: ") << image << std::endl;
+    manager.debug_log((removed ? "Book image removed: " : "Book image not found: ") + image, PositionManager::LogLevel::INFO);
+}
+
+// bookの索引ファイル　全部読み込むとメモリに入らないbookで、bookはbook.datのままマップして索引だけを引く
+// --build-index で book_index に作り、book_index を設定したmode 1～6, 13 は索引でbook.datの中のレコードの位置を探してそのレコードだけ読む
+// 形式: 1ページ目がヘッダー、その後はページ (4096バイト) ごとのバケット　バケットは使っている数 (4バイト) と
+// キーのハッシュの上位32ビット (指紋) + book.datの中の位置の12バイトの組を341個　探すのはほとんど1ページだけ
+// 組は1ポジション12バイトだが、バケットは3/4くらいまでしか埋めないのでファイルは1ポジション16バイトくらい
+// バケットがいっぱいの場合は次のバケットに入れる (引くときも、いっぱいのバケットでは次のバケットまで見る)
+constexpr size_t book_index_page_size = 4096;
+
+struct BookIndexHeader {
+    char magic[8];
+    uint64_t book_size;
+    int64_t book_time;
+    uint64_t position_count;
+    uint64_t bucket_count;
+    uint64_t page_size;
+};
+
+struct BookIndexEntry {
+    uint32_t fingerprint;
+    uint32_t offset_low;   // book.datの中の位置 (8バイトだと4バイト境界で詰まらないので分ける)
+    uint32_t offset_high;
+};
+
+constexpr size_t book_index_bucket_entries = (book_index_page_size - sizeof(uint32_t)) / sizeof(BookIndexEntry);
+
+struct BookIndexBucket {
+    uint32_t count;
+    BookIndexEntry entries[book_index_bucket_entries];
+};
+static_assert(sizeof(BookIndexBucket) == book_index_page_size, "BookIndexBucket must fill one page");
+
+// キーのハッシュ　下位32ビットでバケット、上位32ビットを指紋にする
+inline uint64_t book_index_hash(const std::pair<uint64_t, uint64_t>& key) {
+    uint64_t hash = key.first * 0x9e3779b97f4a7c15ULL ^ (key.second + 0x632be59bd9b4e019ULL) * 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 31;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+inline uint64_t book_index_offset(const BookIndexEntry& entry) {
+    return (static_cast<uint64_t>(entry.offset_high) << 32) | entry.offset_low;
+}
+
+BookIndexHeader make_book_index_header(const std::string& book_path) {
+    BookIndexHeader header{};
+    std::memcpy(header.magic, "EDXIDX01", sizeof(header.magic));
+    std::error_code error;
+    header.book_size = static_cast<uint64_t>(std::filesystem::file_size(book_path, error));
+    header.book_time = static_cast<int64_t>(std::filesystem::last_write_time(book_path, error).time_since_epoch().count());
+    header.page_size = book_index_page_size;
+    return header;
+}
+
+// バケットを順に辿ってキーのレコードの位置を探す　指紋が同じならbook.datのレコードの盤面で確かめる　無ければfalse
+// slotは索引の中の組の番号 (バケットの番号 × 341 + バケットの中の番号)
+bool find_book_index_entry(const BookIndexBucket* buckets, uint64_t bucket_count, const char* book, const std::pair<uint64_t, uint64_t>& key, uint64_t& offset, uint64_t& slot) {
+    uint64_t hash = book_index_hash(key);
+    uint32_t fingerprint = static_cast<uint32_t>(hash >> 32);
+    uint64_t bucket = (hash & 0xffffffffULL) % bucket_count;
+    for (uint64_t probed = 0; probed < bucket_count; ++probed) {
+        const BookIndexBucket& page = buckets[bucket];
+        for (uint32_t i = 0; i < page.count; ++i) {
+            if (page.entries[i].fingerprint != fingerprint) {
+                continue;
+            }
+            uint64_t candidate = book_index_offset(page.entries[i]);
+            uint64_t stones[2];
+            std::memcpy(stones, book + candidate, sizeof(stones));
+            if (stones[0] == key.first && stones[1] == key.second) {
+                offset = candidate;
+                slot = bucket * book_index_bucket_entries + i;
+                return true;
+            }
+        }
+        if (page.count < book_index_bucket_entries) {
+            return false;
+        }
+        bucket = (bucket + 1) % bucket_count;
+    }
+    return false;
+}
+
+// --build-index: book.datを流し読みして索引を作る　索引もマップして直接書くので、作るときも索引の分のメモリは要らない
+// 同じポジションが何度もある場合は読み込みと同じく先に出てきた方を残す　magicは最後に書く
+void build_book_index(const std::string& index_path, const std::string& book_path, PositionManager& manager) {
+    boost::interprocess::file_mapping book_file(book_path.c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region book_region(book_file, boost::interprocess::read_only);
+    const char* book = static_cast<const char*>(book_region.get_address());
+    const char* book_end = book + book_region.get_size();
+
+    // ポジション数を数えてからバケットの数を決める　使うのは3/4くらいまで　レコードは長さだけ見て読まない
+    uint64_t position_count = 0;
+    for (const char* current = book + 42; current < book_end; position_count++) {
+        current += BookRecordView{ current }.size();
+    }
+    BookIndexHeader header = make_book_index_header(book_path);
+    header.bucket_count = std::max<uint64_t>(1, (position_count * 4 / 3 + book_index_bucket_entries - 1) / book_index_bucket_entries);
+    uint64_t index_size = book_index_page_size * (1 + header.bucket_count);
+
+    std::string write_path = index_path + ".tmp";
+    std::ofstream(write_path, std::ios::binary | std::ios::trunc);
+    std::filesystem::resize_file(write_path, index_size);
+    {
+        boost::interprocess::file_mapping index_file(write_path.c_str(), boost::interprocess::read_write);
+        boost::interprocess::mapped_region index_region(index_file, boost::interprocess::read_write);
+        char* base = static_cast<char*>(index_region.get_address());
+        auto* buckets = reinterpret_cast<BookIndexBucket*>(base + book_index_page_size);
+
+        uint64_t indexed = 0, duplicates = 0;
+        for (const char* current = book + 42; current < book_end; ) {
+            uint64_t offset = static_cast<uint64_t>(current - book);
+            BookRecordView record{ current };
+            current += record.size();
+            auto key = record.key();
+            uint64_t found_offset, found_slot;
+            if (find_book_index_entry(buckets, header.bucket_count, book, key, found_offset, found_slot)) {
+                duplicates++;
+                continue;
+            }
+            uint64_t hash = book_index_hash(key);
+            uint64_t bucket = (hash & 0xffffffffULL) % header.bucket_count;
+            while (buckets[bucket].count == book_index_bucket_entries) {
+                bucket = (bucket + 1) % header.bucket_count;
+            }
+            BookIndexBucket& page = buckets[bucket];
+            page.entries[page.count++] = { static_cast<uint32_t>(hash >> 32), static_cast<uint32_t>(offset), static_cast<uint32_t>(offset >> 32) };
+            indexed++;
+
+            // 10万ポジションごとに進捗を表示
+            if (indexed % 100000 == 0) {
+                std::cout << "\r" << indexed << " Positions indexed" << std::flush;
+            }
+        }
+        header.position_count = indexed;
+        BookIndexHeader published = header;
+        std::memset(published.magic, 0, sizeof(published.magic));
+        std::memcpy(base, &published, sizeof(published));
+        std::memcpy(base, header.magic, sizeof(header.magic));
+        index_region.flush();
+        std::cout << "\r" << indexed << " Positions indexed (" << duplicates << " duplicates skipped)" << std::endl;
+    }
+    std::error_code rename_error;
+    std::filesystem::rename(write_path, index_path, rename_error);
+    if (rename_error) {
+        manager.debug_log("Failed to write book index: " + index_path, PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: Failed to write book index: " << index_path << std::endl;
+        std::exit(1);
+    }
+    std::cout << "Book index built: " << index_path << " (" << header.bucket_count << " buckets, " << index_size << " bytes)" << std::endl;
+    manager.debug_log("Book index built: " + index_path + " (" + std::to_string(index_size) + " bytes)", PositionManager::LogLevel::INFO);
+}
+
+// lazy_decodeで起動時にメモリに作る索引の1件　キーのハッシュの順に並べて二分探索する
+// キーはbook.datのレコードの先頭にあるので持たずに、ハッシュが同じならレコードの盤面で確かめる (1ポジション16バイト)
+struct BookOffsetEntry {
+    uint64_t hash;    // book_index_hash
+    uint64_t offset;  // book.datの中の位置
+};
+
+// 割り当てた索引とbook.dat　read_positionで要るレコードだけを索引で引いてbook.datから作る (book_positionsには入れない)
+// 索引のページとbook.datはOSのページキャッシュから読む　レコードの持ち方はBookImageと同じで、
+// 探索 (mode 1～4, 6) はHeldRecordsに探索の深さで持ち、辿り終わった印は索引の組の番号ごとに1ビットで持つ　mode 5, 13 は読んだスレッドのレコード1つに作る
+// 辿り終わった子ポジションはもう入らないので、レコードを作って持たずにマップしたレコードのビュー (read_view) から子ポジションを直接作る
+// 索引は --build-index で作ったファイル (attach) か、lazy_decodeで起動時にメモリに作ったもの (build)
+class BookIndex {
+public:
+    // 無いか、bookと合わない場合はnullptr　hold_records: 探索のようにレコードを深さで持つか
+    static std::unique_ptr<BookIndex> attach(const std::string& index_path, const std::string& book_path, bool hold_records, PositionManager& manager) {
+        std::unique_ptr<BookIndex> attached(new BookIndex());
+        attached->manager = &manager;
+        attached->hold_records = hold_records;
+        try {
+            boost::interprocess::file_mapping index_file(index_path.c_str(), boost::interprocess::read_only);
+            attached->index_region = boost::interprocess::mapped_region(index_file, boost::interprocess::read_only);
+            boost::interprocess::file_mapping book_file(book_path.c_str(), boost::interprocess::read_only);
+            attached->book_region = boost::interprocess::mapped_region(book_file, boost::interprocess::read_only);
+        }
+        catch (const std::exception&) {
+            manager.debug_log("Book index not found: " + index_path, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+
+        const char* base = static_cast<const char*>(attached->index_region.get_address());
+        BookIndexHeader expected = make_book_index_header(book_path);
+        const BookIndexHeader& header = *reinterpret_cast<const BookIndexHeader*>(base);
+        if (attached->index_region.get_size() < book_index_page_size || std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+            header.page_size != book_index_page_size || header.bucket_count == 0 ||
+            attached->index_region.get_size() < book_index_page_size * (1 + header.bucket_count)) {
+            manager.debug_log("Book index is incomplete: " + index_path, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+        if (header.book_size != expected.book_size || header.book_time != expected.book_time) {
+            manager.debug_log("Book index is stale: " + index_path, PositionManager::LogLevel::WARNING);
+            return nullptr;
+        }
+        attached->buckets = reinterpret_cast<const BookIndexBucket*>(base + book_index_page_size);
+        attached->bucket_count = header.bucket_count;
+        attached->count = header.position_count;
+        if (hold_records) {
+            attached->completed.assign((attached->bucket_count * book_index_bucket_entries + 63) / 64, 0);
+        }
+        return attached;
+    }
+
+    // book.datをマップしてキーのハッシュとレコードの位置だけの索引を作る (1ポジション16バイト)　レコードは盤面と長さだけ見て中身は読まない
+    // 同じポジションが何度もある場合は読み込みと同じく先に出てきた方を残す
+    static std::unique_ptr<BookIndex> build(const std::string& book_path, bool hold_records, PositionManager& manager) {
+        std::unique_ptr<BookIndex> built(new BookIndex());
+        built->manager = &manager;
+        built->hold_records = hold_records;
+        try {
+            boost::interprocess::file_mapping book_file(book_path.c_str(), boost::interprocess::read_only);
+            built->book_region = boost::interprocess::mapped_region(book_file, boost::interprocess::read_only);
+        }
+        catch (const std::exception&) {
+            manager.debug_log("Failed to open book file: " + book_path, PositionManager::LogLevel::ERROR);
+            return nullptr;
+        }
+        const char* book = static_cast<const char*>(built->book_region.get_address());
+        const char* book_end = book + built->book_region.get_size();
+        // 1レコードは最短42バイトなのでポジション数はこれより多くならない　先に取っておけば途中で取り直さない
+        // (平均は44バイトくらいなので余りは5%くらい　取り直すと一時的に2倍要るのでshrink_to_fitもしない)
+        if (book_end > book + 42) {
+            built->offsets.reserve((book_end - book - 42) / 42);
+        }
+        for (const char* current = book + 42; current < book_end; ) {
+            BookRecordView record{ current };
+            built->offsets.push_back({ book_index_hash(record.key()), static_cast<uint64_t>(current - book) });
+            current += record.size();
+
+            // 10万ポジションごとに進捗を表示
+            if (built->offsets.size() % 100000 == 0) {
+                std::cout << "\r" << built->offsets.size() << " Positions indexed" << std::flush;
+            }
+        }
+        // ハッシュが同じ中では位置の順なので、同じキーは先に出てきた方が残る
+        std::sort(built->offsets.begin(), built->offsets.end(), [](const BookOffsetEntry& lhs, const BookOffsetEntry& rhs) {
+            return lhs.hash != rhs.hash ? lhs.hash < rhs.hash : lhs.offset < rhs.offset;
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < built->offsets.size(); ++i) {
+            bool duplicate = false;
+            for (size_t j = kept; j > 0 && built->offsets[j - 1].hash == built->offsets[i].hash && !duplicate; --j) {
+                duplicate = BookRecordView{ book + built->offsets[j - 1].offset }.key() == BookRecordView{ book + built->offsets[i].offset }.key();
+            }
+            if (!duplicate) {
+                built->offsets[kept++] = built->offsets[i];
+            }
+        }
+        built->offsets.resize(kept);
+        built->count = built->offsets.size();
+        if (hold_records) {
+            built->completed.assign((built->count + 63) / 64, 0);
+        }
+        std::cout << "\r" << built->count << " Positions indexed" << std::endl;
+        return built;
+    }
+
+    const Position* read(const std::pair<uint64_t, uint64_t>& key) {
+        const char* book = static_cast<const char*>(book_region.get_address());
+        uint64_t offset, slot;
+        if (!hold_records) {
+            thread_local Position scratch;
+            if (!find_offset(book, key, offset, slot)) {
+                return nullptr;
+            }
+            scratch = BookRecordView{ book + offset }.decode(*manager);
+            decoded_count++;
+            return &scratch;
+        }
+        size_t depth = manager->traversal_stack.size();
+        if (const Position* held_position = held.find(key, depth)) {
+            return held_position;
+        }
+        if (!find_offset(book, key, offset, slot)) {
+            return nullptr;
+        }
+        return hold(key, BookRecordView{ book + offset }, slot, depth);
+    }
+
+    // 探索の子ポジション用のread　辿り終わった子ポジションには入らないので、Positionを作って持たずにマップしたレコードのビューをrecordに返す (返値はnullptr)
+    // それ以外はreadと同じ　bookに無い場合はrecord.dataもnullptr
+    const Position* read_view(const std::pair<uint64_t, uint64_t>& key, BookRecordView& record) {
+        record.data = nullptr;
+        if (!hold_records) {
+            return read(key);
+        }
+        const char* book = static_cast<const char*>(book_region.get_address());
+        uint64_t offset, slot;
+        size_t depth = manager->traversal_stack.size();
+        if (const Position* held_position = held.find(key, depth)) {
+            return held_position;
+        }
+        if (!find_offset(book, key, offset, slot)) {
+            return nullptr;
+        }
+        if (is_completed(slot)) {
+            record.data = book + offset;
+            return nullptr;
+        }
+        return hold(key, BookRecordView{ book + offset }, slot, depth);
+    }
+
+    // 今の深さのポジションを辿り終わった　辿り終わった印をビットに残して、この深さ以上で読んだレコードを捨てる
+    void finish_subtree(const Position* record) {
+        const char* book = static_cast<const char*>(book_region.get_address());
+        uint64_t offset, slot;
+        if (record && find_offset(book, std::make_pair(record->my_stones, record->opponent_stones), offset, slot)) {
+            completed[slot >> 6] |= 1ULL << (slot & 63);
+        }
+        held.release_from(manager->traversal_stack.size());
+    }
+
+    size_t position_count() const {
+        return count;
+    }
+
+    size_t peak_records() const {
+        return held.peak_size();
+    }
+
+    std::atomic<size_t> decoded_count{ 0 };
+
+private:
+    BookIndex() = default;
+
+    bool is_completed(uint64_t slot) const {
+        return (completed[slot >> 6] >> (slot & 63)) & 1;
+    }
+
+    const Position* hold(const std::pair<uint64_t, uint64_t>& key, const BookRecordView& record, uint64_t slot, size_t depth) {
+        Position position = record.decode(*manager);
+        position.subtree_completed = is_completed(slot);
+        decoded_count++;
+        return &held.hold(key, std::move(position), depth);
+    }
+
+    // slotは辿り終わった印のビットの番号　ファイルの索引は組の番号、メモリの索引は並びの位置
+    bool find_offset(const char* book, const std::pair<uint64_t, uint64_t>& key, uint64_t& offset, uint64_t& slot) const {
+        if (buckets) {
+            return find_book_index_entry(buckets, bucket_count, book, key, offset, slot);
+        }
+        uint64_t hash = book_index_hash(key);
+        auto it = std::lower_bound(offsets.begin(), offsets.end(), hash, [](const BookOffsetEntry& entry, uint64_t value) {
+            return entry.hash < value;
+        });
+        for (; it != offsets.end() && it->hash == hash; ++it) {
+            if (BookRecordView{ book + it->offset }.key() == key) {
+                offset = it->offset;
+                slot = static_cast<uint64_t>(it - offsets.begin());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    PositionManager* manager = nullptr;
+    boost::interprocess::mapped_region index_region;
+    boost::interprocess::mapped_region book_region;
+    const BookIndexBucket* buckets = nullptr;   // ファイルの索引
+    uint64_t bucket_count = 0;
+    std::vector<BookOffsetEntry> offsets;        // メモリに作った索引
+    size_t count = 0;
+    bool hold_records = false;
+    HeldRecords held;                 // 探索で使っているレコード
+    std::vector<uint64_t> completed;  // 辿り終わった印　slotごとに1ビット
+};
+
+// 探索でポジションを辿り終わった　辿り終わった印を残して、このポジションで読んだレコードを捨てる
+void release_book_records(const Position* record) {
+    if (remote_lookup) {
+        remote_lookup->finish_subtree(record);
+    }
+    else if (book_image) {
+        book_image->finish_subtree(record);
+    }
+    else if (book_index) {
+        book_index->finish_subtree(record);
+    }
+}
+
+// mode 7で見つかった不一致　リンクの評価値か、ポジションの評価値のどちらか
+struct NegamaxFinding {
+    const Position* position;  // bookの正規化済みポジション
+    uint8_t move;              // 不一致のリンクの手　ポジションの評価値の場合はnegamaxで最善の手
+    bool is_link;
+    int8_t stored_eval;        // bookに入っている評価値
+    int8_t propagated_eval;    // リンクとリーフから計算した評価値
+    int8_t child_eval;         // リンクの場合の子ポジションのnegamaxの値
+};
+
+inline bool has_pass_edge(const Position& position) {
+    return position.leaf.move == 64 ||
+        std::any_of(position.links.begin(), position.links.end(), [](const Link& link) { return link.move == 64; });
+}
+
+// negamaxで値を使う子ポジション　パスの先もパスの場合は同じ石の数の中で互いに待つことになるので使わない (保存値を使う)
+const Position* find_propagation_child(const Position& position, uint8_t move) {
+    const Position* child = find_child_record(position, move);
+    if (child && move == 64 && has_pass_edge(*child)) {
+        return nullptr;
+    }
+    return child;
+}
+
+// リンクやリーフの手の値　子ポジションがbookにあればその値の反転、無ければ保存されている評価値
+inline int propagated_edge_value(const Position& position, uint8_t move, int8_t stored_eval, const Position*& child) {
+    child = find_propagation_child(position, move);
+    if (!child) {
+        return stored_eval;
+    }
+    return -static_cast<int>(child->propagated_eval);
+}
+
+// 1ポジション分のnegamax　子ポジションの値は計算済みのものを使う
+void negamax_position(Position& position, std::vector<NegamaxFinding>& findings) {
+    bool has_move = false;
+    int best = 0;
+    uint8_t best_move = 65;
+
+    for (const auto& link : position.links) {
+        const Position* child = nullptr;
+        int value = propagated_edge_value(position, link.move, link.eval_link, child);
+        if (child && value != link.eval_link) {
+            findings.push_back({ &position, link.move, true, link.eval_link, static_cast<int8_t>(std::clamp(value, -127, 127)), child->propagated_eval });
+        }
+        if (!has_move || value > best) {
+            has_move = true;
+            best = value;
+            best_move = link.move;
+        }
+    }
+
+    if (is_usable_leaf(position.leaf)) {
+        const Position* child = nullptr;
+        int value = propagated_edge_value(position, position.leaf.move, position.leaf.eval, child);
+        if (!has_move || value > best) {
+            has_move = true;
+            best = value;
+            best_move = position.leaf.move;
+        }
+    }
+
+    // リンクもリーフも無い場合は保存されている評価値をそのまま使う
+    if (!has_move) {
+        position.propagated_eval = position.eval_value;
+        return;
+    }
+    position.propagated_eval = static_cast<int8_t>(std::clamp(best, -127, 127));
+    if (position.propagated_eval != position.eval_value) {
+        findings.push_back({ &position, best_move, false, position.eval_value, position.propagated_eval, 0 });
+    }
+}
+
+// mode 7: bookのリンクとリーフだけからnegamaxした値と、保存されている評価値やリンクの評価値を比べる
+// 子ポジションは必ず石が1つ多いので石の数ごとに 64 → 4 の順で処理する　同じ石の数の中は互いに独立なので並列にできる
+// パスは石の数が変わらないので、パスの無いポジションを先に、パスのあるポジションを後に処理する
+std::vector<NegamaxFinding> propagate_negamax(PositionManager& manager, const ToolConfig& config) {
+    unsigned threads = resolve_thread_count(config.threads);
+    manager.debug_log("Negamax threads: " + std::to_string(threads), PositionManager::LogLevel::INFO);
+
+    // 石の数ごとに分ける　[石の数][0: パス無し, 1: パス有り]
+    std::vector<std::array<std::vector<Position*>, 2>> levels(65);
+    for (auto& pair : book_positions) {
+        Position& position = pair.second;
+        int discs = popcount64(position.my_stones | position.opponent_stones);
+        levels[discs][has_pass_edge(position) ? 1 : 0].push_back(&position);
+    }
+
+    std::vector<NegamaxFinding> findings;
+    std::vector<std::vector<NegamaxFinding>> worker_findings(threads);
+    for (int discs = 64; discs >= 0; --discs) {
+        for (int phase = 0; phase < 2; ++phase) {
+            std::vector<Position*>& positions = levels[discs][phase];
+            parallel_for(positions.size(), threads, [&](size_t begin, size_t end, unsigned worker) {
+                for (size_t i = begin; i < end; ++i) {
+                    negamax_position(*positions[i], worker_findings[worker]);
+                }
+            });
+            for (auto& local : worker_findings) {
+                findings.insert(findings.end(), local.begin(), local.end());
+                local.clear();
+            }
+        }
+        if (!levels[discs][0].empty() || !levels[discs][1].empty()) {
+            std::cout << "\r" << discs << " discs done" << std::flush;
+        }
+    }
+    std::cout << std::endl;
+    std::cout << findings.size() << " Negamax mismatches found" << std::endl;
+    manager.debug_log("Negamax: " + std::to_string(findings.size()) + " mismatches", PositionManager::LogLevel::INFO);
+    return findings;
+}
+
+// mode 7 本体　negamaxして見つかった不一致の棋譜を出力する
+void negamax_process(const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    std::vector<NegamaxFinding> findings = propagate_negamax(manager, config);
+
+    MismatchOutput output(output_path, manager, config.ranked_output, config.ranked_top_k, config.ranked_weight_by_games, config.report_format);
+    if (!findings.empty()) {
+        // 棋譜は初期局面から辿って探す　ポジションごとにまとめる (スレッド数で順番が変わらないように手の順まで並べる)
+        std::sort(findings.begin(), findings.end(), [](const NegamaxFinding& lhs, const NegamaxFinding& rhs) {
+            return std::make_tuple(lhs.position->my_stones, lhs.position->opponent_stones, lhs.is_link, lhs.move) <
+                std::make_tuple(rhs.position->my_stones, rhs.position->opponent_stones, rhs.is_link, rhs.move);
+        });
+        KifuSearch search;
+        search.nodes.reserve(book_positions.size());
+        for (const auto& pair : book_positions) {
+            search.add(pair.first, pair.second);
+        }
+        std::vector<size_t> first_finding;
+        for (size_t i = 0; i < findings.size(); ++i) {
+            auto key = std::make_pair(findings[i].position->my_stones, findings[i].position->opponent_stones);
+            if (search.target_keys.empty() || search.target_keys.back() != key) {
+                search.target_keys.push_back(key);
+                first_finding.push_back(i);
+            }
+        }
+        first_finding.push_back(findings.size());
+
+        search.report = [&](size_t index, uint64_t, uint64_t, const std::string& transformation, const std::string& kifu) {
+            // 同じ手を2回出力しないように (リンクの不一致と最善の手が同じ場合)
+            uint64_t written_moves = 0;
+            bool pass_written = false;
+            for (size_t i = first_finding[index]; i < first_finding[index + 1]; ++i) {
+                const NegamaxFinding& finding = findings[i];
+                int move = denormalize_move(finding.move, transformation, manager);
+                if (move == 64 ? pass_written : (move < 64 && (written_moves & (1ULL << move)))) {
+                    continue;
+                }
+                if (move == 64) {
+                    pass_written = true;
+                }
+                else if (move < 64) {
+                    written_moves |= 1ULL << move;
+                }
+
+                MismatchDetail detail;
+                detail.mode = 7;
+                detail.severity = std::abs(finding.stored_eval - finding.propagated_eval);
+                detail.depth = static_cast<int>(kifu.length() / 2);
+                detail.has_parent_eval = finding.is_link;
+                detail.parent_eval = finding.stored_eval;
+                detail.child_eval = finding.is_link ? finding.child_eval : finding.stored_eval;
+                detail.max_child_eval = finding.propagated_eval;
+                detail.canonical_my_stones = finding.position->my_stones;
+                detail.canonical_opponent_stones = finding.position->opponent_stones;
+                detail.transformation = transformation;
+                detail.game_count = finding.position->game_count;
+
+                // パスは棋譜に残らないのでポジションまでの棋譜を出力
+                output.write(move < 64 ? kifu + move_to_str(move) : kifu, detail);
+            }
+        };
+        run_kifu_search(search, manager, true);
+    }
+    output.finish();
+    manager.debug_log("Mode 7 mismatches written: " + std::to_string(output.line_count()), PositionManager::LogLevel::INFO);
+
+    report_total_time(manager);
+}
+
+// book.datの1レコード分の評価値をnegamaxした値で書き換える　record: 固定長の40バイト、moves: リンクとリーフ
+// 返値: ポジションの評価値とリンクの評価値を書き換えた数
+std::pair<size_t, size_t> correct_book_record(unsigned char* record, unsigned char* moves) {
+    uint64_t my_stones = 0, opponent_stones = 0;
+    std::memcpy(&my_stones, record, sizeof(my_stones));
+    std::memcpy(&opponent_stones, record + 8, sizeof(opponent_stones));
+    const Position* position = read_position(my_stones, opponent_stones);
+    if (!position) {
+        return { 0, 0 };
+    }
+
+    size_t positions_updated = 0, links_updated = 0;
+    int16_t score = 0;
+    std::memcpy(&score, record + 32, sizeof(score));
+    if (score != position->propagated_eval) {
+        score = position->propagated_eval;
+        std::memcpy(record + 32, &score, sizeof(score));
+        positions_updated++;
+
+        // +34, +36 の下限と上限に評価値が収まらないとEdaxで壊れたbookになるので、評価値が入るまで広げる
+        int16_t lower = 0, upper = 0;
+        std::memcpy(&lower, record + 34, sizeof(lower));
+        std::memcpy(&upper, record + 36, sizeof(upper));
+        lower = std::min(lower, score);
+        upper = std::max(upper, score);
+        std::memcpy(record + 34, &lower, sizeof(lower));
+        std::memcpy(record + 36, &upper, sizeof(upper));
+    }
+
+    // リンクとリーフは子ポジションがbookにあるものだけ書き換える
+    uint8_t numberline = record[38];
+    for (int i = 0; i <= numberline; ++i) {
+        int8_t stored_eval = static_cast<int8_t>(moves[2 * i]);
+        uint8_t move = rotate_move_180(moves[2 * i + 1]);
+        if (i == numberline && !is_usable_leaf(Leaf{ move, stored_eval, false })) {
+            break;
+        }
+        const Position* child = nullptr;
+        int value = std::clamp(propagated_edge_value(*position, move, stored_eval, child), -127, 127);
+        if (child && value != stored_eval) {
+            moves[2 * i] = static_cast<unsigned char>(static_cast<int8_t>(value));
+            if (i < numberline) {
+                links_updated++;
+            }
+        }
+    }
+    return { positions_updated, links_updated };
+}
+
+// book.datを先頭から流し読みして1レコードずつfilterに渡し、trueが返ったレコードだけを書き出す
+// filterはrecord(固定長の40バイト)とmoves(リンクとリーフ)を書き換えてもよい　ヘッダーはポジション数だけ書き直してそのままコピー
+// 返値: 書き出したポジション数　失敗した場合は-1
+template<class Filter>
+long long rewrite_book_records(const std::string& book_path, const std::string& output_path, PositionManager& manager, Filter&& filter) {
+    // ファイルマッピングを作成
+    boost::interprocess::file_mapping file(book_path.c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+    const unsigned char* data = static_cast<const unsigned char*>(region.get_address());
+    std::size_t filesize = region.get_size();
+    if (filesize < 42) {
+        manager.debug_log("Book file is too short: " + book_path, PositionManager::LogLevel::ERROR);
+        return -1;
+    }
+
+    std::ofstream output(output_path, std::ios::binary | std::ios::trunc);
+    if (!output.is_open()) {
+        manager.debug_log("Failed to create book file: " + output_path, PositionManager::LogLevel::ERROR);
+        return -1;
+    }
+
+    // ヘッダーはそのままコピー
+    output.write(reinterpret_cast<const char*>(data), 42);
+    const unsigned char* current = data + 42;
+
+    long long written = 0;
+    unsigned char record[40];
+    boost::container::small_vector<unsigned char, 64> moves;
+    while (current + sizeof(record) <= data + filesize) {
+        std::memcpy(record, current, sizeof(record));
+        current += sizeof(record);
+        moves.resize(2 * static_cast<size_t>(record[38]) + 2);
+        if (current + moves.size() > data + filesize) break;
+        std::memcpy(moves.data(), current, moves.size());
+        current += moves.size();
+
+        if (!filter(record, moves.data())) {
+            continue;
+        }
+        output.write(reinterpret_cast<const char*>(record), sizeof(record));
+        output.write(reinterpret_cast<const char*>(moves.data()), moves.size());
+        if (!output) {
+            break;
+        }
+        written++;
+    }
+
+    // ヘッダーのポジション数を書き出した数にする
+    int32_t position_count = static_cast<int32_t>(written);
+    output.seekp(38);
+    output.write(reinterpret_cast<const char*>(&position_count), sizeof(position_count));
+    output.close();
+    if (output.fail()) {
+        manager.debug_log("Failed to write book file: " + output_path, PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: Failed to write " << output_path << std::endl;
+        return -1;
+    }
+    return written;
+}
+
+// mode 8: negamaxした値でポジションとリンクの評価値を書き換えたbookをEdax形式で書き出す
+// 入力のbook.datを先頭から流し読みして評価値だけを書き換えてコピーするので、win, draw, lose, line, level などはそのまま
+void write_corrected_book(const std::string& book_path, const std::string& corrected_book_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    propagate_negamax(manager, config);
+
+    size_t positions_updated = 0, links_updated = 0;
+    long long records = rewrite_book_records(book_path, corrected_book_path, manager, [&](unsigned char* record, unsigned char* moves) {
+        auto [position_count, link_count] = correct_book_record(record, moves);
+        positions_updated += position_count;
+        links_updated += link_count;
+        return true;
+    });
+    if (records < 0) {
+        return;
+    }
+
+    std::cout << records << " Positions written to " << corrected_book_path << std::endl;
+    std::cout << positions_updated << " Position evals and " << links_updated << " Link evals corrected" << std::endl;
+    manager.debug_log("Corrected book: " + std::to_string(positions_updated) + " position evals, " + std::to_string(links_updated) + " link evals updated", PositionManager::LogLevel::INFO);
+
+    report_total_time(manager);
+}
+
+// book.datでの1レコードのバイト数 (固定長40バイト + リンク + リーフ)
+inline size_t book_record_size(const Position& position) {
+    return 40 + 2 * position.links.size() + 2;
+}
+
+// 初期局面からリンクとリーフで辿れるポジションにreachableを付ける　返値: 辿れたポジション数
+// 子ポジションは石が1つ多いので石の数ごとに1段ずつ、段の中は並列に展開する　パスは同じ段なので先に1スレッドで足しておく
+size_t mark_reachable_positions(PositionManager& manager, unsigned threads) {
+    for (auto& pair : book_positions) {
+        pair.second.reachable = false;
+    }
+    std::pair<uint64_t, uint64_t> initial_key = normalize_key(0x0000000810000000ULL, 0x0000001008000000ULL);
+    auto initial_it = book_positions.find(initial_key);
+    if (initial_it == book_positions.end()) {
+        manager.debug_log("Initial position not found in book. Terminating program.", PositionManager::LogLevel::ERROR);
+        std::exit(1);
+    }
+
+    std::vector<std::vector<Position*>> levels(65);
+    Position* initial_position = &initial_it->second;
+    initial_position->reachable = true;
+    levels[popcount64(initial_position->my_stones | initial_position->opponent_stones)].push_back(initial_position);
+    size_t reachable_count = 1;
+
+    std::vector<std::vector<Position*>> worker_children(threads);
+    for (int discs = 0; discs <= 64; ++discs) {
+        std::vector<Position*>& frontier = levels[discs];
+
+        // パスの先は同じ石の数なのでこの段に足す
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            const Position& position = *frontier[i];
+            if (!has_pass_edge(position)) {
+                continue;
+            }
+            Position* child = const_cast<Position*>(find_child_record(position, 64));
+            if (child && !child->reachable) {
+                child->reachable = true;
+                reachable_count++;
+                frontier.push_back(child);
+            }
+        }
+
+        // パス以外の手は並列に展開　reachableを書くのは後でまとめて1スレッドで
+        parallel_for(frontier.size(), threads, [&](size_t begin, size_t end, unsigned worker) {
+            std::vector<Position*>& children = worker_children[worker];
+            for (size_t i = begin; i < end; ++i) {
+                const Position& position = *frontier[i];
+                auto visit = [&](uint8_t move) {
+                    if (move >= 64) return;
+                    const Position* child = find_child_record(position, move);
+                    if (child && !child->reachable) {
+                        children.push_back(const_cast<Position*>(child));
+                    }
+                };
+                for (const auto& link : position.links) {
+                    visit(link.move);
+                }
+                if (is_usable_leaf(position.leaf)) {
+                    visit(position.leaf.move);
+                }
+            }
+        });
+        for (auto& children : worker_children) {
+            for (Position* child : children) {
+                if (!child->reachable) {
+                    child->reachable = true;
+                    reachable_count++;
+                    levels[popcount64(child->my_stones | child->opponent_stones)].push_back(child);
+                }
+            }
+            children.clear();
+        }
+    }
+    return reachable_count;
+}
+
+// mode 9: 初期局面から辿れないポジション(孤立したポジション)を石の数ごとに数える
+// 正規化されていない向きで入っているポジションは探索で見つからないので、それも別に数える
+void reachability_process(PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    unsigned threads = resolve_thread_count(config.threads);
+    size_t reachable_count = mark_reachable_positions(manager, threads);
+
+    struct LevelCount {
+        size_t total = 0;
+        size_t orphans = 0;
+        size_t non_canonical = 0;
+        size_t orphan_bytes = 0;
+    };
+    std::vector<LevelCount> counts(65);
+    size_t total_bytes = 0;
+    std::ofstream dump_file;
+    if (config.dump_orphans) {
+        dump_file.open("orphan_positions.txt", std::ios::binary | std::ios::trunc);
+        dump_file << "# my_stones\topponent_stones\tdiscs\tcanonical\n";
+    }
+    for (const auto& pair : book_positions) {
+        const Position& position = pair.second;
+        int discs = popcount64(position.my_stones | position.opponent_stones);
+        LevelCount& count = counts[discs];
+        count.total++;
+        total_bytes += book_record_size(position);
+        if (position.reachable) {
+            continue;
+        }
+        bool canonical = normalize_key(position.my_stones, position.opponent_stones) == pair.first;
+        count.orphans++;
+        count.orphan_bytes += book_record_size(position);
+        if (!canonical) {
+            count.non_canonical++;
+        }
+        if (dump_file.is_open()) {
+            dump_file << "0x" << std::hex << std::setw(16) << std::setfill('0') << position.my_stones
+                << "\t0x" << std::setw(16) << position.opponent_stones << std::dec
+                << '\t' << discs << '\t' << (canonical ? 1 : 0) << '\n';
+        }
+    }
+
+    // 石の数ごとの表をコンソールとデバッグログに出力
+    std::stringstream ss;
+    ss << "discs\ttotal\treachable\torphans\tnon_canonical\n";
+    size_t orphan_count = 0, orphan_bytes = 0;
+    for (int discs = 0; discs <= 64; ++discs) {
+        const LevelCount& count = counts[discs];
+        orphan_count += count.orphans;
+        orphan_bytes += count.orphan_bytes;
+        if (count.total == 0) {
+            continue;
+        }
+        ss << discs << '\t' << count.total << '\t' << (count.total - count.orphans) << '\t' << count.orphans << '\t' << count.non_canonical << '\n';
+    }
+    ss << "Reachable positions: " << reachable_count << " / " << book_positions.size() << "\n"
+        << "Orphan positions: " << orphan_count << " (" << orphan_bytes << " of " << total_bytes << " record bytes)";
+    std::cout << ss.str() << std::endl;
+    manager.debug_log("Reachability:\n" + ss.str(), PositionManager::LogLevel::WARNING);
+
+    report_total_time(manager);
+}
+
+// mode 10: 初期局面から辿れるポジションだけを正規化した向きで書き出したbookを作る
+// 正規化されていない向きで入っているポジションは、正規化した向きのポジションがbookに無ければ向きを直して残す
+// 残すレコードは石とmove値以外をそのままコピーする　ヘッダーもポジション数以外はそのまま
+void compact_book(const std::string& book_path, const std::string& compacted_book_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+
+    // 正規化されていない向きのポジションを正規化した向きでmapに足しておく　そうしないと探索で辿れない
+    std::vector<Position> rekeyed_positions;
+    std::set<std::pair<uint64_t, uint64_t>> rekeyed_keys;
+    for (const auto& pair : book_positions) {
+        std::pair<uint64_t, uint64_t> canonical_key = normalize_key(pair.first.first, pair.first.second);
+        if (canonical_key == pair.first || book_positions.count(canonical_key)) {
+            continue;
+        }
+        Position position = pair.second;
+        normalize_book_position(position, manager);
+        rekeyed_positions.push_back(std::move(position));
+        rekeyed_keys.insert(pair.first);
+    }
+    for (auto& position : rekeyed_positions) {
+        std::pair<uint64_t, uint64_t> key(position.my_stones, position.opponent_stones);
+        book_positions.emplace(key, std::move(position));
+    }
+    rekeyed_positions.clear();
+
+    size_t reachable_count = mark_reachable_positions(manager, resolve_thread_count(config.threads));
+
+    size_t read_count = 0, reoriented_count = 0;
+    long long written = rewrite_book_records(book_path, compacted_book_path, manager, [&](unsigned char* record, unsigned char* moves) {
+        read_count++;
+        uint64_t my_stones, opponent_stones;
+        std::memcpy(&my_stones, record, sizeof(my_stones));
+        std::memcpy(&opponent_stones, record + 8, sizeof(opponent_stones));
+        std::pair<uint64_t, uint64_t> key(my_stones, opponent_stones);
+        std::pair<uint64_t, uint64_t> canonical_key = normalize_key(my_stones, opponent_stones);
+        if (canonical_key != key && !rekeyed_keys.count(key)) {
+            return false;
+        }
+        auto it = book_positions.find(canonical_key);
+        if (it == book_positions.end() || !it->second.reachable) {
+            return false;
+        }
+        // 同じポジションが何度出てきても書き出すのは最初の1回だけ
+        it->second.reachable = false;
+        if (canonical_key == key) {
+            return true;
+        }
+
+        // 石とmove値を正規化した向きに直す　move値はbook.datの並びなので180度回してから変換して戻す
+        auto [normalized, transformation] = normalize_position(my_stones, opponent_stones, manager);
+        my_stones = std::get<0>(normalized);
+        opponent_stones = std::get<1>(normalized);
+        std::memcpy(record, &my_stones, sizeof(my_stones));
+        std::memcpy(record + 8, &opponent_stones, sizeof(opponent_stones));
+        int move_count = record[38] + 1;
+        for (int i = 0; i < move_count; ++i) {
+            uint8_t& raw_move = moves[2 * i + 1];
+            if (raw_move < 64) {
+                raw_move = rotate_move_180(static_cast<uint8_t>(normalize_move(rotate_move_180(raw_move), transformation, manager)));
+            }
+        }
+        reoriented_count++;
+        return true;
+    });
+    if (written < 0) {
+        return;
+    }
+
+    std::stringstream ss;
+    ss << "Reachable positions: " << reachable_count << " / " << book_positions.size() << "\n"
+        << written << " Positions written to " << compacted_book_path << " (" << (read_count - written) << " records dropped, "
+        << reoriented_count << " reoriented)";
+    std::cout << ss.str() << std::endl;
+    manager.debug_log("Compacted book:\n" + ss.str(), PositionManager::LogLevel::WARNING);
+
+    report_total_time(manager);
+}
+
+// mode 11 で2つのbookを比べるための1ポジション分の要約　一時ファイルにはこのまま書き出す
+struct BookDiffEntry {
+    uint64_t my_stones;        // 正規化した向きの盤面
+    uint64_t opponent_stones;
+    uint64_t moves_hash;       // リンクとリーフ(手と評価値)のハッシュ
+    uint32_t game_count;
+    int8_t eval_value;
+    int8_t max_move_eval;
+    uint8_t link_count;
+    uint8_t mismatch_flags;    // bit0: mode 1 の不一致, bit1: mode 2 の不一致
+};
+
+inline bool book_diff_key_less(const BookDiffEntry& lhs, const BookDiffEntry& rhs) {
+    return std::make_pair(lhs.my_stones, lhs.opponent_stones) < std::make_pair(rhs.my_stones, rhs.opponent_stones);
+}
+
+// ポジションから要約を作る　向きが違っても同じになるように正規化してからリンクを手の順に並べてハッシュする
+BookDiffEntry make_book_diff_entry(Position& position, PositionManager& manager) {
+    normalize_book_position(position, manager);
+
+    BookDiffEntry entry{};
+    entry.my_stones = position.my_stones;
+    entry.opponent_stones = position.opponent_stones;
+    entry.game_count = position.game_count;
+    entry.eval_value = position.eval_value;
+    entry.max_move_eval = position.max_move_eval;
+    entry.link_count = static_cast<uint8_t>(position.links.size());
+
+    MismatchDetail detail;
+    if (judge_mismatch<1>(position, position, 0, manager, detail)) entry.mismatch_flags |= 1;
+    if (judge_mismatch<2>(position, position, 0, manager, detail)) entry.mismatch_flags |= 2;
+
+    // FNV-1a
+    std::vector<std::pair<uint8_t, int8_t>> moves;
+    for (const auto& link : position.links) {
+        moves.emplace_back(link.move, link.eval_link);
+    }
+    std::sort(moves.begin(), moves.end());
+    moves.emplace_back(position.leaf.move, position.leaf.eval);
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto& move : moves) {
+        hash = (hash ^ move.first) * 1099511628211ULL;
+        hash = (hash ^ static_cast<uint8_t>(move.second)) * 1099511628211ULL;
+    }
+    entry.moves_hash = hash;
+    return entry;
+}
+
+// 外部ソートのランを1本書き出す　chunkを並べ替えてrun_prefixに番号を付けた一時ファイルに書き、run_pathsに足して空にする
+// 同じキーが何度もある場合は先に出てきた方を残すのでstable_sort
+template<class Entry, class Less>
+void write_sorted_run(std::vector<Entry>& chunk, const std::string& run_prefix, std::vector<std::string>& run_paths, Less less, PositionManager& manager) {
+    if (chunk.empty()) {
+        return;
+    }
+    std::stable_sort(chunk.begin(), chunk.end(), less);
+    std::string run_path = run_prefix + std::to_string(run_paths.size()) + ".tmp";
+    std::ofstream run_file(run_path, std::ios::binary | std::ios::trunc);
+    if (!run_file.is_open()) {
+        manager.debug_log("Failed to create temporary file: " + run_path, PositionManager::LogLevel::ERROR);
+        std::exit(1);
+    }
+    run_file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size() * sizeof(Entry));
+    run_file.close();
+    if (run_file.fail()) {
+        manager.debug_log("Failed to write temporary file: " + run_path, PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: Failed to write " << run_path << std::endl;
+        std::exit(1);
+    }
+    run_paths.push_back(run_path);
+    chunk.clear();
+}
+
+// 外部ソートの1段目　bookを流し読みしてchunk_positions件ずつキーの順に並べて一時ファイル(ラン)に書き出す
+// 返値: 書き出したランのファイル名　bookを開けなかった場合はopenedがfalse
+std::vector<std::string> write_book_diff_runs(const std::string& book_path, const std::string& run_prefix, size_t chunk_positions, PositionManager& manager, size_t& positions_read, bool& opened) {
+    std::vector<std::string> run_paths;
+    std::vector<BookDiffEntry> chunk;
+    chunk.reserve(chunk_positions);
+    positions_read = 0;
+
+    auto flush_chunk = [&]() {
+        write_sorted_run(chunk, run_prefix, run_paths, book_diff_key_less, manager);
+    };
+
+    opened = for_each_book_record(book_path, manager, [&](Position&& position) {
+        chunk.push_back(make_book_diff_entry(position, manager));
+        positions_read++;
+        if (chunk.size() >= chunk_positions) {
+            flush_chunk();
+        }
+
+        // 10万ポジションごとに進捗を表示
+        if (positions_read % 100000 == 0) {
+            std::cout << "\r" << positions_read << " Positions sorted (" << book_path << ")" << std::flush;
+        }
+    });
+    flush_chunk();
+    std::cout << "\r" << positions_read << " Positions sorted (" << book_path << ")" << std::endl;
+    return run_paths;
+}
+
+// 外部ソートの2段目　ランをk-wayマージしてキーの順に1件ずつ返す　skip_duplicatesなら同じキーの2件目以降は数えるだけで飛ばす
+template<class Entry, bool (*Less)(const Entry&, const Entry&)>
+class SortedRunStream {
+public:
+    explicit SortedRunStream(const std::vector<std::string>& run_paths, bool skip_duplicates = true) : skip_duplicates(skip_duplicates) {
+        for (const auto& run_path : run_paths) {
+            runs.push_back(std::make_unique<std::ifstream>(run_path, std::ios::binary));
+            heads.emplace_back();
+            advance(runs.size() - 1);
+        }
+    }
+
+    bool next(Entry& entry) {
+        while (!queue.empty()) {
+            size_t run = queue.top();
+            queue.pop();
+            entry = heads[run];
+            advance(run);
+            if (skip_duplicates && has_last && !Less(last, entry)) {
+                duplicates++;
+                continue;
+            }
+            last = entry;
+            has_last = true;
+            return true;
+        }
+        return false;
+    }
+
+    size_t duplicates = 0;
+
+private:
+    void advance(size_t run) {
+        if (runs[run]->read(reinterpret_cast<char*>(&heads[run]), sizeof(Entry))) {
+            queue.push(run);
+        }
+    }
+
+    // キーが同じならランの番号が小さい方 (bookの前の方) を先に出す
+    struct Greater {
+        const SortedRunStream* stream;
+        bool operator()(size_t lhs, size_t rhs) const {
+            const Entry& a = stream->heads[lhs];
+            const Entry& b = stream->heads[rhs];
+            if (Less(b, a)) return true;
+            if (Less(a, b)) return false;
+            return lhs > rhs;
+        }
+    };
+
+    std::vector<std::unique_ptr<std::ifstream>> runs;
+    std::vector<Entry> heads;
+    std::priority_queue<size_t, std::vector<size_t>, Greater> queue{ Greater{ this } };
+    Entry last{};
+    bool has_last = false;
+    bool skip_duplicates;
+};
+
+using BookDiffStream = SortedRunStream<BookDiffEntry, book_diff_key_less>;
+
+// mode 11: 前のbook (diff_book) と今のbook.datを比べて、増えた、消えた、変わったポジションを出力する
+// どちらのbookもmapに入れずに外部ソートしてマージするので、メモリはdiff_chunk_positions件分で済む
+void diff_books(const std::string& old_book_path, const std::string& new_book_path, const std::string& diff_output_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    if (old_book_path.empty()) {
+        std::cerr << "Error: diff_book is not set in config.ini." << std::endl;
+        manager.debug_log("diff_book is not set", PositionManager::LogLevel::ERROR);
+        return;
+    }
+    size_t chunk_positions = std::max<size_t>(1, config.diff_chunk_positions);
+
+    size_t old_positions = 0, new_positions = 0;
+    bool old_opened = false, new_opened = false;
+    std::vector<std::string> old_runs = write_book_diff_runs(old_book_path, diff_output_path + ".old.run", chunk_positions, manager, old_positions, old_opened);
+    std::vector<std::string> new_runs = write_book_diff_runs(new_book_path, diff_output_path + ".new.run", chunk_positions, manager, new_positions, new_opened);
+
+    auto remove_runs = [&]() {
+        std::error_code remove_error;
+        for (const auto& run_paths : { old_runs, new_runs }) {
+            for (const auto& run_path : run_paths) {
+                std::filesystem::remove(run_path, remove_error);
+            }
+        }
+    };
+    if (!old_opened || !new_opened) {
+        std::cerr << "Error: Failed to open " << (old_opened ? new_book_path : old_book_path) << std::endl;
+        remove_runs();
+        return;
+    }
+
+    std::ofstream diff_file(diff_output_path, std::ios::binary | std::ios::trunc);
+    if (!diff_file.is_open()) {
+        manager.debug_log("Failed to create diff file: " + diff_output_path, PositionManager::LogLevel::ERROR);
+        remove_runs();
+        return;
+    }
+    diff_file << "# status\tmy_stones\topponent_stones\told_eval\tnew_eval\told_max_move_eval\tnew_max_move_eval\tchanges\n";
+
+    size_t added = 0, removed = 0, changed = 0, eval_changed = 0, unchanged = 0;
+    size_t fixed[2] = { 0, 0 }, introduced[2] = { 0, 0 };
+    auto write_line = [&](const char* status, const BookDiffEntry& key, const BookDiffEntry* old_entry, const BookDiffEntry* new_entry, const std::string& changes) {
+        diff_file << status << "\t0x" << std::hex << std::setw(16) << std::setfill('0') << key.my_stones
+            << "\t0x" << std::setw(16) << key.opponent_stones << std::dec;
+        for (const BookDiffEntry* entry : { old_entry, new_entry }) {
+            diff_file << '\t';
+            if (entry) diff_file << static_cast<int>(entry->eval_value); else diff_file << '-';
+        }
+        for (const BookDiffEntry* entry : { old_entry, new_entry }) {
+            diff_file << '\t';
+            if (entry) diff_file << static_cast<int>(entry->max_move_eval); else diff_file << '-';
+        }
+        diff_file << '\t' << changes << '\n';
+    };
+
+    // 3段目: キーの順に並んだ2本をマージしながら突き合わせる
+    BookDiffStream old_stream(old_runs), new_stream(new_runs);
+    BookDiffEntry old_entry{}, new_entry{};
+    bool has_old = old_stream.next(old_entry);
+    bool has_new = new_stream.next(new_entry);
+    while (has_old || has_new) {
+        if (has_old && (!has_new || book_diff_key_less(old_entry, new_entry))) {
+            write_line("removed", old_entry, &old_entry, nullptr, "-");
+            removed++;
+            has_old = old_stream.next(old_entry);
+            continue;
+        }
+        if (has_new && (!has_old || book_diff_key_less(new_entry, old_entry))) {
+            write_line("added", new_entry, nullptr, &new_entry, "-");
+            added++;
+            has_new = new_stream.next(new_entry);
+            continue;
+        }
+
+        std::vector<std::string> changes;
+        if (old_entry.eval_value != new_entry.eval_value) {
+            changes.push_back("eval");
+            eval_changed++;
+        }
+        if (old_entry.moves_hash != new_entry.moves_hash || old_entry.link_count != new_entry.link_count) {
+            changes.push_back("moves");
+        }
+        if (old_entry.game_count != new_entry.game_count) {
+            changes.push_back("games");
+        }
+        for (int i = 0; i < 2; ++i) {
+            bool old_mismatch = (old_entry.mismatch_flags >> i) & 1;
+            bool new_mismatch = (new_entry.mismatch_flags >> i) & 1;
+            if (old_mismatch && !new_mismatch) {
+                changes.push_back("mode" + std::to_string(i + 1) + "_fixed");
+                fixed[i]++;
+            }
+            else if (!old_mismatch && new_mismatch) {
+                changes.push_back("mode" + std::to_string(i + 1) + "_introduced");
+                introduced[i]++;
+            }
+        }
+        if (changes.empty()) {
+            unchanged++;
+        }
+        else {
+            std::string joined;
+            for (const auto& change : changes) {
+                joined += (joined.empty() ? "" : ",") + change;
+            }
+            write_line("changed", new_entry, &old_entry, &new_entry, joined);
+            changed++;
+        }
+        has_old = old_stream.next(old_entry);
+        has_new = new_stream.next(new_entry);
+    }
+    diff_file.close();
+    remove_runs();
+
+    std::stringstream ss;
+    ss << "Old book: " << old_book_path << " (" << old_positions << " positions, " << old_stream.duplicates << " duplicates)\n"
+        << "New book: " << new_book_path << " (" << new_positions << " positions, " << new_stream.duplicates << " duplicates)\n"
+        << "Added: " << added << ", Removed: " << removed << ", Changed: " << changed << " (eval " << eval_changed << "), Unchanged: " << unchanged << "\n"
+        << "Mode 1 mismatches fixed: " << fixed[0] << ", introduced: " << introduced[0] << "\n"
+        << "Mode 2 mismatches fixed: " << fixed[1] << ", introduced: " << introduced[1];
+    std::cout << ss.str() << std::endl;
+    manager.debug_log("Book diff:\n" + ss.str(), PositionManager::LogLevel::WARNING);
+
+    report_total_time(manager);
+}
+
+inline bool streaming_edge_child_less(const StreamingEdge& lhs, const StreamingEdge& rhs) {
+    return std::make_pair(lhs.child_my_stones, lhs.child_opponent_stones) < std::make_pair(rhs.child_my_stones, rhs.child_opponent_stones);
+}
+
+// streaming_checkのポジションの要約　同じポジションの2つ目以降のレコードが分かるように、book.datの何番目かも持つ
+struct StreamingBookEntry {
+    BookDiffEntry summary;
+    uint64_t record;
+};
+
+inline bool streaming_book_entry_less(const StreamingBookEntry& lhs, const StreamingBookEntry& rhs) {
+    return book_diff_key_less(lhs.summary, rhs.summary);
+}
+
+// streaming_checkのmode 3, 4　bookを1回流し読みして、辺 (親の手と子ポジション) と子ポジションの要約をそれぞれ外部ソートのランに書き出す
+// 子ポジションのキーの順にマージして突き合わせ、親の手の評価値と子ポジションの評価値で判定する　mapは作らない
+// メモリはランの分 (memory_bytesを辺と要約で半分ずつ) と不一致の辺だけ　返値: 不一致の辺 (mismatch_flagsに不一致のmode)
+std::vector<StreamingEdge> find_streaming_edge_mismatches(const std::string& book_path, const std::string& run_prefix, size_t memory_bytes, unsigned mode_mask, PositionManager& manager, size_t& positions_read, bool& opened) {
+    size_t edge_chunk_size = std::max<size_t>(1, memory_bytes / 2 / sizeof(StreamingEdge));
+    size_t entry_chunk_size = std::max<size_t>(1, memory_bytes / 2 / sizeof(StreamingBookEntry));
+    std::vector<std::string> edge_runs, entry_runs;
+    std::vector<StreamingEdge> edge_chunk;
+    std::vector<StreamingBookEntry> entry_chunk;
+    size_t edges_written = 0;
+    positions_read = 0;
+
+    auto remove_runs = [&]() {
+        std::error_code remove_error;
+        for (const auto& run_paths : { edge_runs, entry_runs }) {
+            for (const auto& run_path : run_paths) {
+                std::filesystem::remove(run_path, remove_error);
+            }
+        }
+    };
+
+    // 1段目: 正規化した親ポジションのリンクとリーフから辺を作る　通常の探索と同じく対称な手で評価値も同じものは1つだけ
+    // リーフの手がリンクにもある場合は判定にリンクの評価値を使うので、リンクの辺だけにする
+    opened = for_each_book_record(book_path, manager, [&](Position&& position) {
+        uint64_t record = positions_read;
+        entry_chunk.push_back({ make_book_diff_entry(position, manager), record });
+        prune_symmetric_moves(position);
+        auto add_edge = [&](uint8_t move, int8_t eval) {
+            uint64_t child_my_stones, child_opponent_stones;
+            if (!make_child_stones(position, move, child_my_stones, child_opponent_stones)) {
+                return;
+            }
+            std::pair<uint64_t, uint64_t> child_key = normalize_key(child_my_stones, child_opponent_stones);
+            // 一時ファイルにそのまま書き出すので、詰め物のバイトも0にしておく
+            StreamingEdge edge{};
+            edge.child_my_stones = child_key.first;
+            edge.child_opponent_stones = child_key.second;
+            edge.parent_my_stones = position.my_stones;
+            edge.parent_opponent_stones = position.opponent_stones;
+            edge.parent_record = record;
+            edge.move = move;
+            edge.parent_eval = eval;
+            edge_chunk.push_back(edge);
+            edges_written++;
+            if (edge_chunk.size() >= edge_chunk_size) {
+                write_sorted_run(edge_chunk, run_prefix + "_edge", edge_runs, streaming_edge_child_less, manager);
+            }
+        };
+        for (const Link& link : position.links) {
+            if (!link.visited) {
+                add_edge(link.move, link.eval_link);
+            }
+        }
+        if (is_usable_leaf(position.leaf) && !position.leaf.visited && find_link_slot(position, position.leaf.move) < 0) {
+            add_edge(position.leaf.move, position.leaf.eval);
+        }
+        if (entry_chunk.size() >= entry_chunk_size) {
+            write_sorted_run(entry_chunk, run_prefix + "_book", entry_runs, streaming_book_entry_less, manager);
+        }
+
+        // 10万ポジションごとに進捗を表示
+        positions_read++;
+        if (positions_read % 100000 == 0) {
+            std::cout << "\r" << positions_read << " Positions sorted (" << edges_written << " edges)" << std::flush;
+        }
+    });
+    write_sorted_run(edge_chunk, run_prefix + "_edge", edge_runs, streaming_edge_child_less, manager);
+    write_sorted_run(entry_chunk, run_prefix + "_book", entry_runs, streaming_book_entry_less, manager);
+    std::vector<StreamingEdge>().swap(edge_chunk);
+    std::vector<StreamingBookEntry>().swap(entry_chunk);
+    if (!opened) {
+        remove_runs();
+        return {};
+    }
+    std::cout << "\r" << positions_read << " Positions sorted (" << edges_written << " edges)" << std::endl;
+
+    // 同じポジションが何度もある場合は、通常の読み込みと同じく先に出てきたレコードだけを使う
+    // 要約を1回流して2つ目以降のレコードの番号を集めておき、そのレコードから出る辺は突き合わせない
+    std::vector<uint64_t> duplicate_records;
+    {
+        SortedRunStream<StreamingBookEntry, streaming_book_entry_less> duplicate_stream(entry_runs, false);
+        StreamingBookEntry entry{}, last{};
+        bool has_last = false;
+        while (duplicate_stream.next(entry)) {
+            if (has_last && !streaming_book_entry_less(last, entry)) {
+                duplicate_records.push_back(entry.record);
+            }
+            last = entry;
+            has_last = true;
+        }
+        std::sort(duplicate_records.begin(), duplicate_records.end());
+    }
+
+    // 2段目: 辺と要約を子ポジションのキーの順にマージして突き合わせる　bookに無い子ポジションへの辺は通常の探索でも辿らない
+    std::vector<StreamingEdge> mismatches;
+    SortedRunStream<StreamingEdge, streaming_edge_child_less> edge_stream(edge_runs, false);
+    SortedRunStream<StreamingBookEntry, streaming_book_entry_less> entry_stream(entry_runs);
+    StreamingBookEntry child{};
+    bool has_child = entry_stream.next(child);
+    StreamingEdge edge{};
+    size_t edges_joined = 0, duplicate_edges = 0;
+    while (edge_stream.next(edge)) {
+        if (std::binary_search(duplicate_records.begin(), duplicate_records.end(), edge.parent_record)) {
+            duplicate_edges++;
+            continue;
+        }
+        auto child_key = std::make_pair(edge.child_my_stones, edge.child_opponent_stones);
+        while (has_child && std::make_pair(child.summary.my_stones, child.summary.opponent_stones) < child_key) {
+            has_child = entry_stream.next(child);
+        }
+        if (!has_child || std::make_pair(child.summary.my_stones, child.summary.opponent_stones) != child_key) {
+            continue;
+        }
+        edges_joined++;
+
+        // judge_mismatch<3>, <4> と同じ条件
+        int8_t max_child_move_eval = std::max<int8_t>(child.summary.max_move_eval, -64);
+        if ((mode_mask & mode_bit(3)) && edge.parent_eval != -child.summary.eval_value) {
+            edge.mismatch_flags |= mode_bit(3);
+        }
+        if ((mode_mask & mode_bit(4)) && edge.parent_eval != -max_child_move_eval) {
+            edge.mismatch_flags |= mode_bit(4);
+        }
+        if (edge.mismatch_flags != 0) {
+            mismatches.push_back(edge);
+        }
+    }
+    remove_runs();
+
+    manager.debug_log("Streaming check: " + std::to_string(edges_written) + " edges in " + std::to_string(edge_runs.size()) + " runs, " +
+        std::to_string(edges_joined) + " edges to book positions, " + std::to_string(duplicate_edges) + " edges of duplicate records skipped, " +
+        std::to_string(mismatches.size()) + " mismatched edges", PositionManager::LogLevel::INFO);
+    return mismatches;
+}
+
+// streaming_checkの棋譜探しで使うbookのポジションの手　(石の数, キー) の順に外部ソートして1つのファイルにする
+struct StreamingMoveEntry {
+    uint64_t my_stones;        // bookのレコードの盤面 (正規化した向き)
+    uint64_t opponent_stones;
+    uint8_t disc_count;
+    uint8_t move_count;
+    uint8_t moves[38];         // 通常の探索で辿るリンクとリーフの手 (bookの向き)　打てる手は33手までなので足りる
+};
+
+inline bool streaming_move_entry_less(const StreamingMoveEntry& lhs, const StreamingMoveEntry& rhs) {
+    return std::tie(lhs.disc_count, lhs.my_stones, lhs.opponent_stones) < std::tie(rhs.disc_count, rhs.my_stones, rhs.opponent_stones);
+}
+
+// 初期局面から着いたポジション (フロンティア) の1件　正規化したキーの順に外部ソートする
+struct StreamingFrontierEntry {
+    uint64_t key_my_stones;    // 正規化したキー (ソートのキー)
+    uint64_t key_opponent_stones;
+    uint64_t my_stones;        // 実際の盤面
+    uint64_t opponent_stones;
+    uint8_t kifu_length;
+    uint8_t kifu[60];          // 初期局面からの手 (実際の向き)　パスは棋譜に残らないので入れない
+};
+
+inline bool streaming_frontier_less(const StreamingFrontierEntry& lhs, const StreamingFrontierEntry& rhs) {
+    return std::make_pair(lhs.key_my_stones, lhs.key_opponent_stones) < std::make_pair(rhs.key_my_stones, rhs.key_opponent_stones);
+}
+
+// streaming_checkの棋譜探し　キーの索引をメモリに置かずに、初期局面から石の数ごとに幅優先で辿る
+// bookを流し読みしてポジションの手を (石の数, キー) の順に外部ソートしたファイルにし、石の数ごとに着いたポジションの外部ソートのランとマージして次の石の数のポジションを作る
+// 手を打つと石が1つ増えるので1つの石の数は1回読むだけで済む　パスの先は同じ石の数なのでもう1回だけ読む
+// 棋譜が欲しいポジションに全部着いたら止める　メモリはmemory_bytes分だけ
+// on_recordはbookの各レコードを読んだときに呼ぶ (出力で使うレコードを取っておく)　返値: bookを開けなかった場合はfalse
+bool find_streaming_kifus(const std::string& book_path, const std::string& run_prefix, size_t memory_bytes, KifuSearch& search, const std::function<void(Position&)>& on_record, PositionManager& manager, bool report_root) {
+    size_t move_chunk_size = std::max<size_t>(1, memory_bytes / sizeof(StreamingMoveEntry));
+    size_t frontier_chunk_size = std::max<size_t>(1, memory_bytes / 2 / sizeof(StreamingFrontierEntry));
+    std::string moves_path = run_prefix + "_moves.tmp";
+    std::vector<std::string> move_runs, frontier_runs, next_runs, pass_runs;
+    auto remove_files = [](std::vector<std::string>& paths) {
+        std::error_code remove_error;
+        for (const auto& path : paths) {
+            std::filesystem::remove(path, remove_error);
+        }
+        paths.clear();
+    };
+    auto remove_all = [&]() {
+        for (auto* paths : { &move_runs, &frontier_runs, &next_runs, &pass_runs }) {
+            remove_files(*paths);
+        }
+        std::error_code remove_error;
+        std::filesystem::remove(moves_path, remove_error);
+    };
+
+    // 1段目: bookを流し読みして手の一覧をランに書き出す　通常の探索と同じくリンクと使えるリーフの手
+    std::vector<StreamingMoveEntry> move_chunk;
+    size_t positions_read = 0, truncated_records = 0;
+    bool opened = for_each_book_record(book_path, manager, [&](Position&& position) {
+        StreamingMoveEntry entry{};
+        entry.my_stones = position.my_stones;
+        entry.opponent_stones = position.opponent_stones;
+        entry.disc_count = static_cast<uint8_t>(popcount64(position.my_stones | position.opponent_stones));
+        bool truncated = false;
+        auto add_move = [&](uint8_t move) {
+            if (entry.move_count < sizeof(entry.moves)) {
+                entry.moves[entry.move_count++] = move;
+            }
+            else {
+                truncated = true;
+            }
+        };
+        for (const Link& link : position.links) {
+            add_move(link.move);
+        }
+        if (is_usable_leaf(position.leaf)) {
+            add_move(position.leaf.move);
+        }
+        truncated_records += truncated ? 1 : 0;
+        move_chunk.push_back(entry);
+        if (move_chunk.size() >= move_chunk_size) {
+            write_sorted_run(move_chunk, run_prefix + "_moves", move_runs, streaming_move_entry_less, manager);
+        }
+        on_record(position);
+
+        // 10万ポジションごとに進捗を表示
+        positions_read++;
+        if (positions_read % 100000 == 0) {
+            std::cout << "\r" << positions_read << " Positions sorted for kifus" << std::flush;
+        }
+    });
+    write_sorted_run(move_chunk, run_prefix + "_moves", move_runs, streaming_move_entry_less, manager);
+    std::vector<StreamingMoveEntry>().swap(move_chunk);
+    if (!opened) {
+        remove_all();
+        return false;
+    }
+    std::cout << "\r" << positions_read << " Positions sorted for kifus" << std::endl;
+    if (truncated_records > 0) {
+        manager.debug_log("Kifu search: " + std::to_string(truncated_records) + " records have more moves than a position can have, extra moves ignored", PositionManager::LogLevel::WARNING);
+    }
+
+    // 2段目: ランをマージして1つのファイルにし、石の数ごとの始まりを覚えておく　同じポジションが何度もある場合は先に出てきたレコード
+    std::vector<uint64_t> level_begin(66, 0);
+    {
+        std::ofstream moves_file(moves_path, std::ios::binary | std::ios::trunc);
+        if (!moves_file.is_open()) {
+            manager.debug_log("Failed to create temporary file: " + moves_path, PositionManager::LogLevel::ERROR);
+            remove_all();
+            std::exit(1);
+        }
+        SortedRunStream<StreamingMoveEntry, streaming_move_entry_less> move_stream(move_runs);
+        StreamingMoveEntry entry{};
+        while (move_stream.next(entry)) {
+            moves_file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            level_begin[entry.disc_count + 1]++;
+        }
+        moves_file.close();
+        if (moves_file.fail()) {
+            manager.debug_log("Failed to write temporary file: " + moves_path, PositionManager::LogLevel::ERROR);
+            std::cerr << "Error: Failed to write " << moves_path << std::endl;
+            remove_all();
+            std::exit(1);
+        }
+    }
+    remove_files(move_runs);
+    for (size_t discs = 1; discs < level_begin.size(); ++discs) {
+        level_begin[discs] += level_begin[discs - 1];
+    }
+
+    // 3段目: 石の数ごとに、着いたポジションをキーの順にbookの手の一覧と突き合わせて次のポジションを作る
+    search.reported.assign(search.target_keys.size(), false);
+    search.reported_count = 0;
+    const uint64_t initial_my_stones = 0x0000000810000000ULL;
+    const uint64_t initial_opponent_stones = 0x0000001008000000ULL;
+    std::pair<uint64_t, uint64_t> initial_key = normalize_key(initial_my_stones, initial_opponent_stones);
+    std::vector<StreamingFrontierEntry> next_chunk, pass_chunk;
+    StreamingFrontierEntry root{};
+    root.key_my_stones = initial_key.first;
+    root.key_opponent_stones = initial_key.second;
+    root.my_stones = initial_my_stones;
+    root.opponent_stones = initial_opponent_stones;
+    next_chunk.push_back(root);
+    write_sorted_run(next_chunk, run_prefix + "_frontier4_", frontier_runs, streaming_frontier_less, manager);
+
+    size_t expanded = 0, passes_dropped = 0;
+    bool initial_found = false;
+    int discs = 4;
+    std::string next_prefix, pass_prefix;
+
+    // bookにあるポジションに着いたら、棋譜が欲しいポジションなら出力して子ポジションを次に回す
+    auto visit = [&](const StreamingFrontierEntry& node, const StreamingMoveEntry& record, bool allow_pass) {
+        expanded++;
+        std::pair<uint64_t, uint64_t> key(node.key_my_stones, node.key_opponent_stones);
+        initial_found |= node.kifu_length == 0 && key == initial_key;
+        if (node.kifu_length > 0 || report_root) {
+            long long target_index = find_sorted_key(search.target_keys, key);
+            if (target_index >= 0 && !search.reported[target_index]) {
+                search.reported[target_index] = true;
+                search.reported_count++;
+                std::string kifu;
+                for (uint8_t i = 0; i < node.kifu_length; ++i) {
+                    kifu += move_to_str(node.kifu[i]);
+                }
+                search.report(static_cast<size_t>(target_index), node.my_stones, node.opponent_stones,
+                    std::get<1>(normalize_position(node.my_stones, node.opponent_stones, manager)), kifu);
+            }
+        }
+
+        // 手はbookの向きなので実際の盤面の向きに戻して打つ　kifu_searchと同じく対称な手は辿らない
+        int symmetry = normalize_symmetry(node.my_stones, node.opponent_stones);
+        int inverse = symmetry == 1 ? 3 : symmetry == 3 ? 1 : symmetry;
+        uint8_t moves[sizeof(record.moves)];
+        for (uint8_t i = 0; i < record.move_count; ++i) {
+            moves[i] = static_cast<uint8_t>(transform_move(record.moves[i], inverse));
+        }
+        std::sort(moves, moves + record.move_count);
+        uint8_t stabilizer = symmetry_stabilizer(node.my_stones, node.opponent_stones);
+        for (uint8_t i = 0; i < record.move_count; ++i) {
+            int move = moves[i];
+            bool pruned = false;
+            for (uint8_t j = 0; j < i && stabilizer != 0 && !pruned; ++j) {
+                pruned = symmetric_moves(moves[j], move, stabilizer);
+            }
+            if (pruned || move > 64) {
+                continue;
+            }
+            StreamingFrontierEntry child = node;
+            if (move == 64) {
+                // パスは同じ石の数なのでもう1回読むときに辿る　パスが続くことは無いので2回目のパスは捨てる
+                if (!allow_pass) {
+                    passes_dropped++;
+                    continue;
+                }
+                std::swap(child.my_stones, child.opponent_stones);
+            }
+            else {
+                uint64_t move_bit = 1ULL << (63 - move);
+                uint64_t flipped = flip_all_directions(node.my_stones, node.opponent_stones, move_bit);
+                if (flipped == 0 || ((node.my_stones | node.opponent_stones) & move_bit) || node.kifu_length >= sizeof(node.kifu)) {
+                    continue;
+                }
+                child.my_stones = node.opponent_stones ^ flipped;
+                child.opponent_stones = node.my_stones | move_bit | flipped;
+                child.kifu[child.kifu_length++] = static_cast<uint8_t>(move);
+            }
+            std::pair<uint64_t, uint64_t> child_key = normalize_key(child.my_stones, child.opponent_stones);
+            child.key_my_stones = child_key.first;
+            child.key_opponent_stones = child_key.second;
+            if (move == 64) {
+                pass_chunk.push_back(child);
+                if (pass_chunk.size() >= frontier_chunk_size) {
+                    write_sorted_run(pass_chunk, pass_prefix, pass_runs, streaming_frontier_less, manager);
+                }
+            }
+            else {
+                next_chunk.push_back(child);
+                if (next_chunk.size() >= frontier_chunk_size) {
+                    write_sorted_run(next_chunk, next_prefix, next_runs, streaming_frontier_less, manager);
+                }
+            }
+        }
+    };
+
+    for (; discs <= 64 && !frontier_runs.empty() && search.reported_count < search.target_keys.size(); ++discs) {
+        next_prefix = run_prefix + "_frontier" + std::to_string(discs + 1) + "_";
+        pass_prefix = run_prefix + "_pass" + std::to_string(discs) + "_";
+        for (int round = 0; round < 2 && !frontier_runs.empty(); ++round) {
+            {
+                std::ifstream moves_file(moves_path, std::ios::binary);
+                moves_file.seekg(static_cast<std::streamoff>(level_begin[discs] * sizeof(StreamingMoveEntry)));
+                uint64_t records_left = level_begin[discs + 1] - level_begin[discs];
+                auto next_record = [&](StreamingMoveEntry& record) {
+                    if (records_left == 0) {
+                        return false;
+                    }
+                    records_left--;
+                    return static_cast<bool>(moves_file.read(reinterpret_cast<char*>(&record), sizeof(record)));
+                };
+                StreamingMoveEntry record{};
+                bool has_record = next_record(record);
+                // 同じポジションに何通りかで着いた場合は先に作った方 (親のキーの順、手の順で最初) だけ残る
+                SortedRunStream<StreamingFrontierEntry, streaming_frontier_less> frontier(frontier_runs);
+                StreamingFrontierEntry node{};
+                while (search.reported_count < search.target_keys.size() && frontier.next(node)) {
+                    std::pair<uint64_t, uint64_t> key(node.key_my_stones, node.key_opponent_stones);
+                    while (has_record && std::make_pair(record.my_stones, record.opponent_stones) < key) {
+                        has_record = next_record(record);
+                    }
+                    if (has_record && std::make_pair(record.my_stones, record.opponent_stones) == key) {
+                        visit(node, record, round == 0);
+                    }
+                }
+            }
+            remove_files(frontier_runs);
+            if (discs == 4 && round == 0 && !initial_found) {
+                manager.debug_log("Initial position not found in book. Terminating program.", PositionManager::LogLevel::ERROR);
+                remove_all();
+                std::exit(1);
+            }
+            write_sorted_run(pass_chunk, pass_prefix, pass_runs, streaming_frontier_less, manager);
+            frontier_runs.swap(pass_runs);
+        }
+        write_sorted_run(next_chunk, next_prefix, next_runs, streaming_frontier_less, manager);
+        remove_files(frontier_runs);
+        frontier_runs.swap(next_runs);
+        std::cout << "\r" << discs << " Discs searched (" << search.reported_count << " / " << search.target_keys.size() << " kifus found)" << std::flush;
+    }
+    std::cout << std::endl;
+    remove_all();
+
+    manager.debug_log("Kifu search: " + std::to_string(expanded) + " positions expanded up to " + std::to_string(discs - 1) + " discs" +
+        (passes_dropped > 0 ? ", " + std::to_string(passes_dropped) + " consecutive passes dropped" : ""), PositionManager::LogLevel::INFO);
+    // 初期局面から辿れないポジションは通常の探索でも出力されないので数だけ残す
+    size_t unreachable = search.target_keys.size() - search.reported_count;
+    if (unreachable > 0) {
+        manager.debug_log("Kifu search: " + std::to_string(unreachable) + " positions are not reachable from the initial position", PositionManager::LogLevel::WARNING);
+    }
+    return true;
+}
+
+// 子ポジションから親ポジションと手を引く逆引きの索引　子ポジションのキーの順に並べて二分探索する
+// ポインタではなくキーで持つのでそのままファイルに保存できる
+struct ParentIndex {
+    struct Entry {
+        std::pair<uint64_t, uint64_t> child_key;
+        std::pair<uint64_t, uint64_t> parent_key;
+        uint8_t move;      // 親ポジションの手 (正規化した向き)
+        uint8_t symmetry;  // 親ポジションから手を打った盤面を子ポジションの正規化した向きにする変換 (symmetry_namesの番号)
+    };
+    std::vector<Entry> entries;
+    bool built = false;
+
+    // 子ポジションの親の範囲 [first, second)
+    std::pair<size_t, size_t> find(const std::pair<uint64_t, uint64_t>& child_key) const {
+        auto range = std::equal_range(entries.begin(), entries.end(), Entry{ child_key, {}, 0, 0 },
+            [](const Entry& lhs, const Entry& rhs) { return lhs.child_key < rhs.child_key; });
+        return { static_cast<size_t>(range.first - entries.begin()), static_cast<size_t>(range.second - entries.begin()) };
+    }
+};
+
+// parent_index= True の場合に読み込み後に作る全体の索引
+ParentIndex book_parent_index;
+
+// bookの全ポジションのリンクとリーフを並列に辿って逆引きの索引を作る
+// child_keys (ソート済み) を渡した場合はその子ポジションへの辺だけを入れる　正規化されていない向きのレコードは探索で使わないので除く
+ParentIndex build_parent_index(PositionManager& manager, unsigned threads, const std::vector<std::pair<uint64_t, uint64_t>>* child_keys) {
+    std::vector<const Position*> positions;
+    positions.reserve(book_positions.size());
+    for (const auto& pair : book_positions) {
+        positions.push_back(&pair.second);
+    }
+
+    std::vector<std::vector<ParentIndex::Entry>> worker_entries(threads);
+    parallel_for(positions.size(), threads, [&](size_t begin, size_t end, unsigned worker) {
+        std::vector<ParentIndex::Entry>& entries = worker_entries[worker];
+        for (size_t i = begin; i < end; ++i) {
+            const Position& position = *positions[i];
+            std::pair<uint64_t, uint64_t> key(position.my_stones, position.opponent_stones);
+            if (normalize_key(position.my_stones, position.opponent_stones) != key) {
+                continue;
+            }
+            auto add = [&](uint8_t move) {
+                uint64_t child_my_stones, child_opponent_stones;
+                if (!make_child_stones(position, move, child_my_stones, child_opponent_stones)) return;
+                std::pair<uint64_t, uint64_t> child_key = normalize_key(child_my_stones, child_opponent_stones);
+                if (child_keys && find_sorted_key(*child_keys, child_key) < 0) return;
+                if (!read_position(child_key.first, child_key.second)) return;
+                uint8_t symmetry = static_cast<uint8_t>(normalize_symmetry(child_my_stones, child_opponent_stones));
+                entries.push_back({ child_key, key, move, symmetry });
+            };
+            for (const auto& link : position.links) {
+                add(link.move);
+            }
+            if (is_usable_leaf(position.leaf)) {
+                add(position.leaf.move);
+            }
+        }
+    });
+
+    ParentIndex index;
+    size_t total = 0;
+    for (const auto& entries : worker_entries) {
+        total += entries.size();
+    }
+    index.entries.reserve(total);
+    for (auto& entries : worker_entries) {
+        index.entries.insert(index.entries.end(), entries.begin(), entries.end());
+        std::vector<ParentIndex::Entry>().swap(entries);
+    }
+    // スレッド数で並びが変わらないように親と手まで並べる
+    std::sort(index.entries.begin(), index.entries.end(), [](const ParentIndex::Entry& lhs, const ParentIndex::Entry& rhs) {
+        return std::tie(lhs.child_key, lhs.parent_key, lhs.move) < std::tie(rhs.child_key, rhs.parent_key, rhs.move);
+    });
+    index.built = true;
+    manager.debug_log("Parent index entries: " + std::to_string(index.entries.size()), PositionManager::LogLevel::INFO);
+    return index;
+}
+
+// 索引のファイルの先頭　bookのサイズと更新時刻とポジション数が違えば作り直す
+struct ParentIndexHeader {
+    char magic[8];
+    uint64_t book_size;
+    int64_t book_time;
+    uint64_t position_count;
+    uint64_t entry_count;
+};
+
+ParentIndexHeader make_parent_index_header(const std::string& book_path) {
+    ParentIndexHeader header{};
+    std::memcpy(header.magic, "EDXPIDX1", sizeof(header.magic));
+    std::error_code error;
+    header.book_size = static_cast<uint64_t>(std::filesystem::file_size(book_path, error));
+    header.book_time = static_cast<int64_t>(std::filesystem::last_write_time(book_path, error).time_since_epoch().count());
+    header.position_count = book_positions.size();
+    return header;
+}
+
+bool load_parent_index(const std::string& snapshot_path, const std::string& book_path, ParentIndex& index, PositionManager& manager) {
+    std::ifstream snapshot(snapshot_path, std::ios::binary);
+    if (!snapshot.is_open()) {
+        return false;
+    }
+    ParentIndexHeader expected = make_parent_index_header(book_path);
+    ParentIndexHeader header{};
+    if (!snapshot.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.book_size != expected.book_size || header.book_time != expected.book_time || header.position_count != expected.position_count) {
+        manager.debug_log("Parent index snapshot is stale, rebuilding: " + snapshot_path, PositionManager::LogLevel::WARNING);
+        return false;
+    }
+    index.entries.resize(header.entry_count);
+    if (!snapshot.read(reinterpret_cast<char*>(index.entries.data()), header.entry_count * sizeof(ParentIndex::Entry))) {
+        manager.debug_log("Parent index snapshot is truncated, rebuilding: " + snapshot_path, PositionManager::LogLevel::WARNING);
+        index.entries.clear();
+        return false;
+    }
+    index.built = true;
+    return true;
+}
+
+void save_parent_index(const std::string& snapshot_path, const std::string& book_path, const ParentIndex& index, PositionManager& manager) {
+    std::ofstream snapshot(snapshot_path, std::ios::binary | std::ios::trunc);
+    if (!snapshot.is_open()) {
+        manager.debug_log("Failed to create parent index snapshot: " + snapshot_path, PositionManager::LogLevel::ERROR);
+        return;
+    }
+    ParentIndexHeader header = make_parent_index_header(book_path);
+    header.entry_count = index.entries.size();
+    snapshot.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    snapshot.write(reinterpret_cast<const char*>(index.entries.data()), index.entries.size() * sizeof(ParentIndex::Entry));
+}
+
+// 読み込み後に全体の逆引きの索引を用意する　スナップショットがあって新しければ読むだけ
+void prepare_parent_index(const std::string& book_path, PositionManager& manager, const ToolConfig& config) {
+    auto start_time = std::chrono::steady_clock::now();
+    bool loaded = !config.parent_index_snapshot.empty() && load_parent_index(config.parent_index_snapshot, book_path, book_parent_index, manager);
+    if (!loaded) {
+        book_parent_index = build_parent_index(manager, resolve_thread_count(config.threads), nullptr);
+        if (!config.parent_index_snapshot.empty()) {
+            save_parent_index(config.parent_index_snapshot, book_path, book_parent_index, manager);
+        }
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+    std::cout << book_parent_index.entries.size() << " Parent edges " << (loaded ? "loaded" : "indexed") << " (" << duration.count() << " seconds)" << std::endl;
+    manager.debug_log("Parent index " + std::string(loaded ? "loaded" : "built") + ": " + std::to_string(book_parent_index.entries.size()) + " edges, " + std::to_string(duration.count()) + " seconds", PositionManager::LogLevel::INFO);
+}
+
+// 変わったポジションの一覧を読む　1行に1ポジション、最初の2つの0xから始まる値が盤面 (mode 11 のbook_diff.txtもそのまま読める)
+bool read_changed_positions(const std::string& path, std::vector<std::pair<uint64_t, uint64_t>>& keys, PositionManager& manager) {
+    std::ifstream input_file(path);
+    if (!input_file.is_open()) {
+        manager.debug_log("Failed to open changed positions file: " + path, PositionManager::LogLevel::ERROR);
+        return false;
+    }
+    std::string line;
+    while (std::getline(input_file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::vector<uint64_t> values;
+        size_t pos = 0;
+        while (values.size() < 2 && (pos = line.find("0x", pos)) != std::string::npos) {
+            values.push_back(std::stoull(line.substr(pos + 2, 16), nullptr, 16));
+            pos += 2;
+            while (pos < line.size() && std::isxdigit(static_cast<unsigned char>(line[pos]))) pos++;
+        }
+        if (values.size() == 2) {
+            keys.push_back(normalize_key(values[0], values[1]));
+        }
+    }
+    return true;
+}
+
+// 前のbook (diff_book) と読み込んだbookを比べて、評価値かリンクとリーフが変わったポジション、増えたポジション、消えたポジションを返す
+// mode 11と同じくどちらも要約を外部ソートしてマージするので、メモリはchunk_positions件分で済む (前のbookはメモリに読み込まない)
+bool diff_changed_positions(const std::string& old_book_path, const std::string& run_prefix, size_t chunk_positions, std::vector<std::pair<uint64_t, uint64_t>>& keys, PositionManager& manager) {
+    size_t old_positions = 0;
+    bool opened = false;
+    std::vector<std::string> old_runs = write_book_diff_runs(old_book_path, run_prefix + ".old.run", chunk_positions, manager, old_positions, opened);
+    // 読み込んだbookはmapから同じようにランに書き出す
+    std::vector<std::string> new_runs;
+    if (opened) {
+        std::vector<BookDiffEntry> chunk;
+        chunk.reserve(std::min(chunk_positions, book_positions.size()));
+        for (const auto& pair : book_positions) {
+            Position position = pair.second;
+            chunk.push_back(make_book_diff_entry(position, manager));
+            if (chunk.size() >= chunk_positions) {
+                write_sorted_run(chunk, run_prefix + ".new.run", new_runs, book_diff_key_less, manager);
+            }
+        }
+        write_sorted_run(chunk, run_prefix + ".new.run", new_runs, book_diff_key_less, manager);
+    }
+    auto remove_runs = [&]() {
+        std::error_code remove_error;
+        for (const auto& run_paths : { old_runs, new_runs }) {
+            for (const auto& run_path : run_paths) {
+                std::filesystem::remove(run_path, remove_error);
+            }
+        }
+    };
+    if (!opened) {
+        remove_runs();
+        return false;
+    }
+
+    // 前のbookは同じポジションの2件目以降を飛ばす　読み込んだbookは正規化すると同じになるレコードがあればそれぞれ比べる
+    BookDiffStream old_stream(old_runs), new_stream(new_runs, false);
+    BookDiffEntry old_entry{}, new_entry{};
+    bool has_old = old_stream.next(old_entry);
+    bool has_new = new_stream.next(new_entry);
+    bool old_found = false;
+    while (has_old || has_new) {
+        if (has_old && (!has_new || book_diff_key_less(old_entry, new_entry))) {
+            if (!old_found) {
+                keys.emplace_back(old_entry.my_stones, old_entry.opponent_stones);
+            }
+            old_found = false;
+            has_old = old_stream.next(old_entry);
+            continue;
+        }
+        if (!has_old || book_diff_key_less(new_entry, old_entry)) {
+            keys.emplace_back(new_entry.my_stones, new_entry.opponent_stones);
+        }
+        else {
+            old_found = true;
+            if (old_entry.eval_value != new_entry.eval_value || old_entry.moves_hash != new_entry.moves_hash || old_entry.link_count != new_entry.link_count) {
+                keys.emplace_back(new_entry.my_stones, new_entry.opponent_stones);
+            }
+        }
+        has_new = new_stream.next(new_entry);
+    }
+    remove_runs();
+    manager.debug_log("Diff book: " + std::to_string(old_positions) + " positions in " + old_book_path + ", " + std::to_string(keys.size()) + " changed", PositionManager::LogLevel::INFO);
+    return true;
+}
+
+// 逆引きの索引で、棋譜が欲しいポジションから親ポジションを辿って初期局面までの手順を探し、初期局面から並べ直して棋譜にする
+// bookの全ポジションの索引を作らずに、辿った親ポジションの分だけで済む　親が何個かある場合は索引の順で初期局面に着く最初の親
+// report_rootなら初期局面自身も出力の対象にする　出力の順はtarget_keysの順
+void run_parent_kifu_search(KifuSearch& search, const ParentIndex& parent_index, PositionManager& manager, bool report_root) {
+    search.reported.assign(search.target_keys.size(), false);
+    search.reported_count = 0;
+
+    const uint64_t initial_my_stones = 0x0000000810000000ULL;
+    const uint64_t initial_opponent_stones = 0x0000001008000000ULL;
+    const std::pair<uint64_t, uint64_t> initial_key = normalize_key(initial_my_stones, initial_opponent_stones);
+
+    // ポジションごとの初期局面側の親の辺 (parent_index.entriesの添え字)
+    // 手を打つと石が増え、パスが続くことも無いので親を辿ってもループしないが、念のため辿っている途中の印も付ける
+    const size_t root_edge = SIZE_MAX, no_edge = SIZE_MAX - 1, visiting = SIZE_MAX - 2;
+    std::unordered_map<std::pair<uint64_t, uint64_t>, size_t, PairHash> toward_root;
+    toward_root[initial_key] = root_edge;
+    std::function<bool(const std::pair<uint64_t, uint64_t>&)> reaches_root = [&](const std::pair<uint64_t, uint64_t>& key) {
+        auto found = toward_root.find(key);
+        if (found != toward_root.end()) {
+            return found->second != no_edge && found->second != visiting;
+        }
+        toward_root[key] = visiting;
+        auto [first, last] = parent_index.find(key);
+        for (size_t i = first; i < last; ++i) {
+            if (reaches_root(parent_index.entries[i].parent_key)) {
+                toward_root[key] = i;
+                return true;
+            }
+        }
+        toward_root[key] = no_edge;
+        return false;
+    };
+
+    std::vector<size_t> path;
+    for (size_t target = 0; target < search.target_keys.size(); ++target) {
+        const std::pair<uint64_t, uint64_t>& target_key = search.target_keys[target];
+        if ((target_key == initial_key && !report_root) || !reaches_root(target_key)) {
+            continue;
+        }
+        path.clear();
+        for (std::pair<uint64_t, uint64_t> key = target_key; key != initial_key; key = parent_index.entries[path.back()].parent_key) {
+            path.push_back(toward_root[key]);
+        }
+
+        // 初期局面から親の手を実際の盤面の向きに戻して打つ　パスは棋譜に残らない
+        uint64_t my_stones = initial_my_stones, opponent_stones = initial_opponent_stones;
+        std::string kifu;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            int symmetry = normalize_symmetry(my_stones, opponent_stones);
+            int inverse = symmetry == 1 ? 3 : symmetry == 3 ? 1 : symmetry;
+            int move = transform_move(parent_index.entries[*it].move, inverse);
+            if (move == 64) {
+                std::swap(my_stones, opponent_stones);
+                continue;
+            }
+            uint64_t move_bit = 1ULL << (63 - move);
+            uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+            uint64_t next_my_stones = opponent_stones ^ flipped;
+            opponent_stones = my_stones | move_bit | flipped;
+            my_stones = next_my_stones;
+            kifu += move_to_str(move);
+        }
+        search.reported[target] = true;
+        search.reported_count++;
+        search.report(target, my_stones, opponent_stones, std::get<1>(normalize_position(my_stones, opponent_stones, manager)), kifu);
+    }
+    manager.debug_log("Kifu search: " + std::to_string(toward_root.size()) + " positions visited through the parent index", PositionManager::LogLevel::INFO);
+
+    // 初期局面から辿れないポジションは通常の探索でも出力されないので数だけ残す
+    size_t unreachable = search.target_keys.size() - search.reported_count - (!report_root && std::binary_search(search.target_keys.begin(), search.target_keys.end(), initial_key) ? 1 : 0);
+    if (unreachable > 0) {
+        manager.debug_log("Kifu search: " + std::to_string(unreachable) + " positions are not reachable from the initial position", PositionManager::LogLevel::WARNING);
+    }
+}
+
+// 不一致の棋譜を初期局面から並べ直して、判定した辺の親ポジションと子ポジションの正規化したキーを求める
+// 棋譜の最後の手は子ポジションの手なので並べない　パスは棋譜に残らないので打てる手が無ければパスして進める
+// 返値: 棋譜が読めなかった場合はfalse
+bool replay_mismatch_kifu(const std::string& kifu, std::pair<uint64_t, uint64_t>& parent_key, std::pair<uint64_t, uint64_t>& child_key, bool& has_parent) {
+    size_t move_count = kifu.size() / 2;
+    if (kifu.size() % 2 != 0 || move_count == 0) {
+        return false;
+    }
+    uint64_t my_stones = 0x0000000810000000ULL, opponent_stones = 0x0000001008000000ULL;
+    uint64_t parent_my_stones = 0, parent_opponent_stones = 0;
+    has_parent = false;
+
+    for (size_t i = 0; i < move_count; ++i) {
+        char col = kifu[2 * i], row = kifu[2 * i + 1];
+        if (col < 'a' || col > 'h' || row < '1' || row > '9') {
+            return false;
+        }
+        int move = (row - '1') * 8 + (col - 'a');
+        bool last = i + 1 == move_count;
+        if (last && move >= 64) {
+            break;  // 子ポジションの手がパスかnone
+        }
+        if (move >= 64) {
+            return false;
+        }
+
+        // 打てる手が無ければパス　最後の手の前のパスは親ポジションからのパスの辺
+        if (get_legal_moves(my_stones, opponent_stones) == 0) {
+            parent_my_stones = my_stones;
+            parent_opponent_stones = opponent_stones;
+            has_parent = true;
+            std::swap(my_stones, opponent_stones);
+        }
+        uint64_t move_bit = 1ULL << (63 - move);
+        if (!(get_legal_moves(my_stones, opponent_stones) & move_bit)) {
+            return false;
+        }
+        if (last) {
+            break;
+        }
+        uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+        parent_my_stones = my_stones;
+        parent_opponent_stones = opponent_stones;
+        has_parent = true;
+        my_stones |= move_bit | flipped;
+        opponent_stones ^= flipped;
+        std::swap(my_stones, opponent_stones);
+    }
+    child_key = normalize_key(my_stones, opponent_stones);
+    parent_key = normalize_key(parent_my_stones, parent_opponent_stones);
+    return true;
+}
+
+// _ranked.txtの行の棋譜 (最後の列)　ヘッダーは空
+std::string kifu_of_ranked_line(const std::string& line) {
+    return line[0] == '#' ? std::string() : line.substr(line.find_last_of('\t') + 1);
+}
+
+// レポートの行の棋譜 (CSVは2列目、JSONLは"kifu")　ヘッダーは空
+std::string kifu_of_report_line(const std::string& line, ReportFormat format) {
+    if (format == ReportFormat::CSV) {
+        size_t first = line.find(',');
+        size_t second = line.find(',', first + 1);
+        std::string kifu = line.substr(first + 1, second - first - 1);
+        return kifu == "kifu" ? std::string() : kifu;
+    }
+    size_t begin = line.find("\"kifu\":\"");
+    if (begin == std::string::npos) {
+        return std::string();
+    }
+    begin += 8;
+    return line.substr(begin, line.find('"', begin) - begin);
+}
+
+// 前回の出力ファイルから、変わったポジションに関わる辺の行を取り除いて書き直す　kifu_of_lineで行から棋譜を取り出す (空ならそのまま残す)
+// match_parentがfalseなら子ポジションが変わった行だけ取り除く (親を見ないmode 1, 2)
+// 返値: 取り除いた行数
+template<class KifuOfLine>
+size_t remove_changed_mismatch_lines(const std::string& path, const std::vector<std::pair<uint64_t, uint64_t>>& changed_keys, bool match_parent, KifuOfLine&& kifu_of_line, PositionManager& manager) {
+    std::ifstream input_file(path, std::ios::binary);
+    if (!input_file.is_open()) {
+        return 0;
+    }
+    std::vector<std::string> kept_lines;
+    std::string line;
+    size_t removed = 0;
+    bool first_line = true, has_bom = false;
+    while (std::getline(input_file, line)) {
+        if (first_line && line.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            line.erase(0, 3);
+            has_bom = true;
+        }
+        first_line = false;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        std::string kifu = kifu_of_line(line);
+        std::pair<uint64_t, uint64_t> parent_key, child_key;
+        bool has_parent = false;
+        if (!kifu.empty()) {
+            if (!replay_mismatch_kifu(kifu, parent_key, child_key, has_parent)) {
+                manager.debug_log("Could not replay kifu, line kept: " + kifu, PositionManager::LogLevel::WARNING);
+            }
+            else if (find_sorted_key(changed_keys, child_key) >= 0 || (match_parent && has_parent && find_sorted_key(changed_keys, parent_key) >= 0)) {
+                removed++;
+                continue;
+            }
+        }
+        kept_lines.push_back(line);
+    }
+    input_file.close();
+
+    // 書き直す (BOMは元のファイルにあれば付ける)　新しい行はこの後MismatchOutputが追記する
+    std::ofstream output_file(path, std::ios::binary | std::ios::trunc);
+    if (has_bom) {
+        output_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
+    }
+    for (const auto& kept_line : kept_lines) {
+        output_file << kept_line << '\n';
+    }
+    return removed;
+}
+
+// mode 12: 再学習などで変わったポジションに関わる辺だけを判定し直して、前回の不一致の出力を更新する
+// 変わったポジションは changed_positions の一覧か、なければ diff_book との比較で求める　判定するmodeは multi_modes
+void incremental_check_process(const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    manager.program_start_time = std::chrono::steady_clock::now();
+    unsigned threads = resolve_thread_count(config.threads);
+
+    std::vector<std::pair<uint64_t, uint64_t>> changed_keys;
+    bool loaded = false;
+    if (!config.changed_positions.empty()) {
+        loaded = read_changed_positions(config.changed_positions, changed_keys, manager);
+    }
+    else if (!config.diff_book.empty()) {
+        loaded = diff_changed_positions(config.diff_book, output_path, std::max<size_t>(1, config.diff_chunk_positions), changed_keys, manager);
+    }
+    else {
+        std::cerr << "Error: Set changed_positions or diff_book in config.ini." << std::endl;
+        manager.debug_log("Neither changed_positions nor diff_book is set", PositionManager::LogLevel::ERROR);
+        return;
+    }
+    if (!loaded) {
+        std::cerr << "Error: Failed to read the changed positions." << std::endl;
+        return;
+    }
+    std::sort(changed_keys.begin(), changed_keys.end());
+    changed_keys.erase(std::unique(changed_keys.begin(), changed_keys.end()), changed_keys.end());
+
+    // mode 1, 2 は子ポジションだけで判定するので、変わったポジションを1回ずつ判定し直す
+    // mode 3, 4 は親の手も見るので辺ごとに判定し直す
+    bool position_modes = false, edge_modes = false;
+    for (int mode : config.multi_modes) {
+        (mode <= 2 ? position_modes : edge_modes) = true;
+    }
+
+    // 判定し直す辺: 変わったポジションから出る辺と、変わったポジションに入る辺 (逆引きの索引で探す)　mode 3, 4 が無ければ作らない
+    const std::vector<std::pair<uint64_t, uint64_t>> no_keys;
+    const std::vector<std::pair<uint64_t, uint64_t>>& edge_keys = edge_modes ? changed_keys : no_keys;
+    std::vector<std::pair<const Position*, uint8_t>> edges;
+    for (const auto& key : edge_keys) {
+        const Position* position = read_position(key.first, key.second);
+        if (!position) {
+            continue;
+        }
+        for (const auto& link : position->links) {
+            edges.emplace_back(position, link.move);
+        }
+        if (is_usable_leaf(position->leaf)) {
+            edges.emplace_back(position, position->leaf.move);
+        }
+    }
+    // 全体の索引があればそれを引く　なければ変わったポジションへの辺だけの索引を作る
+    ParentIndex changed_parent_index;
+    if (edge_modes && !book_parent_index.built) {
+        changed_parent_index = build_parent_index(manager, threads, &edge_keys);
+    }
+    const ParentIndex& parent_index = book_parent_index.built ? book_parent_index : changed_parent_index;
+    size_t parent_edges = 0;
+    for (const auto& key : edge_keys) {
+        auto [first, last] = parent_index.find(key);
+        for (size_t i = first; i < last; ++i) {
+            const ParentIndex::Entry& entry = parent_index.entries[i];
+            edges.emplace_back(read_position(entry.parent_key.first, entry.parent_key.second), entry.move);
+            parent_edges++;
+        }
+    }
+    std::sort(edges.begin(), edges.end(), [](const std::pair<const Position*, uint8_t>& lhs, const std::pair<const Position*, uint8_t>& rhs) {
+        return std::make_tuple(lhs.first->my_stones, lhs.first->opponent_stones, lhs.second) <
+            std::make_tuple(rhs.first->my_stones, rhs.first->opponent_stones, rhs.second);
+    });
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    // 出力先はmode 6と同じ　modeが1つならmismatched_positions.txtそのもの
+    std::vector<ModeTarget> targets;
+    size_t lines_removed = 0;
+    for (int mode : config.multi_modes) {
+        std::string mode_output_path = config.multi_modes.size() == 1 ? output_path : add_path_suffix(output_path, "_mode" + std::to_string(mode));
+        if (!std::filesystem::exists(mode_output_path)) {
+            manager.debug_log("Previous output not found, only re-checked mismatches are written: " + mode_output_path, PositionManager::LogLevel::WARNING);
+        }
+        bool match_parent = mode >= 3;
+        lines_removed += remove_changed_mismatch_lines(mode_output_path, changed_keys, match_parent, [](const std::string& line) {
+            return line;
+        }, manager);
+        remove_changed_mismatch_lines(add_path_suffix(mode_output_path, "_ranked"), changed_keys, match_parent, kifu_of_ranked_line, manager);
+        if (config.report_format != ReportFormat::NONE) {
+            remove_changed_mismatch_lines(MismatchOutput::report_path_for(mode_output_path, config.report_format), changed_keys, match_parent, [&](const std::string& line) {
+                return kifu_of_report_line(line, config.report_format);
+            }, manager);
+        }
+        targets.push_back({ mode, std::make_unique<MismatchOutput>(mode_output_path, manager, config.ranked_output, config.ranked_top_k, config.ranked_weight_by_games, config.report_format) });
+    }
+
+    // 辺の親ポジションまでの棋譜を探して判定する
+    // 全体の逆引きの索引があれば親を辿って探す　なければbookの全ポジションの索引を作って初期局面から探す
+    KifuSearch search;
+    if (!book_parent_index.built) {
+        search.nodes.reserve(book_positions.size());
+        for (const auto& pair : book_positions) {
+            search.add(pair.first, pair.second);
+        }
+    }
+    // 探すポジションは辺の親ポジションと (mode 1, 2 があれば) 変わったポジション自身　どちらもキーの順なのでマージする
+    std::vector<size_t> first_edge;
+    std::vector<const Position*> changed_records;
+    size_t edge_cursor = 0, changed_cursor = 0;
+    while (edge_cursor < edges.size() || (position_modes && changed_cursor < changed_keys.size())) {
+        std::pair<uint64_t, uint64_t> key;
+        if (edge_cursor < edges.size()) {
+            key = std::make_pair(edges[edge_cursor].first->my_stones, edges[edge_cursor].first->opponent_stones);
+        }
+        if (position_modes && changed_cursor < changed_keys.size() && (edge_cursor == edges.size() || changed_keys[changed_cursor] < key)) {
+            key = changed_keys[changed_cursor];
+        }
+        search.target_keys.push_back(key);
+        first_edge.push_back(edge_cursor);
+        while (edge_cursor < edges.size() && std::make_pair(edges[edge_cursor].first->my_stones, edges[edge_cursor].first->opponent_stones) == key) {
+            edge_cursor++;
+        }
+        const Position* changed_record = nullptr;
+        if (position_modes && changed_cursor < changed_keys.size() && changed_keys[changed_cursor] == key) {
+            changed_record = read_position(key.first, key.second);
+            changed_cursor++;
+        }
+        changed_records.push_back(changed_record);
+    }
+    first_edge.push_back(edges.size());
+
+    size_t positions_checked = 0, edges_checked = 0;
+    search.report = [&](size_t index, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, const std::string& kifu) {
+        // 変わったポジション自身をmode 1, 2で判定する　通常の探索と同じく初期局面は子ポジションにならないので判定しない
+        if (changed_records[index] && !kifu.empty()) {
+            positions_checked++;
+            Position position = denormalize_book_position(*changed_records[index], my_stones, opponent_stones, transformation, manager);
+            for (ModeTarget& target : targets) {
+                MismatchDetail detail;
+                if (target.mode == 1 && judge_mismatch<1>(position, position, 0, manager, detail)) {
+                    mismatch_process<1>(position, kifu, transformation, *target.output, manager, position.eval_value, position.eval_value, detail);
+                }
+                else if (target.mode == 2 && judge_mismatch<2>(position, position, 0, manager, detail)) {
+                    mismatch_process<2>(position, kifu, transformation, *target.output, manager, position.eval_value, position.eval_value, detail);
+                }
+            }
+        }
+        if (first_edge[index] == first_edge[index + 1]) {
+            return;
+        }
+
+        const Position& book_parent = *edges[first_edge[index]].first;
+        Position parent_position = denormalize_book_position(book_parent, my_stones, opponent_stones, transformation, manager);
+        for (size_t i = first_edge[index]; i < first_edge[index + 1]; ++i) {
+            const Position* book_child = find_child_record(book_parent, edges[i].second);
+            if (!book_child) {
+                continue;
+            }
+            edges_checked++;
+
+            // 実際の盤面の向きで子ポジションを作る　パスは棋譜に残らない
+            uint8_t move = static_cast<uint8_t>(denormalize_move(edges[i].second, transformation, manager));
+            uint64_t child_my_stones = opponent_stones, child_opponent_stones = my_stones;
+            std::string new_kifu = kifu;
+            if (move < 64) {
+                uint64_t move_bit = 1ULL << (63 - move);
+                uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+                child_my_stones = opponent_stones ^ flipped;
+                child_opponent_stones = my_stones | move_bit | flipped;
+                new_kifu += move_to_str(move);
+            }
+            auto [normalized_child, child_transformation] = normalize_position(child_my_stones, child_opponent_stones, manager);
+            Position child_position = denormalize_book_position(*book_child, child_my_stones, child_opponent_stones, child_transformation, manager);
+
+            for (ModeTarget& target : targets) {
+                MismatchDetail detail;
+                switch (target.mode) {
+                case 1:
+                case 2:
+                    break;
+                case 3:
+                    if (judge_mismatch<3>(child_position, parent_position, move, manager, detail))
+                        mismatch_process<3>(child_position, new_kifu, child_transformation, *target.output, manager, child_position.eval_value, parent_position.eval_value, detail);
+                    break;
+                default:
+                    if (judge_mismatch<4>(child_position, parent_position, move, manager, detail))
+                        mismatch_process<4>(child_position, new_kifu, child_transformation, *target.output, manager, child_position.eval_value, parent_position.eval_value, detail);
+                    break;
+                }
+            }
+        }
+    };
+    if (!search.target_keys.empty()) {
+        if (book_parent_index.built) {
+            run_parent_kifu_search(search, book_parent_index, manager, true);
+        }
+        else {
+            run_kifu_search(search, manager, true);
+        }
+    }
+
+    size_t lines_written = 0;
+    for (ModeTarget& target : targets) {
+        target.output->finish();
+        lines_written += target.output->line_count();
+        manager.debug_log("Mode " + std::to_string(target.mode) + " mismatches re-checked: " + std::to_string(target.output->line_count()), PositionManager::LogLevel::INFO);
+    }
+
+    std::stringstream ss;
+    ss << "Changed positions: " << changed_keys.size() << " (" << positions_checked << " re-checked for mode 1, 2)\n"
+        << "Edges re-checked: " << edges_checked << " (" << edges.size() << " edges, " << parent_edges << " from the parent index)\n"
+        << "Mismatch lines removed: " << lines_removed << ", written: " << lines_written;
+    std::cout << ss.str() << std::endl;
+    manager.debug_log("Incremental check:\n" + ss.str(), PositionManager::LogLevel::WARNING);
+
+    report_total_time(manager);
+}
+
+// シャードの計画で使う、bookのポジションの子ポジションのレコードの一覧 (リンクとリーフ、bookにある子ポジションだけ)
+// ログを出さないのでスレッドから呼んでも大丈夫
+void collect_child_records(const Position& record, std::vector<const Position*>& children) {
+    children.clear();
+    for (const auto& link : record.links) {
+        if (const Position* child = find_child_record(record, link.move)) {
+            children.push_back(child);
+        }
+    }
+    if (is_usable_leaf(record.leaf)) {
+        if (const Position* child = find_child_record(record, record.leaf.move)) {
+            children.push_back(child);
+        }
+    }
+}
+
+// ポジションから先の大きさをランダムな道筋で見積もる (Knuthの方法: 1 + c1 + c1*c2 + ... の平均)
+// 転置で同じポジションを何回も数えるので実際より大きくなるが、シャードの大きさを揃えるための比べる値としては十分
+double estimate_subtree_size(const Position& root, size_t samples, std::mt19937_64& random) {
+    std::vector<const Position*> children;
+    double total = 0.0;
+    for (size_t sample = 0; sample < samples; ++sample) {
+        const Position* position = &root;
+        double estimate = 1.0, width = 1.0;
+        for (int ply = 0; ply < 64; ++ply) {
+            collect_child_records(*position, children);
+            if (children.empty()) {
+                break;
+            }
+            width *= static_cast<double>(children.size());
+            estimate += width;
+            position = children[random() % children.size()];
+        }
+        total += estimate;
+    }
+    return samples > 0 ? total / static_cast<double>(samples) : 1.0;
+}
+
+// シャードの根になるポジション
+struct ShardRoot {
+    std::pair<uint64_t, uint64_t> key;
+    std::string kifu;
+    double estimate = 0.0;
+};
+
+// 初期局面からリンクとリーフでshard_plyの手数まで辿り、その手数のポジションを最初に着いた棋譜で集める
+// 手数 (パスを除く) は石の数で決まるので、どの手順で来ても同じポジションは同じ手数になる
+std::vector<ShardRoot> collect_shard_roots(int shard_ply) {
+    std::vector<ShardRoot> roots;
+    std::unordered_set<std::pair<uint64_t, uint64_t>, PairHash, PairEqual> seen;
+    struct Node {
+        uint64_t my_stones;
+        uint64_t opponent_stones;
+        std::string kifu;
+    };
+    std::vector<Node> stack = { { 0x0000000810000000ULL, 0x0000001008000000ULL, "" } };
+    while (!stack.empty()) {
+        Node node = std::move(stack.back());
+        stack.pop_back();
+        std::pair<uint64_t, uint64_t> key = normalize_key(node.my_stones, node.opponent_stones);
+        const Position* record = read_position(key.first, key.second);
+        if (!record || !seen.insert(key).second) {
+            continue;
+        }
+        if (static_cast<int>(node.kifu.size() / 2) >= shard_ply) {
+            roots.push_back({ key, node.kifu, 0.0 });
+            continue;
+        }
+
+        // 実際の向きの手を正規化した向きに直して、レコードにリンクかリーフがある手だけ辿る
+        int symmetry = normalize_symmetry(node.my_stones, node.opponent_stones);
+        auto has_edge = [&](int move) {
+            int normalized_move = transform_move(move, symmetry);
+            return find_link_slot(*record, static_cast<uint8_t>(normalized_move)) >= 0 ||
+                (is_usable_leaf(record->leaf) && record->leaf.move == normalized_move);
+        };
+        uint64_t legal_moves = get_legal_moves(node.my_stones, node.opponent_stones);
+        if (legal_moves == 0) {
+            if (has_edge(64)) {
+                stack.push_back({ node.opponent_stones, node.my_stones, node.kifu });
+            }
+            continue;
+        }
+        // 棋譜の小さい手から辿るように逆順に積む
+        for (int move = 63; move >= 0; --move) {
+            uint64_t move_bit = 1ULL << (63 - move);
+            if (!(legal_moves & move_bit) || !has_edge(move)) {
+                continue;
+            }
+            uint64_t flipped = flip_all_directions(node.my_stones, node.opponent_stones, move_bit);
+            stack.push_back({ node.opponent_stones ^ flipped, node.my_stones | move_bit | flipped, node.kifu + move_to_str(move) });
+        }
+    }
+    return roots;
+}
+
+// --plan-shards: 1つのbookの判定を複数のプロセスに分ける計画を作る
+// shard_plyの手数のポジションを見積もった大きさで大きい順にshard_count個のシャードへ割り振り (一番軽いシャードへ)、
+// shard_dirにシャードごとの棋譜の一覧 shard_000.txt ... と、shard_plyまでを判定する shard_top.txt を書く
+void plan_shards(PositionManager& manager, const ToolConfig& config) {
+    auto start_time = std::chrono::steady_clock::now();
+    if (config.shard_count == 0 || config.shard_ply < 1) {
+        std::cerr << "Error: shard_count and shard_ply must be 1 or more." << std::endl;
+        manager.debug_log("Invalid shard_count or shard_ply", PositionManager::LogLevel::ERROR);
+        std::exit(1);
+    }
+
+    std::vector<ShardRoot> roots = collect_shard_roots(config.shard_ply);
+    std::cout << roots.size() << " Positions at ply " << config.shard_ply << std::endl;
+
+    // 見積もりはポジションごとに別の乱数で並列に行う　キーから種を作るので何回やっても同じ計画になる
+    parallel_for(roots.size(), resolve_thread_count(config.threads), [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            std::mt19937_64 random(roots[i].key.first ^ (roots[i].key.second * 0x9E3779B97F4A7C15ULL));
+            roots[i].estimate = estimate_subtree_size(*read_position(roots[i].key.first, roots[i].key.second), config.shard_samples, random);
+        }
+    });
+    std::sort(roots.begin(), roots.end(), [](const ShardRoot& lhs, const ShardRoot& rhs) {
+        return lhs.estimate != rhs.estimate ? lhs.estimate > rhs.estimate : lhs.kifu < rhs.kifu;
+    });
+
+    std::vector<std::vector<const ShardRoot*>> shards(config.shard_count);
+    std::vector<double> loads(config.shard_count, 0.0);
+    using Load = std::pair<double, size_t>;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> lightest;
+    for (size_t shard = 0; shard < config.shard_count; ++shard) {
+        lightest.push({ 0.0, shard });
+    }
+    for (const ShardRoot& root : roots) {
+        auto [load, shard] = lightest.top();
+        lightest.pop();
+        shards[shard].push_back(&root);
+        loads[shard] = load + root.estimate;
+        lightest.push({ loads[shard], shard });
+    }
+
+    // 前の計画のシャードが残っているとまとめる時に混ざるので消してから書く
+    std::error_code error;
+    std::filesystem::create_directories(config.shard_dir, error);
+    for (const auto& entry : std::filesystem::directory_iterator(config.shard_dir, error)) {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 6, "shard_") == 0 && entry.path().extension() == ".txt") {
+            std::filesystem::remove(entry.path(), error);
+        }
+    }
+    std::ofstream top_file(std::filesystem::path(config.shard_dir) / "shard_top.txt", std::ios::binary);
+    top_file << "# positions up to ply " << config.shard_ply << " from the initial position\n"
+        << "max_ply= " << config.shard_ply << "\n";
+    if (!top_file) {
+        manager.debug_log("Failed to write shard files in " + config.shard_dir, PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: Failed to write shard files in " << config.shard_dir << std::endl;
+        std::exit(1);
+    }
+
+    std::stringstream ss;
+    ss << "Shard plan: " << roots.size() << " positions at ply " << config.shard_ply << " in " << config.shard_count << " shards\n";
+    for (size_t shard = 0; shard < config.shard_count; ++shard) {
+        std::stringstream name;
+        name << "shard_" << std::setw(3) << std::setfill('0') << shard << ".txt";
+        std::ofstream shard_file(std::filesystem::path(config.shard_dir) / name.str(), std::ios::binary);
+        shard_file << "# shard " << shard << " / " << config.shard_count << ": " << shards[shard].size()
+            << " positions, estimated " << static_cast<long long>(loads[shard]) << " positions below\n";
+        for (const ShardRoot* root : shards[shard]) {
+            shard_file << root->kifu << '\n';
+        }
+        ss << name.str() << ": " << shards[shard].size() << " positions, estimated " << static_cast<long long>(loads[shard]) << "\n";
+    }
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start_time;
+    ss << "Planning time: " << duration.count() << " seconds";
+    std::cout << ss.str() << std::endl;
+    manager.debug_log(ss.str(), PositionManager::LogLevel::WARNING);
+}
+
+// --shard <ファイル>: シャードのファイルを読んで探索を始める棋譜と手数の上限を設定する　# の行は読まない
+// 棋譜が無ければ初期局面から (shard_top.txt)
+bool read_shard_file(const std::string& shard_path, ToolConfig& config) {
+    std::ifstream shard_file(shard_path);
+    if (!shard_file.is_open()) {
+        return false;
+    }
+    config.start_kifu.clear();
+    std::string line, setting;
+    while (std::getline(shard_file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (read_config_value(line, "max_ply", setting)) {
+            config.max_ply = std::stoi(setting);
+            continue;
+        }
+        std::transform(line.begin(), line.end(), line.begin(),
+            [](unsigned char c) { return std::tolower(c); });
+        config.start_kifu.push_back(line);
+    }
+    return true;
+}
+
+// 不一致の行の重複を見分けるキー　判定した辺の親ポジションと子ポジションの正規化したキーに、最後の手を打った後のポジションの正規化したキーを足す
+// (1つの辺から子ポジションの手ごとに何行も出るため)　最後の手がパスかnoneの場合は手の値をそのまま使う
+bool mismatch_line_key(const std::string& kifu, std::string& key) {
+    std::pair<uint64_t, uint64_t> parent_key, child_key, after_key, unused_key;
+    bool has_parent = false, unused = false;
+    if (!replay_mismatch_kifu(kifu, parent_key, child_key, has_parent)) {
+        return false;
+    }
+    int last_move = (kifu[kifu.size() - 1] - '1') * 8 + (kifu[kifu.size() - 2] - 'a');
+    if (last_move >= 64) {
+        after_key = { static_cast<uint64_t>(last_move), 0 };
+    }
+    // 後ろにパス (a9) を付けると最後の手まで並べたポジションが子ポジションとして返る
+    else if (!replay_mismatch_kifu(kifu + "a9", unused_key, after_key, unused)) {
+        return false;
+    }
+    uint64_t values[6] = { has_parent ? parent_key.first : 0, has_parent ? parent_key.second : 0, child_key.first, child_key.second, after_key.first, after_key.second };
+    key.assign(reinterpret_cast<const char*>(values), sizeof(values));
+    return true;
+}
+
+// シャードの出力を1つのファイルにまとめる　同じ辺から出た同じ手の行 (mismatch_line_keyが同じ行) は最初の1行だけ残す
+// 棋譜の無いヘッダーの行は同じものを1回だけ　rankedはスコアの大きい順に並べ直す
+// 返値: 書いた行数と除いた重複の行数
+template<class KifuOfLine>
+std::pair<size_t, size_t> merge_shard_lines(const std::vector<std::string>& input_paths, const std::string& merged_path, KifuOfLine&& kifu_of_line, bool sort_by_score, PositionManager& manager) {
+    std::vector<std::string> merged_lines;
+    std::unordered_set<std::string> seen;
+    size_t duplicates = 0;
+    bool has_bom = false, found = false;
+    for (const std::string& path : input_paths) {
+        std::ifstream input_file(path, std::ios::binary);
+        if (!input_file.is_open()) {
+            continue;
+        }
+        std::string line;
+        bool first_line = true;
+        while (std::getline(input_file, line)) {
+            if (first_line && line.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+                line.erase(0, 3);
+                has_bom |= !found;
+            }
+            first_line = false;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                continue;
+            }
+            std::string kifu = kifu_of_line(line);
+            std::string key;
+            if (kifu.empty() || !mismatch_line_key(kifu, key)) {
+                key = "L" + line;
+            }
+            if (!seen.insert(key).second) {
+                duplicates += kifu.empty() ? 0 : 1;
+                continue;
+            }
+            merged_lines.push_back(line);
+        }
+        found = true;
+    }
+    if (!found) {
+        return { 0, 0 };
+    }
+    if (sort_by_score) {
+        std::stable_sort(merged_lines.begin(), merged_lines.end(), [](const std::string& lhs, const std::string& rhs) {
+            bool lhs_header = lhs[0] == '#', rhs_header = rhs[0] == '#';
+            if (lhs_header || rhs_header) {
+                return lhs_header && !rhs_header;
+            }
+            return std::stod(lhs.substr(0, lhs.find('\t'))) > std::stod(rhs.substr(0, rhs.find('\t')));
+        });
+    }
+
+    std::ofstream output_file(merged_path, std::ios::binary | std::ios::trunc);
+    if (!output_file.is_open()) {
+        manager.debug_log("Failed to create merged file: " + merged_path, PositionManager::LogLevel::ERROR);
+        return { 0, duplicates };
+    }
+    if (has_bom) {
+        output_file << static_cast<char>(0xEF) << static_cast<char>(0xBB) << static_cast<char>(0xBF);
+    }
+    for (const auto& merged_line : merged_lines) {
+        output_file << merged_line << '\n';
+    }
+    return { merged_lines.size(), duplicates };
+}
+
+// --merge-shards: shard_dirのシャードごとの出力 (mismatched_positions_shard_000.txt など) を通常の出力のファイルにまとめる
+// 判定したmodeの出力ごとに、レポートとrankedも同じようにまとめる　まとめた先のファイルは上書きする
+void merge_shard_outputs(const std::string& output_path, PositionManager& manager, const ToolConfig& config) {
+    std::vector<std::string> shard_names;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(config.shard_dir, error)) {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 6, "shard_") == 0 && entry.path().extension() == ".txt") {
+            shard_names.push_back(entry.path().stem().string());
+        }
+    }
+    if (shard_names.empty()) {
+        std::cerr << "Error: No shard files found in " << config.shard_dir << std::endl;
+        manager.debug_log("No shard files found in " + config.shard_dir, PositionManager::LogLevel::ERROR);
+        std::exit(1);
+    }
+    std::sort(shard_names.begin(), shard_names.end());
+
+    // modeごとの出力のパス (make_mode_targetsと同じ名前)　シャードの出力はシャードの名前を付けたパスから同じように作る
+    auto mode_output_paths = [&](const std::string& base_path) {
+        std::vector<std::string> paths;
+        if (config.mode == 6) {
+            for (int mode : config.multi_modes) {
+                paths.push_back(add_path_suffix(base_path, "_mode" + std::to_string(mode)));
+            }
+        }
+        else {
+            paths.push_back(base_path);
+        }
+        return paths;
+    };
+    std::vector<std::string> merged_paths = mode_output_paths(output_path);
+
+    std::stringstream ss;
+    ss << "Merged " << shard_names.size() << " shards";
+    for (size_t i = 0; i < merged_paths.size(); ++i) {
+        const std::string& mode_output_path = merged_paths[i];
+        auto shard_paths = [&](auto&& path_of) {
+            std::vector<std::string> paths;
+            for (const std::string& name : shard_names) {
+                paths.push_back(path_of(mode_output_paths(add_path_suffix(output_path, "_" + name))[i]));
+            }
+            return paths;
+        };
+        auto same_path = [](const std::string& path) { return path; };
+        auto [lines, duplicates] = merge_shard_lines(shard_paths(same_path), mode_output_path, same_path, false, manager);
+        ss << "\n" << mode_output_path << ": " << lines << " lines (" << duplicates << " duplicates removed)";
+        if (config.ranked_output) {
+            auto ranked_path = [](const std::string& path) { return add_path_suffix(path, "_ranked"); };
+            merge_shard_lines(shard_paths(ranked_path), ranked_path(mode_output_path), kifu_of_ranked_line, true, manager);
+        }
+        if (config.report_format != ReportFormat::NONE) {
+            auto report_path = [&](const std::string& path) { return MismatchOutput::report_path_for(path, config.report_format); };
+            merge_shard_lines(shard_paths(report_path), report_path(mode_output_path), [&](const std::string& line) {
+                return kifu_of_report_line(line, config.report_format);
+            }, false, manager);
+        }
+    }
+    std::cout << ss.str() << std::endl;
+    manager.debug_log(ss.str(), PositionManager::LogLevel::WARNING);
+}
+
+std::tuple<Position, std::string, std::string, uint8_t, const Position*> get_children(PositionManager& manager, Position& position) {
+    try {
+
+        // リンクの処理
+        for (auto& link : position.links) {
+            if (!link.visited) {
+                link.visited = true;  // リンクを訪問済みにマーク
+                manager.debug_log("Unvisited link found: Move=" + std::to_string(link.move) + ", Eval=" + std::to_string(link.eval_link) + ", Visited: False", PositionManager::LogLevel::DEBUG);
+                auto [child_position, new_kifu, transformation, child_record] = process_position(position, manager.current_kifu, link.move, manager);
+                if (transformation != "child_not_found") {
+                    // 返値: 子ポジション、新しい棋譜、変換名、リンクの手の値、子ポジションのレコードのタプル
+                    return std::make_tuple(child_position, new_kifu, transformation, link.move, child_record);
+                }
+            }
+        }
+
+        // リーフの処理
+        if (!(position.leaf.move == 0 && position.leaf.eval == 0 && !position.leaf.visited) && position.leaf.move != 65) {
+            if (!position.leaf.visited) {
+                position.leaf.visited = true;  // リーフを訪問済みにマーク
+                manager.debug_log("Unvisited leaf found: Move=" + std::to_string(position.leaf.move) + ", Eval=" + std::to_string(position.leaf.eval) + ", Visited: False", PositionManager::LogLevel::DEBUG);
+                auto [child_position, new_kifu, transformation, child_record] = process_position(position, manager.current_kifu, position.leaf.move, manager);
+                if (transformation != "child_not_found") {
+                    // 返値: 子ポジション、新しい棋譜、変換名、リーフの手の値、子ポジションのレコードのタプル
+                    return std::make_tuple(child_position, new_kifu, transformation, position.leaf.move, child_record);
+                }
+            }
+        }
+        // move値が65 noneの場合は処理をスキップしてデバッグ出力のみ
+        else if (position.leaf.move == 65) {
+            manager.debug_log("Leaf with move value 65 encountered. Skipping processing.", PositionManager::LogLevel::DEBUG);
+        }
+        // 返値: 空のポジション、現在の棋譜、"child_not_found"文字列、0のタプル（探索終了を指示）
+        return std::make_tuple(Position(), manager.current_kifu, "child_not_found", static_cast<uint8_t>(0), static_cast<const Position*>(nullptr));
+    }
+    catch (const std::exception& e) {
+        manager.debug_log("Critical error in get_children: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
+        std::cerr << "Critical error: " << e.what() << std::endl;
+        std::exit(1);  // プログラムを終了
+    }
+}
+
+std::tuple<Position, std::string, std::string, const Position*> process_position(Position& position, const std::string& kifu, uint8_t move, PositionManager& manager) {
+
+    // 子ポジションを生成し、一時変数に保存する
+    Position original_child_position;
+    std::string new_kifu;
+    std::tie(original_child_position, new_kifu) = create_position_data(manager, move);
+    manager.debug_log("Generated original child position: " + format_position(original_child_position), PositionManager::LogLevel::DEBUG);
+    manager.debug_log("New kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
+
+    // 親ポジションの正規化とフラグ更新を行う
+    auto [normalized_parent, parent_transformation] = normalize_position(position.my_stones, position.opponent_stones, manager);
+    auto normalized_parent_key = std::make_pair(std::get<0>(normalized_parent), std::get<1>(normalized_parent));
+
+    // 正規化された親ポジションをread_positionを使用して取得
+    const Position* normalized_parent_position = read_position(std::get<0>(normalized_parent), std::get<1>(normalized_parent));
+    //　万一見つからなかった場合のエラー処理
+    if (!normalized_parent_position) {
+        manager.debug_log("Critical error: Parent position not found in book", PositionManager::LogLevel::ERROR);
+        std::cerr << "Critical error: Parent position not found in book. Terminating program." << std::endl;
+        std::exit(1);  // プログラムを終了
+    }
+    manager.debug_log("Book position retrieved: " + format_position(*normalized_parent_position), PositionManager::LogLevel::DEBUG);
+
+    // 正規化された親ポジションの該当する手のVisitedフラグを直接更新 直接更新したいのでconstが付いているread_position関数は使えない
+    uint8_t normalized_move = normalize_move(move, parent_transformation, manager);
+    auto it = book_positions.find(normalized_parent_key);
+    if (it != book_positions.end()) {
+        Position& book_position = it->second;
+        bool updated = false;
+        int slot = find_link_slot(book_position, normalized_move);
+        if (slot >= 0) {
+            book_position.links[slot].visited = true;
+            manager.debug_log("Parent link visited flag updated: move=" + std::to_string(normalized_move) + ", visited=True", PositionManager::LogLevel::DEBUG);
+            updated = true;
+        }
+        // リーフも同様に処理
+        if (!updated && book_position.leaf.move == normalized_move) {
+            book_position.leaf.visited = true;
+            manager.debug_log("Parent leaf visited flag updated: move=" + std::to_string(normalized_move) + ", visited=True", PositionManager::LogLevel::DEBUG);
+            updated = true;
+        }
+            // 更新された正規化親ポジションをbook_positionに直接保存
+        if (updated) {
+            manager.debug_log("Updated parent book position: " + format_position(book_position), PositionManager::LogLevel::DEBUG);
+        }
+    }
+
+    // 子ポジションを正規化し、bookと照合する
+    std::tuple<uint64_t, uint64_t> normalized_child_position;
+    std::string transformation;
+    std::tie(normalized_child_position, transformation) = normalize_position(original_child_position.my_stones, original_child_position.opponent_stones, manager);
+
+    uint64_t normalized_child_my_stones = std::get<0>(normalized_child_position);
+    uint64_t normalized_child_opponent_stones = std::get<1>(normalized_child_position);
+
+    // book_indexの場合、辿り終わった子ポジションはレコードを作らずにマップしたレコードのビュー (child_view) で返ってくる
+    BookRecordView child_view{ nullptr };
+    const Position* book_child_position = book_index ? book_index->read_view(std::make_pair(normalized_child_my_stones, normalized_child_opponent_stones), child_view)
+        : read_position(normalized_child_my_stones, normalized_child_opponent_stones);
+
+    if (book_child_position || child_view.data) {
+        // bookから得られた情報を使って、正規化前の子ポジションを更新する　move値も正規化前の状態に戻す
+        if (book_child_position) {
+            manager.debug_log("Child position found in book: " + format_position(*book_child_position), PositionManager::LogLevel::DEBUG);
+            original_child_position = denormalize_book_position(*book_child_position, original_child_position.my_stones, original_child_position.opponent_stones, transformation, manager);
+        }
+        // 辿り終わった子ポジションはビューから直接作る　この子ポジションには入らないのでレコードは要らない (nullptrのまま返す)
+        else {
+            original_child_position = denormalize_book_position(child_view, original_child_position.my_stones, original_child_position.opponent_stones, transformation, manager);
+            original_child_position.subtree_completed = true;
+            manager.debug_log("Child position found in book (subtree completed): " + format_position(original_child_position), PositionManager::LogLevel::DEBUG);
+        }
+
+        manager.debug_log("Final denormalized child position: " + format_position(original_child_position), PositionManager::LogLevel::DEBUG);
+
+        // 返値: 正規化前の子ポジション、新しい棋譜、変換名、正規化した子ポジションのレコードのタプル
+        return std::make_tuple(original_child_position, new_kifu, transformation, book_child_position);
+    }
+    else {
+        std::stringstream ss2;
+        ss2 << "Child position not found in book: (my_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << normalized_child_my_stones
+            << ", opponent_stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << normalized_child_opponent_stones << ")";
+        manager.debug_log(ss2.str(), PositionManager::LogLevel::DEBUG);
+
+        // 返値: 空のポジション、新しい棋譜、"child_not_found"文字列のタプル（子ポジションがbookに見つからなかったことを示す）
+        return std::make_tuple(Position(), new_kifu, "child_not_found", static_cast<const Position*>(nullptr));
+    }
+}
+// bookの正規化済みポジションを実際の盤面の向きに戻したコピーを作る
+Position denormalize_book_position(const Position& book_position, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, PositionManager& manager) {
+    Position position = book_position;
+    position.my_stones = my_stones;
+    position.opponent_stones = opponent_stones;
+    for (auto& link : position.links) {
+        link.move = denormalize_move(link.move, transformation, manager);
+    }
+    position.leaf.move = denormalize_move(position.leaf.move, transformation, manager);
+    position.best_move = denormalize_move(book_position.best_move, transformation, manager);
+    return position;
+}
+
+// マップしたレコードのビューから直接作る　レコードのPositionを作ってからコピーしない
+Position denormalize_book_position(const BookRecordView& record, uint64_t my_stones, uint64_t opponent_stones, const std::string& transformation, PositionManager& manager) {
+    Position position = record.decode(manager);
+    position.my_stones = my_stones;
+    position.opponent_stones = opponent_stones;
+    for (auto& link : position.links) {
+        link.move = denormalize_move(link.move, transformation, manager);
+    }
+    position.leaf.move = denormalize_move(position.leaf.move, transformation, manager);
+    position.best_move = denormalize_move(position.best_move, transformation, manager);
+    return position;
+}
+
+// bookのポジションを正規化した向きに直す (石とリンク、リーフのmove値)　返値: 向きを直した場合はtrue
+bool normalize_book_position(Position& position, PositionManager& manager) {
+    if (normalize_key(position.my_stones, position.opponent_stones) == std::make_pair(position.my_stones, position.opponent_stones)) {
+        return false;
+    }
+    auto [normalized, transformation] = normalize_position(position.my_stones, position.opponent_stones, manager);
+    position.my_stones = std::get<0>(normalized);
+    position.opponent_stones = std::get<1>(normalized);
+    for (auto& link : position.links) {
+        if (link.move < 64) {
+            link.move = static_cast<uint8_t>(normalize_move(link.move, transformation, manager));
+        }
+    }
+    if (position.leaf.move < 64) {
+        position.leaf.move = static_cast<uint8_t>(normalize_move(position.leaf.move, transformation, manager));
+    }
+    update_derived_evals(position);
+    return true;
+}
+
+// moveの例外処理と関数二つの呼び出し
+std::tuple<Position, std::string> create_position_data(PositionManager& manager, int move) {
+    std::string move_str, new_kifu;
+
+    if (move == 64) {  // パス
+        move_str = "Pass";
+        new_kifu = manager.current_kifu + move_str;
+        manager.debug_log("Pass move detected. New kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
+
+        // パスの場合はflip_stonesと同様の処理を行うが、石の反転は行わない
+        Position child_position;
+        child_position.my_stones = manager.current_position.opponent_stones;
+        child_position.opponent_stones = manager.current_position.my_stones;
+        child_position.eval_value = -manager.current_position.eval_value;  // 評価値を反転
+
+        // 返値: 新しいポジション、更新された棋譜のタプル
+        return std::make_tuple(child_position, new_kifu);
+    }
+    // ここに65が来ることはあり得ないはず
+    else if (move == 65) {  // 無効な手
+        move_str = "None";
+        new_kifu = manager.current_kifu + move_str;
+        manager.debug_log("Invalid move (None) detected. Terminating program. New kifu: " + new_kifu, PositionManager::LogLevel::ERROR);
+        // プログラムを終了
+        std::exit(1);
+    }
+    // 二つの関数を呼び出して子ポジションを実際に作るところ
+    std::tie(move_str, new_kifu) = convert_move_to_str(move, manager.current_kifu, manager);
+
+    Position child_position = flip_stones(manager.current_position, move_str);
+    child_position.links.clear();
+
+    // 返値: 手を表す文字列、更新された棋譜のタプル
+    return std::make_tuple(child_position, new_kifu);
+}
+// moveを a1 のような文字列に変換する
+std::string move_to_str(int move) {
+    char col = 'a' + (move % 8);
+    int row = (move / 8) + 1;
+    return std::string(1, col) + std::to_string(row);
+}
+
+// moveを棋譜に変換する
+std::tuple<std::string, std::string> convert_move_to_str(int move, const std::string& kifu, PositionManager& manager) {
+    std::string move_str = move_to_str(move);
+
+    // 棋譜を更新
+    std::string previous_kifu = kifu.empty() ? manager.current_kifu : kifu;
+    std::string new_kifu = previous_kifu + move_str;
+    manager.debug_log("Updated kifu: " + new_kifu, PositionManager::LogLevel::DEBUG);
+
+    manager.current_kifu = new_kifu;
+    return std::make_tuple(move_str, new_kifu);
+}
+
+// グローバル変数として定義
+constexpr uint64_t direction_mask[8] = {
+    0xfefefefefefefefe, 0x7f7f7f7f7f7f7f7f,
+    0xffffffffffffffff, 0xffffffffffffffff,
+    0x7f7f7f7f7f7f7f7f, 0xfefefefefefefefe,
+    0xfefefefefefefefe, 0x7f7f7f7f7f7f7f7f
+};
+// ビットシフト
+inline uint64_t shift(uint64_t b, int dir) {
+    switch (dir) {
+    case 0: return (b << 1) & direction_mask[0];
+    case 1: return (b >> 1) & direction_mask[1];
+    case 2: return b << 8;
+    case 3: return b >> 8;
+    case 4: return (b << 7) & direction_mask[4];
+    case 5: return (b >> 7) & direction_mask[5];
+    case 6: return (b << 9) & direction_mask[6];
+    case 7: return (b >> 9) & direction_mask[7];
+    default: return 0;
+    }
+}
+//　1方向ひっくり返し
+inline uint64_t flip_line(uint64_t player, uint64_t opponent, int dir, uint64_t move) {
+    uint64_t mask = shift(move, dir) & opponent;
+    mask |= shift(mask, dir) & opponent;
+    mask |= shift(mask, dir) & opponent;
+    mask |= shift(mask, dir) & opponent;
+    mask |= shift(mask, dir) & opponent;
+    mask |= shift(mask, dir) & opponent;
+    uint64_t outflank = shift(mask, dir) & player;
+    return outflank ? mask : 0;
+}
+//　全方向ひっくり返し
+inline uint64_t flip_all_directions(uint64_t player, uint64_t opponent, uint64_t move) {
+    return flip_line(player, opponent, 0, move) |
+        flip_line(player, opponent, 1, move) |
+        flip_line(player, opponent, 2, move) |
+        flip_line(player, opponent, 3, move) |
+        flip_line(player, opponent, 4, move) |
+        flip_line(player, opponent, 5, move) |
+        flip_line(player, opponent, 6, move) |
+        flip_line(player, opponent, 7, move);
+}
+// 合法手の一覧 (ビットボード)
+inline uint64_t get_legal_moves(uint64_t player, uint64_t opponent) {
+    uint64_t empty = ~(player | opponent);
+    uint64_t legal_moves = 0;
+    for (int dir = 0; dir < 8; ++dir) {
+        uint64_t candidates = shift(player, dir) & opponent;
+        candidates |= shift(candidates, dir) & opponent;
+        candidates |= shift(candidates, dir) & opponent;
+        candidates |= shift(candidates, dir) & opponent;
+        candidates |= shift(candidates, dir) & opponent;
+        candidates |= shift(candidates, dir) & opponent;
+        legal_moves |= shift(candidates, dir) & empty;
+    }
+    return legal_moves;
+}
+//　ひっくり返し関数本体
+Position flip_stones(const Position& position, const std::string& move_str) {
+    uint64_t my_stones = position.my_stones;
+    uint64_t opponent_stones = position.opponent_stones;
+
+    // 打つ手の変換
+    int move_index = ((8 * (8 - (move_str[1] - '0'))) + (7 - static_cast<int>(move_str[0]) + 'a'));
+    uint64_t move = 1ULL << move_index;
+
+    // 石のひっくり返し
+    uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move);
+    my_stones |= move | flipped;
+    opponent_stones ^= flipped;
+
+    // 返値: 石を裏返した後の新しいポジション
+    return Position{ opponent_stones, my_stones, {}, {0, 0, false}, static_cast<int8_t>(-position.eval_value) };
+}
+
+//　デルタ関数　これが早いらしい
+template<uint64_t Mask, int Delta>
+constexpr uint64_t delta_swap(uint64_t x) {
+    uint64_t t = (x ^ (x >> Delta)) & Mask;
+    return x ^ t ^ (t << Delta);
+}
+//　コンパイル時に処理してくれて早くなるらしい
+constexpr uint64_t flip_horizontal(uint64_t x) {
+    return delta_swap<0x5555555555555555ULL, 1>(
+        delta_swap<0x3333333333333333ULL, 2>(
+            delta_swap<0x0F0F0F0F0F0F0F0FULL, 4>(x)
+        )
+    );
+}
+
+constexpr uint64_t flip_vertical(uint64_t x) {
+    return delta_swap<0x00000000FFFFFFFFULL, 32>(
+        delta_swap<0x0000FFFF0000FFFFULL, 16>(
+            delta_swap<0x00FF00FF00FF00FFULL, 8>(x)
+        )
+    );
+}
+
+constexpr uint64_t flip_diag_a1h8(uint64_t x) {
+    return delta_swap<0x00000000F0F0F0F0ULL, 28>(
+        delta_swap<0x0000CCCC0000CCCCULL, 14>(
+            delta_swap<0x00AA00AA00AA00AAULL, 7>(x)
+        )
+    );
+}
+
+constexpr uint64_t flip_diag_a8h1(uint64_t x) {
+    return delta_swap<0x000000000F0F0F0FULL, 36>(
+        delta_swap<0x0000333300003333ULL, 18>(
+            delta_swap<0x0055005500550055ULL, 9>(x)
+        )
+    );
+}
+
+constexpr uint64_t rotate_90(uint64_t x) {
+    return flip_horizontal(flip_diag_a1h8(x));
+}
+
+constexpr uint64_t rotate_270(uint64_t x) {
+    return flip_vertical(flip_diag_a1h8(x));
+}
+
+constexpr uint64_t rotate_180(uint64_t x) {
+    return flip_vertical(flip_horizontal(x));
+}
+
+//　変換名から盤面を変換する　normalize_positionで選ばれた変換を後から再現する用
+uint64_t transform_board(uint64_t x, const std::string& transformation_name) {
+    if (transformation_name == "rotate_90") return rotate_90(x);
+    if (transformation_name == "rotate_180") return rotate_180(x);
+    if (transformation_name == "rotate_270") return rotate_270(x);
+    if (transformation_name == "flip_vertical") return flip_vertical(x);
+    if (transformation_name == "flip_horizontal") return flip_horizontal(x);
+    if (transformation_name == "flip_diag_a1h8") return flip_diag_a1h8(x);
+    if (transformation_name == "flip_diag_a8h1") return flip_diag_a8h1(x);
+    return x;  // identity
+}
+
+// 正規化後のキーだけが欲しい場合用　ログも変換名も無しなのでスレッドから呼んでも大丈夫
+std::pair<uint64_t, uint64_t> normalize_key(uint64_t my_stones, uint64_t opponent_stones) {
+    std::pair<uint64_t, uint64_t> min_value(my_stones, opponent_stones);
+    auto check = [&](uint64_t (*transform)(uint64_t)) {
+        std::pair<uint64_t, uint64_t> transformed(transform(my_stones), transform(opponent_stones));
+        if (transformed < min_value) {
+            min_value = transformed;
+        }
+    };
+    check(rotate_90);
+    check(rotate_180);
+    check(rotate_270);
+    check(flip_vertical);
+    check(flip_horizontal);
+    check(flip_diag_a1h8);
+    check(flip_diag_a8h1);
+    return min_value;
+}
+
+// 変換の番号と名前　normalize_keyと同じ順
+const char* const symmetry_names[8] = {
+    "identity", "rotate_90", "rotate_180", "rotate_270", "flip_vertical", "flip_horizontal", "flip_diag_a1h8", "flip_diag_a8h1"
+};
+
+// 変換の番号ごとの盤面の変換 (0の恒等変換は無し)
+uint64_t (*const symmetry_transforms[8])(uint64_t) = {
+    nullptr, rotate_90, rotate_180, rotate_270, flip_vertical, flip_horizontal, flip_diag_a1h8, flip_diag_a8h1
+};
+
+// normalize_keyの変換の番号版　ログを出さないのでスレッドから呼んでも大丈夫
+// 対称な盤面で最小になる変換が複数ある場合は番号の小さい方 (normalize_positionの変換名とは違うことがある)
+int normalize_symmetry(uint64_t my_stones, uint64_t opponent_stones) {
+    std::pair<uint64_t, uint64_t> min_value(my_stones, opponent_stones);
+    int symmetry = 0;
+    for (int i = 1; i < 8; ++i) {
+        std::pair<uint64_t, uint64_t> transformed(symmetry_transforms[i](my_stones), symmetry_transforms[i](opponent_stones));
+        if (transformed < min_value) {
+            min_value = transformed;
+            symmetry = i;
+        }
+    }
+    return symmetry;
+}
+
+// 盤面を変えない変換 (盤面の対称性) を変換の番号のビットで返す　ほとんどの盤面は0
+uint8_t symmetry_stabilizer(uint64_t my_stones, uint64_t opponent_stones) {
+    uint8_t stabilizer = 0;
+    for (int i = 1; i < 8; ++i) {
+        if (symmetry_transforms[i](my_stones) == my_stones && symmetry_transforms[i](opponent_stones) == opponent_stones) {
+            stabilizer |= static_cast<uint8_t>(1u << i);
+        }
+    }
+    return stabilizer;
+}
+
+// 変換の番号で手を変換する　パスとnoneはそのまま
+int transform_move(int move, int symmetry) {
+    if (move >= 64) {
+        return move;
+    }
+    switch (symmetry) {
+    case 1: return rotate_move_90(move);
+    case 2: return rotate_move_180(static_cast<uint8_t>(move));
+    case 3: return rotate_move_270(move);
+    case 4: return flip_move_vertical(move);
+    case 5: return flip_move_horizontal(move);
+    case 6: return flip_move_diag_a1h8(move);
+    case 7: return flip_move_diag_a8h1(move);
+    default: return move;
+    }
+}
+
+// 対称な盤面で手が同じ仲間か (stabilizerのどれかの変換でfromがtoになる)
+bool symmetric_moves(int from, int to, uint8_t stabilizer) {
+    for (int i = 1; i < 8; ++i) {
+        if ((stabilizer & (1u << i)) && transform_move(from, i) == to) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//　正規化とはこれのこと　これのせいで散々苦労したその1
+std::tuple<std::tuple<uint64_t, uint64_t>, std::string> normalize_position(uint64_t my_stones, uint64_t opponent_stones, PositionManager& manager) {
+    std::tuple<uint64_t, uint64_t> min_value = std::make_tuple(my_stones, opponent_stones);
+    std::string min_transformation = "identity";
+
+    //　変換用辞書
+    const std::unordered_map<std::string, std::function<uint64_t(uint64_t)>> transformations = {
+        {"rotate_90", rotate_90},
+        {"rotate_180", rotate_180},
+        {"rotate_270", rotate_270},
+        {"flip_vertical", flip_vertical},
+        {"flip_horizontal", flip_horizontal},
+        {"flip_diag_a1h8", flip_diag_a1h8},
+        {"flip_diag_a8h1", flip_diag_a8h1}
+    };
+
+    //　最小の64bit値を出す変換がどれか調べて最小値への変換を採用
+    for (const auto& [name, transform] : transformations) {
+        uint64_t transformed_my_stones = transform(my_stones);
+        uint64_t transformed_opponent_stones = transform(opponent_stones);
+        if (std::make_tuple(transformed_my_stones, transformed_opponent_stones) < min_value) {
+            min_value = std::make_tuple(transformed_my_stones, transformed_opponent_stones);
+            min_transformation = name;
+        }
+    }
+
+    //　デバッグログを出力するのに整形処理がいる
+    std::stringstream ss;
+    ss << "Final min transformation: " << min_transformation
+        << ", min_value: (my_stones=0x" << std::hex << std::setw(16) << std::setfill('0') << std::get<0>(min_value)
+        << ", opponent_stones=0x" << std::hex << std::setw(16) << std::setfill('0') << std::get<1>(min_value) << ")";
+    manager.debug_log(ss.str(), PositionManager::LogLevel::DEBUG);
+
+    // 返値: 正規化された盤面（自分の石、相手の石のタプル）と変換名のタプル
+    return std::make_tuple(min_value, min_transformation);
+}
+
+//　move値の正規化処理　結局必要になってしまった ここにpassがいくことはある　noneはないはずなのでエラー出力して落とそう
+int normalize_move(int move, const std::string& transformation_name, PositionManager& manager) {
+    manager.debug_log("Normalizing move: " + std::to_string(move) + ", using transformation: " + transformation_name, PositionManager::LogLevel::DEBUG);
+
+    if (move == 64) {  // パス
+        manager.debug_log("At normalize move is a pass, returning move unchanged.", PositionManager::LogLevel::DEBUG);
+        return move;
+    }
+    else if (move == 65) {  // 無効な手
+        manager.debug_log("Invalid move (None) detected. Terminating program.", PositionManager::LogLevel::ERROR);
+        std::exit(1);  // プログラムを終了
+    }
+    //　かたくなにunorderd mapしか使わない
+    const std::unordered_map<std::string, std::function<int(int)>> transformations = {
+        {"identity", [](int x) { return x; }},
+        {"rotate_90", rotate_move_90},
+        {"rotate_180", rotate_move_180},
+        {"rotate_270", rotate_move_270},
+        {"flip_vertical", flip_move_vertical},
+        {"flip_horizontal", flip_move_horizontal},
+        {"flip_diag_a1h8", flip_move_diag_a1h8},
+        {"flip_diag_a8h1", flip_move_diag_a8h1}
+    };
+    //　move値の正規化処理　ここも前で何を使った記憶しておけば十分
+    const auto& transform = transformations.at(transformation_name);
+
+    // 返値: 正規化された手の値
+    return transform(move);
+}
+
+//　非正規化があるのはmove値のみ ここにnoneが行くことはあるので落としてはいけない。全消し時とか
+int denormalize_move(int move, const std::string& transformation_name, PositionManager& manager) {
+    manager.debug_log("Denormalizing move: " + std::to_string(move) + ", using transformation: " + transformation_name, PositionManager::LogLevel::DEBUG);
+
+    if (move == 64) {
+        manager.debug_log("At denormalize move is a pass, returning move unchanged.", PositionManager::LogLevel::DEBUG);
+        return move;
+    }
+    else if (move == 65) {
+        manager.debug_log("Move is invalid (none), returning move unchanged.", PositionManager::LogLevel::DEBUG);
+        return move;
+    }
+
+    //　逆変換用辞書
+    const std::unordered_map<std::string, std::function<int(int)>> reverse_transformations = {
+        {"identity", [](int x) { return x; }},
+        {"rotate_90", rotate_move_270},
+        {"rotate_180", rotate_move_180},
+        {"rotate_270", rotate_move_90},
+        {"flip_vertical", flip_move_vertical},
+        {"flip_horizontal", flip_move_horizontal},
+        {"flip_diag_a1h8", flip_move_diag_a1h8},
+        {"flip_diag_a8h1", flip_move_diag_a8h1}
+    };
+
+    //　前回使った正規化関数を覚えておいて、その逆変換関数を使用
+    const auto& reverse_transform = reverse_transformations.at(transformation_name);
+    return reverse_transform(move);
+}
+
+//　move値変換関数
+inline int rotate_move_90(int move) {
+    return (move % 8) * 8 + (7 - move / 8);
+}
+
+inline int rotate_move_270(int move) {
+    return (7 - move % 8) * 8 + move / 8;
+}
+
+inline int flip_move_vertical(int move) {
+    return (7 - move / 8) * 8 + move % 8;
+}
+
+inline int flip_move_horizontal(int move) {
+    return (move / 8) * 8 + (7 - move % 8);
+}
+
+inline int flip_move_diag_a1h8(int move) {
+    return (move % 8) * 8 + (move / 8);
+}
+
+inline int flip_move_diag_a8h1(int move) {
+    return (7 - move % 8) * 8 + (7 - move / 8);
+}
+
+//　bookを読む関数はこんなところに
+// lookup_workersの場合は手元に無ければワーカーに問い合わせる　book_imageの場合は手元に無ければイメージから作る
+// book_indexの場合は手元に無ければ索引で引いてbook.datから読む
+const Position* read_position(uint64_t my_stones, uint64_t opponent_stones) {
+    if (book_image) {
+        return book_image->read(std::make_pair(my_stones, opponent_stones));
+    }
+    if (book_index) {
+        return book_index->read(std::make_pair(my_stones, opponent_stones));
+    }
+    auto it = book_positions.find(std::make_pair(my_stones, opponent_stones));
+    if (it != book_positions.end()) {
+        return &(it->second);
+    }
+    return remote_lookup ? remote_lookup->fetch(std::make_pair(my_stones, opponent_stones)) : nullptr;
+}
+
+// 逆引きの索引から、正規化したポジションを子ポジションに持つ親ポジションと手、変換名をdebuglogに表示する
+void log_parent_positions(uint64_t my_stones, uint64_t opponent_stones, PositionManager& manager) {
+    std::pair<uint64_t, uint64_t> child_key = normalize_key(my_stones, opponent_stones);
+    auto [first, last] = book_parent_index.find(child_key);
+    std::stringstream ss;
+    ss << "Parent positions: " << (last - first);
+    for (size_t i = first; i < last; ++i) {
+        const ParentIndex::Entry& entry = book_parent_index.entries[i];
+        const Position* parent = read_position(entry.parent_key.first, entry.parent_key.second);
+        ss << "\n  Parent - My stones: 0x" << std::hex << std::setw(16) << std::setfill('0') << entry.parent_key.first
+            << ", Opponent stones: 0x" << std::setw(16) << entry.parent_key.second << std::dec
+            << ", Move: " << (entry.move == 64 ? std::string("Pass") : move_to_str(entry.move))
+            << ", Symmetry: " << symmetry_names[entry.symmetry];
+        if (parent) {
+            ss << ", Parent eval: " << static_cast<int>(parent->eval_value)
+                << ", Move eval: " << static_cast<int>(calculate_parent_eval(*parent, entry.move, manager));
+        }
+    }
+    manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
+}
+
+// 棋譜を並べた途中のポジションの木 (トライ)　同じ手順で始まる棋譜は共通の部分を並べ直さず、bookも引き直さない
+// 関連する棋譜をまとめて調べる場合は、棋譜の数ではなく違う手の数だけ並べればよい
+// 節が max_nodes に達したら、次の棋譜の前に初期局面だけに戻す
+// book_imageなどではレコードを読んだ後に捨てるので、節にはレコードへのポインタではなく表示に使う値を写しておく
+class KifuReplayCache {
+public:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    // 手を打って、打てる手が無ければパスもした後のポジション (次に打つ側から見た石) と、bookから引いた結果
+    struct Node {
+        uint64_t my_stones;
+        uint64_t opponent_stones;
+        bool found;              // 正規化したポジションがbookにあったか　無ければ下の3つは0
+        int8_t eval_value;
+        uint32_t game_count;
+        uint8_t link_count;
+        uint32_t first_child;
+        uint32_t next_sibling;
+        uint8_t move;
+        bool passed;             // この手の前にパスがあった
+    };
+
+    explicit KifuReplayCache(size_t max_nodes) : max_nodes(std::max<size_t>(max_nodes, 2)) {
+        reset();
+    }
+
+    // 棋譜を並べて手ごとの節の番号をpliesに入れる　読めない手や打てない手があればfalse (pliesにはその前の手まで入る)
+    bool replay(const std::string& kifu, std::vector<uint32_t>& plies) {
+        plies.clear();
+        if (nodes.size() + kifu.size() / 2 > max_nodes) {
+            reset();
+        }
+        uint32_t current = 0;
+        for (size_t i = 0; i < kifu.size(); i += 2) {
+            if (i + 1 >= kifu.size()) {
+                return false;
+            }
+            char col = kifu[i], row = kifu[i + 1];
+            if (col < 'a' || col > 'h' || row < '1' || row > '8') {
+                return false;
+            }
+            uint8_t move = static_cast<uint8_t>((row - '1') * 8 + (col - 'a'));
+            uint32_t child = nodes[current].first_child;
+            while (child != none && nodes[child].move != move) {
+                child = nodes[child].next_sibling;
+            }
+            if (child != none) {
+                reused_moves++;
+            }
+            else {
+                child = add_child(current, move);
+                if (child == none) {
+                    return false;
+                }
+                replayed_moves++;
+            }
+            plies.push_back(child);
+            current = child;
+        }
+        return true;
+    }
+
+    const Node& node(uint32_t index) const {
+        return nodes[index];
+    }
+
+    size_t replayed_moves = 0;  // 並べて bookを引いた手の数
+    size_t reused_moves = 0;    // 木にあったので並べなかった手の数
+
+private:
+    void reset() {
+        nodes.clear();
+        nodes.push_back({ 0x0000000810000000ULL, 0x0000001008000000ULL, false, 0, 0, 0, none, none, 0, false });
+        find_record(nodes[0]);
+    }
+
+    // 打てる手が無いポジションはパスした後の向きでbookに入っていることもある
+    static void find_record(Node& node) {
+        std::pair<uint64_t, uint64_t> key = normalize_key(node.my_stones, node.opponent_stones);
+        const Position* record = read_position(key.first, key.second);
+        if (!record && get_legal_moves(node.my_stones, node.opponent_stones) == 0) {
+            key = normalize_key(node.opponent_stones, node.my_stones);
+            record = read_position(key.first, key.second);
+        }
+        if (record) {
+            node.found = true;
+            node.eval_value = record->eval_value;
+            node.game_count = record->game_count;
+            node.link_count = static_cast<uint8_t>(record->links.size());
+        }
+    }
+
+    uint32_t add_child(uint32_t parent, uint8_t move) {
+        uint64_t my_stones = nodes[parent].my_stones, opponent_stones = nodes[parent].opponent_stones;
+        bool passed = false;
+        if (get_legal_moves(my_stones, opponent_stones) == 0) {
+            std::swap(my_stones, opponent_stones);
+            passed = true;
+        }
+        uint64_t move_bit = 1ULL << (63 - move);
+        if (!(get_legal_moves(my_stones, opponent_stones) & move_bit)) {
+            return none;
+        }
+        uint64_t flipped = flip_all_directions(my_stones, opponent_stones, move_bit);
+        Node child{ opponent_stones ^ flipped, my_stones | move_bit | flipped, false, 0, 0, 0, none, nodes[parent].first_child, move, passed };
+        find_record(child);
+        uint32_t index = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(child);
+        nodes[parent].first_child = index;
+        return index;
+    }
+
+    size_t max_nodes;
+    std::vector<Node> nodes;
+};
+
+// mode 5 の棋譜の行　手ごとのポジションをbookから引いてdebuglogに表示する
+void log_kifu_plies(std::string kifu, KifuReplayCache& cache, PositionManager& manager) {
+    std::transform(kifu.begin(), kifu.end(), kifu.begin(), [](unsigned char c) { return std::tolower(c); });
+    std::vector<uint32_t> plies;
+    bool valid = cache.replay(kifu, plies);
+    std::stringstream ss;
+    ss << "Kifu: " << kifu;
+    for (size_t i = 0; i < plies.size(); ++i) {
+        const KifuReplayCache::Node& node = cache.node(plies[i]);
+        ss << "\n  " << (i + 1) << " " << (node.passed ? "Pass " : "") << move_to_str(node.move) << " - ";
+        if (node.found) {
+            ss << "Eval: " << static_cast<int>(node.eval_value) << ", Games: " << node.game_count
+                << ", Links: " << static_cast<int>(node.link_count);
+        }
+        else {
+            ss << "Not found";
+        }
+    }
+    if (!valid) {
+        ss << "\n  Invalid move at " << (plies.size() + 1);
+    }
+    manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
+}
+
+// 主にデバッグ用 mode5で動作。特定のポジション情報をbookから読み込んでdebuglogに表示するだけ
+// 1列だけの行は棋譜として、手ごとのポジションを表示する
+void read_specified_positions(const std::string& input_file_path, PositionManager& manager, const ToolConfig& config) {
+    std::ifstream input_file(input_file_path);
+    if (!input_file.is_open()) {
+        manager.debug_log("Failed to open input file: " + input_file_path, PositionManager::LogLevel::ERROR);
+        return;
+    }
+    // ファイルの読み込み
+    KifuReplayCache replay_cache(config.kifu_cache_nodes);
+    std::string line;
+    while (std::getline(input_file, line)) {
+        std::istringstream iss(line);
+        std::string my_position_str, opponent_position_str;
+
+        if (!(iss >> my_position_str >> opponent_position_str)) {
+            if (!my_position_str.empty()) {
+                log_kifu_plies(my_position_str, replay_cache, manager);
+                continue;
+            }
+            manager.debug_log("Invalid line format: " + line, PositionManager::LogLevel::ERROR);
+            continue;
+        }
+        // 各行ごとに盤面情報の取得
+        uint64_t my_position, opponent_position;
+        try {
+            my_position = std::stoull(my_position_str, nullptr, 16);
+            opponent_position = std::stoull(opponent_position_str, nullptr, 16);
+        }
+        catch (const std::exception& e) {
+            manager.debug_log("Error parsing hex values: " + line + " - " + e.what(), PositionManager::LogLevel::ERROR);
+            continue;
+        }
+        // bookから読んでくる
+        const Position* position = read_position(my_position, opponent_position);
+        if (position) {
+            std::stringstream ss;
+            ss << "Position found - My stones: " << my_position_str
+                << ", Opponent stones: " << opponent_position_str
+                << "\n" << format_position(*position);
+            manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
+        }
+        else {
+            std::stringstream ss;
+            ss << "Position not found - My stones: " << my_position_str
+                << ", Opponent stones: " << opponent_position_str;
+            manager.debug_log(ss.str(), PositionManager::LogLevel::ERROR);
+        }
+
+        // 逆引きの索引があれば、このポジションを子ポジションに持つ親ポジションと手も出す
+        if (book_parent_index.built) {
+            log_parent_positions(my_position, opponent_position, manager);
+        }
+    }
+
+    input_file.close();
+    if (replay_cache.replayed_moves > 0) {
+        manager.debug_log("Kifu moves replayed: " + std::to_string(replay_cache.replayed_moves) + ", reused from shared prefixes: " + std::to_string(replay_cache.reused_moves), PositionManager::LogLevel::INFO);
+    }
+}
+
+// mode 13: bookを1回だけ読み込んで問い合わせに答え続けるデーモン　mode 5のように調べるたびにbookを読み込まなくてよい
+// 問い合わせは1行1件 (応答はJSONで1件1行)
+//   key <自分の石 16進> <相手の石 16進>   keyは省略可 (specified_positions.txtと同じ形式)
+//   kifu <棋譜>                          初期局面から並べたポジション
+//   plies <棋譜>                         棋譜の手ごとのポジションの評価値など　途中のポジションは接続ごとの木に覚えておく
+//   batch <件数>                         続く件数分の行にまとめて答えて、最後に1回だけ書き出す
+//   quit                                 終わり
+// 応答の石と手は問い合わせの向き、canonical_*はbookの正規化した向き　ログを出さないので複数の接続のスレッドから呼んでも大丈夫
+
+// JSONの文字列に入れられるようにする
+std::string json_escape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            escaped += ' ';
+        }
+        else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+std::string query_hex(uint64_t stones) {
+    std::stringstream ss;
+    ss << "0x" << std::hex << std::setw(16) << std::setfill('0') << stones;
+    return ss.str();
+}
+
+// 応答の手の表記　パスは"pass"
+std::string query_move(int move) {
+    return move == 64 ? std::string("pass") : move_to_str(move);
+}
+
+// ポジションをbookから引いて1件分の応答を書く
+void write_query_position(std::ostream& out, const std::string& query, const std::string& input, uint64_t my_stones, uint64_t opponent_stones) {
+    std::pair<uint64_t, uint64_t> key = normalize_key(my_stones, opponent_stones);
+    int symmetry = normalize_symmetry(my_stones, opponent_stones);
+    int inverse = symmetry == 1 ? 3 : symmetry == 3 ? 1 : symmetry;  // 正規化した向きの手を問い合わせの向きに戻す変換
+    const Position* record = read_position(key.first, key.second);
+
+    out << "{\"query\":\"" << query << "\",\"input\":\"" << json_escape(input) << "\",\"found\":" << (record ? "true" : "false")
+        << ",\"my_stones\":\"" << query_hex(my_stones) << "\",\"opponent_stones\":\"" << query_hex(opponent_stones)
+        << "\",\"canonical_my_stones\":\"" << query_hex(key.first) << "\",\"canonical_opponent_stones\":\"" << query_hex(key.second)
+        << "\",\"symmetry\":\"" << symmetry_names[symmetry] << "\"";
+    if (record) {
+        out << ",\"eval\":" << static_cast<int>(record->eval_value) << ",\"games\":" << record->game_count << ",\"links\":[";
+        for (size_t i = 0; i < record->links.size(); ++i) {
+            out << (i ? "," : "") << "{\"move\":\"" << query_move(transform_move(record->links[i].move, inverse))
+                << "\",\"eval\":" << static_cast<int>(record->links[i].eval_link) << "}";
+        }
+        out << "],\"leaf\":";
+        if (is_usable_leaf(record->leaf)) {
+            out << "{\"move\":\"" << query_move(transform_move(record->leaf.move, inverse)) << "\",\"eval\":" << static_cast<int>(record->leaf.eval) << "}";
+        }
+        else {
+            out << "null";
+        }
+    }
+    // 逆引きの索引があれば親ポジションも (親の手は親ポジションの正規化した向き)
+    if (book_parent_index.built) {
+        auto [first, last] = book_parent_index.find(key);
+        out << ",\"parents\":[";
+        for (size_t i = first; i < last; ++i) {
+            const ParentIndex::Entry& entry = book_parent_index.entries[i];
+            out << (i > first ? "," : "") << "{\"canonical_my_stones\":\"" << query_hex(entry.parent_key.first)
+                << "\",\"canonical_opponent_stones\":\"" << query_hex(entry.parent_key.second) << "\",\"move\":\"" << query_move(entry.move) << "\"}";
+        }
+        out << "]";
+    }
+    out << "}\n";
+}
+
+void write_query_error(std::ostream& out, const std::string& query, const std::string& input, const std::string& error) {
+    out << "{\"query\":\"" << query << "\",\"input\":\"" << json_escape(input) << "\",\"error\":\"" << error << "\"}\n";
+}
+
+// plies の応答　手ごとに bookにあるか、評価値、対局数　パスした手は"pass":true
+void write_query_plies(std::ostream& out, const std::string& kifu, KifuReplayCache& cache) {
+    std::vector<uint32_t> plies;
+    bool valid = cache.replay(kifu, plies);
+    out << "{\"query\":\"plies\",\"input\":\"" << json_escape(kifu) << "\",\"plies\":[";
+    for (size_t i = 0; i < plies.size(); ++i) {
+        const KifuReplayCache::Node& node = cache.node(plies[i]);
+        out << (i ? "," : "") << "{\"move\":\"" << move_to_str(node.move) << "\"";
+        if (node.passed) {
+            out << ",\"pass\":true";
+        }
+        out << ",\"found\":" << (node.found ? "true" : "false");
+        if (node.found) {
+            out << ",\"eval\":" << static_cast<int>(node.eval_value) << ",\"games\":" << node.game_count;
+        }
+        out << "}";
+    }
+    out << "]";
+    if (!valid) {
+        out << ",\"error\":\"invalid move at " << (plies.size() + 1) << "\"";
+    }
+    out << "}\n";
+}
+
+// 1件分の問い合わせに答える　batchの場合は続く行も読む　quitならfalse
+bool answer_query_line(const std::string& line, std::istream& in, std::ostream& out, KifuReplayCache& cache) {
+    std::istringstream iss(line);
+    std::string command;
+    if (!(iss >> command) || command[0] == '#') {
+        return true;  // 空行とコメントは無視
+    }
+    if (command == "quit" || command == "exit") {
+        return false;
+    }
+    if (command == "batch") {
+        size_t count = 0;
+        if (!(iss >> count)) {
+            write_query_error(out, "batch", line, "invalid count");
+            return true;
+        }
+        std::string batch_line;
+        for (size_t i = 0; i < count && std::getline(in, batch_line); ++i) {
+            if (!batch_line.empty() && batch_line.back() == '\r') {
+                batch_line.pop_back();
+            }
+            std::istringstream batch_iss(batch_line);
+            std::string batch_command;
+            if (batch_iss >> batch_command && (batch_command == "batch" || batch_command == "quit" || batch_command == "exit")) {
+                write_query_error(out, batch_command, batch_line, "not allowed in batch");
+                continue;
+            }
+            answer_query_line(batch_line, in, out, cache);
+        }
+        return true;
+    }
+    if (command == "plies") {
+        std::string kifu;
+        iss >> kifu;
+        std::transform(kifu.begin(), kifu.end(), kifu.begin(), [](unsigned char c) { return std::tolower(c); });
+        write_query_plies(out, kifu, cache);
+        return true;
+    }
+    if (command == "kifu") {
+        std::string kifu;
+        iss >> kifu;
+        std::transform(kifu.begin(), kifu.end(), kifu.begin(), [](unsigned char c) { return std::tolower(c); });
+        uint64_t my_stones, opponent_stones;
+        if (!replay_kifu(kifu, my_stones, opponent_stones)) {
+            write_query_error(out, "kifu", kifu, "invalid kifu");
+            return true;
+        }
+        // 最後に打てる手が無い場合はbookにはパスした後のポジションで入っていることもある
+        std::pair<uint64_t, uint64_t> key = normalize_key(my_stones, opponent_stones);
+        if (!read_position(key.first, key.second) && get_legal_moves(my_stones, opponent_stones) == 0) {
+            std::swap(my_stones, opponent_stones);
+        }
+        write_query_position(out, "kifu", kifu, my_stones, opponent_stones);
+        return true;
+    }
+
+    // keyは省略できるので、先頭が16進ならそのまま石として読む
+    std::string my_text, opponent_text;
+    if (command == "key") {
+        iss >> my_text >> opponent_text;
+    }
+    else {
+        my_text = command;
+        iss >> opponent_text;
+    }
+    try {
+        size_t my_end = 0, opponent_end = 0;
+        uint64_t my_stones = std::stoull(my_text, &my_end, 16);
+        uint64_t opponent_stones = std::stoull(opponent_text, &opponent_end, 16);
+        if (my_end != my_text.size() || opponent_end != opponent_text.size()) {
+            throw std::invalid_argument("trailing characters");
+        }
+        write_query_position(out, "key", my_text + " " + opponent_text, my_stones, opponent_stones);
+    }
+    catch (const std::exception&) {
+        write_query_error(out, "key", line, "invalid query");
+    }
+    return true;
+}
+
+// 入力が終わるかquitまで1行ずつ答える　1件 (batchは全部) 答えるたびに書き出す
+void serve_queries(std::istream& in, std::ostream& out, size_t kifu_cache_nodes) {
+    KifuReplayCache cache(kifu_cache_nodes);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!answer_query_line(line, in, out, cache)) {
+            break;
+        }
+        out.flush();
+    }
+    out.flush();
+}
+
+// 標準入出力の場合は読み込みの表示などを標準エラーに回してあるので、応答はresponse_bufferに書く
+// query_socketの場合は接続ごとにスレッドを作って答える　止める時はCtrl+Cなど
+void query_daemon_process(std::streambuf* response_buffer, PositionManager& manager, const ToolConfig& config) {
+    size_t positions = book_image ? book_image->position_count() : book_index ? book_index->position_count() : book_positions.size();
+    std::string ready = "{\"ready\":true,\"positions\":" + std::to_string(positions) + "}\n";
+    if (config.query_socket.empty()) {
+        std::ostream out(response_buffer);
+        manager.debug_log("Query daemon ready on stdin/stdout", PositionManager::LogLevel::INFO);
+        out << ready << std::flush;
+        serve_queries(std::cin, out, config.kifu_cache_nodes);
+        return;
+    }
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    std::error_code remove_error;
+    std::filesystem::remove(config.query_socket, remove_error);  // 前回のソケットのファイルが残っているとbindできない
+#ifdef SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);  // 問い合わせた側が先に閉じても落ちないように
+#endif
+    boost::asio::io_context io;
+    boost::asio::local::stream_protocol::acceptor acceptor(io, boost::asio::local::stream_protocol::endpoint(config.query_socket));
+    std::cout << "Query daemon listening on " << config.query_socket << " (" << positions << " positions)" << std::endl;
+    manager.debug_log("Query daemon listening on " + config.query_socket, PositionManager::LogLevel::INFO);
+    while (true) {
+        boost::asio::local::stream_protocol::socket socket(io);
+        acceptor.accept(socket);
+        std::thread([socket = std::move(socket), ready, kifu_cache_nodes = config.kifu_cache_nodes]() mutable {
+            boost::asio::local::stream_protocol::iostream stream(std::move(socket));
+            stream << ready << std::flush;
+            serve_queries(stream, stream, kifu_cache_nodes);
+        }).detach();
+    }
+#else
+    manager.debug_log("query_socket is not supported on this platform", PositionManager::LogLevel::ERROR);
+    std::cerr << "Error: query_socket needs Unix domain sockets, which this build does not support." << std::endl;
+    std::exit(1);
+#endif
+}
+
+// メイン関数　ファイルパスの指定とコンフィグ読み込み→book読み込み→メイン関数読み込み
+int main(int argc, char* argv[]) {
+    std::string book_path = "book.dat";
+    std::string debug_log_path = "debuglog.txt";
+    std::string output_path = "mismatched_positions.txt";
+    std::string config_path = "config.ini";
+    std::string specified_positions_path = "specified_positions.txt";
+    std::string corrected_book_path = "book_corrected.dat";
+    std::string compacted_book_path = "book_compacted.dat";
+    std::string diff_output_path = "book_diff.txt";
+
+    try {
+        ToolConfig config = read_config(config_path);
+        int mode = config.mode;
+
+        // コマンドライン引数　--resume でmode 1～4, 6 の探索をチェックポイントから続ける
+        // --plan-shards で複数のプロセスに分ける計画を作り、--shard <ファイル> でそのシャードだけ判定し、--merge-shards でまとめる
+        // --lookup-worker <番号> でbookの一部を持って問い合わせに答えるワーカーになる
+        // --publish-image でbookのイメージを book_image に書き出し、--remove-image で消す
+        // --build-index でbook.datの索引を book_index に作る
+        for (int i = 1; i < argc; ++i) {
+            std::string argument = argv[i];
+            if (argument == "--resume") {
+                config.resume = true;
+            }
+            else if (argument == "--plan-shards") {
+                config.plan_shards = true;
+            }
+            else if (argument == "--merge-shards") {
+                config.merge_shards = true;
+            }
+            else if (argument == "--shard" && i + 1 < argc) {
+                config.shard_file = argv[++i];
+            }
+            else if (argument == "--lookup-worker" && i + 1 < argc) {
+                config.lookup_worker = std::stoi(argv[++i]);
+            }
+            else if (argument == "--publish-image") {
+                config.publish_image = true;
+            }
+            else if (argument == "--remove-image") {
+                config.remove_image = true;
+            }
+            else if (argument == "--build-index") {
+                config.build_index = true;
+            }
+        }
+
+        // シャードの判定は出力とデバッグログの名前にシャードの名前を付けて、同じフォルダで並べて動かせるようにする
+        if (!config.shard_file.empty()) {
+            if (!read_shard_file(config.shard_file, config)) {
+                std::cerr << "Error: Failed to read shard file: " << config.shard_file << std::endl;
+                return 1;
+            }
+            std::string shard_name = "_" + std::filesystem::path(config.shard_file).stem().string();
+            output_path = add_path_suffix(output_path, shard_name);
+            debug_log_path = add_path_suffix(debug_log_path, shard_name);
+        }
+        if (config.lookup_worker >= 0) {
+            debug_log_path = add_path_suffix(debug_log_path, "_lookup_worker_" + std::to_string(config.lookup_worker));
+        }
+        PositionManager manager(book_path, debug_log_path, config.log_level, config.auto_adjust, config.adjusted_level);
+
+        if (mode < 1 || mode > 13) {
+            std::cerr << "Error: Invalid mode (" << mode << "). Mode must be between 1 and 13." << std::endl;
+            manager.debug_log("Invalid mode: " + std::to_string(mode), PositionManager::LogLevel::ERROR);
+            return 1;  // エラーコードを返して終了
+        }
+
+        // mode 6, 12 の場合はまとめて判定するmodeも確認する　同じmodeが2回あっても出力先が重なるだけなので除く
+        if (mode == 6 || mode == 12) {
+            std::sort(config.multi_modes.begin(), config.multi_modes.end());
+            config.multi_modes.erase(std::unique(config.multi_modes.begin(), config.multi_modes.end()), config.multi_modes.end());
+            if (config.multi_modes.empty() || config.multi_modes.front() < 1 || config.multi_modes.back() > 4) {
+                std::cerr << "Error: Invalid multi_modes. Each mode must be between 1 and 4." << std::endl;
+                manager.debug_log("Invalid multi_modes setting", PositionManager::LogLevel::ERROR);
+                return 1;
+            }
+        }
+
+        // ワーカーは自分の分のレコードを読み込んで問い合わせに答えるだけ
+        if (config.lookup_worker >= 0) {
+            if (static_cast<size_t>(config.lookup_worker) >= config.lookup_workers) {
+                std::cerr << "Error: --lookup-worker must be less than lookup_workers (" << config.lookup_workers << ")." << std::endl;
+                manager.debug_log("Invalid lookup worker index: " + std::to_string(config.lookup_worker), PositionManager::LogLevel::ERROR);
+                return 1;
+            }
+            serve_lookup_worker(book_path, static_cast<size_t>(config.lookup_worker), manager, config);
+            return 0;
+        }
+
+        if ((config.publish_image || config.remove_image) && config.book_image.empty()) {
+            std::cerr << "Error: Set book_image in config.ini to publish or remove a book image." << std::endl;
+            return 1;
+        }
+        if (config.remove_image) {
+            remove_book_image(config.book_image, manager);
+            return 0;
+        }
+        if (config.build_index) {
+            if (config.book_index.empty()) {
+                std::cerr << "Error: Set book_index in config.ini to build a book index." << std::endl;
+                return 1;
+            }
+            build_book_index(config.book_index, book_path, manager);
+            return 0;
+        }
+
+        // シャードの出力をまとめるだけならbookは読まない
+        if (config.merge_shards) {
+            merge_shard_outputs(output_path, manager, config);
+            return 0;
+        }
+
+        // mode 13 を標準入出力で使う場合は、標準出力を応答だけにするため読み込みの表示などは標準エラーに回す
+        std::streambuf* query_response_buffer = std::cout.rdbuf();
+        if (mode == 13 && config.query_socket.empty()) {
+            std::cout.rdbuf(std::cerr.rdbuf());
+        }
+
+        // streaming_checkならmode 1～4 はmapを作らずに判定する
+        if (config.streaming_check && !config.plan_shards && config.shard_file.empty()) {
+            if (streaming_check_supported(config)) {
+                streaming_check_process(book_path, output_path, manager, config);
+                return 0;
+            }
+            std::cout << "streaming_check supports only mode 1-4 and 6. Running the normal mode." << std::endl;
+            manager.debug_log("streaming_check ignored: mode " + std::to_string(mode) + " is not a mismatch check", PositionManager::LogLevel::WARNING);
+        }
+
+        // mode 11 はmapを作らずに2つのbookを流し読みして比べる
+        if (mode == 11) {
+            diff_books(config.diff_book, book_path, diff_output_path, manager, config);
+            return 0;
+        }
+
+        // bookのイメージを書き出すだけ
+        if (config.publish_image) {
+            load_all_positions(book_path, manager);
+            publish_book_image(config.book_image, book_path, manager);
+            return 0;
+        }
+
+        // lookup_workersを設定した場合はbookを読まずに、要るレコードだけワーカーに問い合わせる
+        // bookを全部見るmodeやシャードの計画はできないので、辿ったポジションだけを読むmode 1～6だけ
+        // book_imageも同じで、mode 1～6, 13 はイメージを割り当てて使うレコードだけ作る　それ以外のmodeは普段通り読み込む
+        // book_indexも同じで、イメージが無ければ索引を割り当ててbook.datから使うレコードだけ読む
+        // lazy_decodeなら索引のファイルが無くても起動時にメモリに索引を作って同じように使う
+        std::unique_ptr<RemoteLookup> lookup;
+        std::unique_ptr<BookImage> image;
+        std::unique_ptr<BookIndex> index;
+        if (config.lookup_workers > 0) {
+            if (mode > 6 || config.plan_shards) {
+                std::cerr << "Error: lookup_workers supports only mode 1-6 without --plan-shards." << std::endl;
+                manager.debug_log("lookup_workers is not supported with mode " + std::to_string(mode) + " or --plan-shards", PositionManager::LogLevel::ERROR);
+                return 1;
+            }
+            lookup = std::make_unique<RemoteLookup>(config, manager);
+            remote_lookup = lookup.get();
+        }
+        else if (!config.book_image.empty() && (mode <= 6 || mode == 13) && !config.plan_shards) {
+            image = BookImage::attach(config.book_image, book_path, mode != 5 && mode != 13, manager);
+            if (image) {
+                book_image = image.get();
+                std::cout << "Book image attached: " << config.book_image << " (" << image->position_count() << " positions)" << std::endl;
+                manager.debug_log("Book image attached: " + config.book_image, PositionManager::LogLevel::INFO);
+            }
+            else if (config.book_index.empty() && !config.lazy_decode) {
+                std::cout << "Book image not available. Loading the book." << std::endl;
+            }
+        }
+        if (!remote_lookup && !book_image && !config.book_index.empty() && (mode <= 6 || mode == 13) && !config.plan_shards) {
+            index = BookIndex::attach(config.book_index, book_path, mode != 5 && mode != 13, manager);
+            if (index) {
+                book_index = index.get();
+                std::cout << "Book index attached: " << config.book_index << " (" << index->position_count() << " positions)" << std::endl;
+                manager.debug_log("Book index attached: " + config.book_index, PositionManager::LogLevel::INFO);
+            }
+            else if (!config.lazy_decode) {
+                std::cout << "Book index not available. Loading the book." << std::endl;
+            }
+        }
+        if (!remote_lookup && !book_image && !book_index && config.lazy_decode && (mode <= 6 || mode == 13) && !config.plan_shards) {
+            index = BookIndex::build(book_path, mode != 5 && mode != 13, manager);
+            if (index) {
+                book_index = index.get();
+                manager.debug_log("Book index built in memory: " + std::to_string(index->position_count()) + " positions", PositionManager::LogLevel::INFO);
+            }
+        }
+        if (!remote_lookup && !book_image && !book_index) {
+            load_all_positions(book_path, manager);
+        }
+        if (config.plan_shards) {
+            plan_shards(manager, config);
+            return 0;
+        }
+        if (config.parent_index && !remote_lookup && !book_image && !book_index) {
+            prepare_parent_index(book_path, manager, config);
+        }
+
+        switch (mode) {
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+        case 6:
+            main_process(output_path, manager, config);
+            break;
+        case 5:
+            read_specified_positions(specified_positions_path, manager, config);
+            break;
+        case 7:
+            negamax_process(output_path, manager, config);
+            break;
+        case 8:
+            write_corrected_book(book_path, corrected_book_path, manager, config);
+            break;
+        case 9:
+            reachability_process(manager, config);
+            break;
+        case 10:
+            compact_book(book_path, compacted_book_path, manager, config);
+            break;
+        case 12:
+            incremental_check_process(output_path, manager, config);
+            break;
+        case 13:
+            query_daemon_process(query_response_buffer, manager, config);
+            break;
+        }
+        if (lookup) {
+            lookup->report();
+            remote_lookup = nullptr;
+        }
+        if (image) {
+            std::cout << image->decoded_count << " Records decoded from book image (" << image->peak_records() << " records held at most)" << std::endl;
+            manager.debug_log("Records decoded from book image: " + std::to_string(image->decoded_count.load()), PositionManager::LogLevel::WARNING);
+            book_image = nullptr;
+        }
+        if (index) {
+            std::cout << index->decoded_count << " Records decoded from book index (" << index->peak_records() << " records held at most)" << std::endl;
+            manager.debug_log("Records decoded from book index: " + std::to_string(index->decoded_count.load()), PositionManager::LogLevel::WARNING);
+            book_index = nullptr;
+        }
+        std::cout.rdbuf(query_response_buffer);
+    }
+    catch (const std::exception& e) {
+        // エラーメッセージをデバッグログに出力
+        PositionManager manager("", "debuglog.txt");  // 一時的なmanagerオブジェクトを作成
+        manager.debug_log("Critical error in main: " + std::string(e.what()), PositionManager::LogLevel::ERROR);
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    // 返値　虚無
+    return 0;
+}